@@ -3,18 +3,125 @@
 
 Game* CreateGame() { return new Benchmark(); }
 
+// set to 1 to measure inline ray batch queries instead of rendering performance
+#define BATCHBENCHMARK	0
+#define BATCHSIZE		(1024 * 1024)
+// set to 1 to measure World::Set throughput in the world write modes instead
+#define SETBENCHMARK	0
+#define SETREGION		256
+// set to 1 to measure random Get/Set and CPU trace throughput, and random brick access with
+// and without huge pages / parallel first touch (see HUGEPAGES and NUMAPLACEMENT in world.h)
+#define MEMBENCHMARK	0
+#define MEMSTORESIZE	(256 << 20)
+// set to 1 to check IsRegionEmpty, CountSolid, FindFirstSolid and RegionColors against
+// brute-force Read loops over random boxes, and to compare their speed
+#define QUERYBENCHMARK	0
+#define QUERYCOUNT		2000
+// set to 1 to check ranged TraceRay and TraceOcclusion against a voxel walk with Read,
+// including ranges that start beyond the point where the ray leaves the map
+#define RANGEBENCHMARK	0
+#define RANGECOUNT		20000
+// set to 1 to check SpriteHit against a voxel-by-voxel comparison of the sprite frames
+#define SPRITEHITBENCHMARK	0
+// set to 1 to check SpriteWorldHit and SweepSprite against Read on the sprite voxels
+#define WORLDHITBENCHMARK	0
+
 uint sprite, frame = 0;
+static float3 sphereCenter[500];
+
+// reference for the ranged ray queries: walk the voxels along the ray, from an origin inside
+// the map; the first solid voxel that the ray leaves after tmin is hit at max( entry, tmin )
+static uint RangedReference( const float3 O, const float3 D, const float tmin, const float tmax, float& dist )
+{
+	int3 p = make_int3( (int)O.x, (int)O.y, (int)O.z );
+	const int3 step = make_int3( D.x > 0 ? 1 : -1, D.y > 0 ? 1 : -1, D.z > 0 ? 1 : -1 );
+	const float3 delta = make_float3( fabs( 1 / D.x ), fabs( 1 / D.y ), fabs( 1 / D.z ) );
+	float3 next = make_float3( (D.x > 0 ? p.x + 1 - O.x : O.x - p.x) * delta.x, (D.y > 0 ? p.y + 1 - O.y : O.y - p.y) * delta.y,
+		(D.z > 0 ? p.z + 1 - O.z : O.z - p.z) * delta.z );
+	float t = 0;
+	dist = 1e34f;
+	while (p.x >= 0 && p.y >= 0 && p.z >= 0 && p.x < MAPWIDTH && p.y < MAPHEIGHT && p.z < MAPDEPTH && t <= tmax)
+	{
+		const float exit = min( next.x, min( next.y, next.z ) );
+		if (exit > tmin) if (const uint v = Read( p ))
+		{
+			if (max( t, tmin ) > tmax) return 0;
+			dist = max( t, tmin );
+			return v;
+		}
+		t = exit;
+		if (t == next.x) next.x += delta.x, p.x += step.x;
+		else if (t == next.y) next.y += delta.y, p.y += step.y;
+		else next.z += delta.z, p.z += step.z;
+	}
+	return 0;
+}
+
+// reference for the sprite collision checks: do the opaque voxels of two sprites overlap
+static bool FramesOverlap( const uint A, const uint B )
+{
+	auto& s = SpriteManager::GetSpriteManager()->sprite;
+	const SpriteFrame* fA = s[A]->frame[s[A]->currFrame], * fB = s[B]->frame[s[B]->currFrame];
+	const int3 offset = s[A]->currPos - s[B]->currPos;
+	for (int z = 0; z < fA->size.z; z++) for (int y = 0; y < fA->size.y; y++) for (int x = 0; x < fA->size.x; x++)
+	{
+		if (!fA->buffer[x + y * fA->size.x + z * fA->size.x * fA->size.y]) continue;
+		const int3 p = make_int3( x, y, z ) + offset;
+		if (p.x < 0 || p.y < 0 || p.z < 0 || p.x >= fB->size.x || p.y >= fB->size.y || p.z >= fB->size.z) continue;
+		if (fB->buffer[p.x + p.y * fB->size.x + p.z * fB->size.x * fB->size.y]) return true;
+	}
+	return false;
+}
+
+// reference for the sprite / world checks: does an opaque voxel of the sprite at 'pos' cover a
+// solid world voxel. With 'underProp', the terrain saved before a resident sprite was drawn
+// replaces the world in the saved box, so that sprite's own voxels do not count.
+static int3 savedMin, savedSize;
+static vector<uint> savedTerrain;
+static bool FrameHitsWorld( const uint idx, const int3 pos, const bool underProp = false )
+{
+	auto& s = SpriteManager::GetSpriteManager()->sprite;
+	const SpriteFrame* f = s[idx]->frame[s[idx]->currFrame];
+	for (int z = 0; z < f->size.z; z++) for (int y = 0; y < f->size.y; y++) for (int x = 0; x < f->size.x; x++)
+	{
+		if (!f->buffer[x + y * f->size.x + z * f->size.x * f->size.y]) continue;
+		const int3 p = pos + make_int3( x, y, z ), q = p - savedMin;
+		if (p.x < 0 || p.y < 0 || p.z < 0 || p.x >= MAPWIDTH || p.y >= MAPHEIGHT || p.z >= MAPDEPTH) continue;
+		const bool saved = underProp && q.x >= 0 && q.y >= 0 && q.z >= 0 && q.x < savedSize.x && q.y < savedSize.y && q.z < savedSize.z;
+		if (saved ? savedTerrain[q.x + q.y * savedSize.x + q.z * savedSize.x * savedSize.y] : Read( p )) return true;
+	}
+	return false;
+}
+static bool SweepReference( const uint idx, const int3 pos, const int3 delta, int3& reached, const bool underProp = false )
+{
+	// SweepSprite, one FrameHitsWorld per step along the longest axis
+	const int steps = max( abs( delta.x ), max( abs( delta.y ), abs( delta.z ) ) );
+	reached = pos;
+	for (int j = 1; j <= steps; j++)
+	{
+		const float3 p = make_float3( pos ) + make_float3( delta ) * ((float)j / steps);
+		const int3 step = make_int3( (int)floorf( p.x + 0.5f ), (int)floorf( p.y + 0.5f ), (int)floorf( p.z + 0.5f ) );
+		if (FrameHitsWorld( idx, step, underProp )) return true;
+		reached = step;
+	}
+	return false;
+}
 
 // -----------------------------------------------------------
 // Initialize the application
 // -----------------------------------------------------------
 void Benchmark::Init()
 {
+#if BATCHBENCHMARK == 0 && SETBENCHMARK == 0 && MEMBENCHMARK == 0 && QUERYBENCHMARK == 0 && RANGEBENCHMARK == 0 && SPRITEHITBENCHMARK == 0 && WORLDHITBENCHMARK == 0
 #if GIRAYS > 0
 	FatalError( "Disable GIRAYS and TAA for an accurate performance measurement." );
 #endif
 #if TAA > 0
 	FatalError( "Disable TAA and GIRAYS for an accurate performance measurement." );
+#endif
+#else
+	// disable automatic rendering: we will spawn our own rays, or measure Set / memory access / queries
+	autoRendering = false;
 #endif
     ClearWorld();
 	uint colors[] = { RED, GREEN, BLUE, YELLOW, LIGHTRED, LIGHTBLUE, WHITE };
@@ -25,19 +132,415 @@ void Benchmark::Init()
 		int z = RandomUInt() % 800 + 100;
 		int r = RandomUInt() % 20 + 20;
 		Sphere( (float)x, (float)y, (float)z, (float)r, colors[RandomUInt() % (sizeof( colors ) / 4)] );
+		sphereCenter[i] = make_float3( (float)x, (float)y, (float)z );
 	}
     LookAt( make_float3( 20, 20, 20 ), make_float3( 512, 512, 512 ) );
 }
 
+// -----------------------------------------------------------
+// Ray batch benchmark: solid-to-void queries from inside the
+// spheres, validated against the CPU traversal. The same rays
+// are traced in submission order and reordered for coherence;
+// the reordered timing includes the sort.
+// -----------------------------------------------------------
+void Benchmark::TraceToVoidBatch()
+{
+	const uint batch = NewBatch( BATCHSIZE ), sortedBatch = NewBatch( BATCHSIZE );
+	Ray* rays = GetBatchBuffer( batch );
+	for (int i = 0; i < BATCHSIZE; i++)
+	{
+		const float3 R = normalize( make_float3( RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f ) );
+		rays[i].O = sphereCenter[i % 500] + R * (RandomFloat() * 10);
+		rays[i].D = R;
+		rays[i].t = 1e34f;
+	}
+	memcpy( GetBatchBuffer( sortedBatch ), rays, BATCHSIZE * sizeof( Ray ) );
+	Timer t;
+	SubmitBatchToVoid( batch, BATCHSIZE );
+	Intersection* result = GetBatchResults( batch );
+	const float elapsed = t.elapsed();
+	t.reset();
+	SubmitBatchToVoid( sortedBatch, BATCHSIZE, true /* reorder */ );
+	Intersection* sortedResult = GetBatchResults( sortedBatch );
+	const float elapsedSorted = t.elapsed();
+	// verify a subset of the results on the CPU, and all reordered results
+	int mismatches = 0, orderMismatches = 0;
+	for (int i = 0; i < 1024; i++)
+	{
+		Intersection ref = TraceToVoid( rays[i] );
+		if (fabs( ref.GetDistance() - result[i].GetDistance() ) > 0.01f || ref.N != result[i].N) mismatches++;
+	}
+	for (int i = 0; i < BATCHSIZE; i++)
+		if (result[i].t != sortedResult[i].t || result[i].N != sortedResult[i].N) orderMismatches++;
+	FreeBatch( batch );
+	FreeBatch( sortedBatch );
+	static float smoothed = 0, smoothedSorted = 0, frameIdx = 0;
+	const float Mrays = BATCHSIZE / 1000000.0f;
+	if (++frameIdx < 10) smoothed = Mrays / elapsed, smoothedSorted = Mrays / elapsedSorted; else
+		smoothed = 0.95f * smoothed + 0.05f * Mrays / elapsed,
+		smoothedSorted = 0.95f * smoothedSorted + 0.05f * Mrays / elapsedSorted;
+	printf( "to-void batch: %4.2fms (%4.1fMrays/s), reordered: %4.2fms (%4.1fMrays/s, %+.1f%%), %i/1024 mismatches, %i reorder mismatches\n",
+		elapsed * 1000, smoothed, elapsedSorted * 1000, smoothedSorted, 100.0f * (smoothedSorted / smoothed - 1), mismatches, orderMismatches );
+}
+
+// -----------------------------------------------------------
+// Set benchmark: fill a SETREGION^3 block with a new color
+// in each world write mode, on one thread and in parallel
+// over brick-aligned slabs. Timings include merging the
+// per-thread dirty lists of WRITE_PARTITIONED.
+// -----------------------------------------------------------
+void Benchmark::SetThroughput()
+{
+	World* world = GetWorld();
+	const uint mode[4] = { World::WRITE_SHARED, World::WRITE_SINGLE, World::WRITE_SHARED, World::WRITE_PARTITIONED };
+	const uint color[4] = { RED, GREEN, BLUE, YELLOW };
+	static float smoothed[4], frameIdx = 0;
+	frameIdx++;
+	for (int i = 0; i < 4; i++)
+	{
+		auto slabs = [&]( uint first, uint last )
+		{
+			for (uint z = first * BRICKDIM; z < last * BRICKDIM; z++)
+				for (uint y = 0; y < SETREGION; y++) for (uint x = 0; x < SETREGION; x++) world->Set( x, y, z, color[i] );
+		};
+		Timer t;
+		world->SetWriteMode( mode[i] );
+		if (i < 2) slabs( 0, SETREGION / BRICKDIM );
+		else TaskScheduler::Get()->ParallelFor( 0, SETREGION / BRICKDIM, 1, slabs );
+		world->SetWriteMode( World::WRITE_SHARED );
+		const float Mvoxels = SETREGION * SETREGION * SETREGION / 1000000.0f / t.elapsed();
+		smoothed[i] = frameIdx < 10 ? Mvoxels : (0.95f * smoothed[i] + 0.05f * Mvoxels);
+	}
+	printf( "Set, 1 thread: shared %4.1fMvoxels/s, single %4.1fMvoxels/s; %i threads: shared %4.1fMvoxels/s, partitioned %4.1fMvoxels/s\n",
+		smoothed[0], smoothed[1], TaskScheduler::Get()->GetNumThreads(), smoothed[2], smoothed[3] );
+}
+
+// -----------------------------------------------------------
+// Memory benchmark: random Get, Set and CPU traces through the
+// world, which uses the allocation options set in world.h;
+// then random brick reads and writes in a MEMSTORESIZE store
+// for each allocation option, to compare them in one run.
+// -----------------------------------------------------------
+void Benchmark::MemoryThroughput()
+{
+	World* world = GetWorld();
+	const uint N = 1 << 22;
+	static uint3* pos = 0;
+	if (!pos)
+	{
+		pos = new uint3[N];
+		for (uint i = 0; i < N; i++) pos[i] = make_uint3( RandomUInt() % 800 + 100, RandomUInt() % 800 + 100, RandomUInt() % 800 + 100 );
+	}
+	Timer t;
+	uint sum = 0;
+	for (uint i = 0; i < N; i++) sum += world->Get( pos[i].x, pos[i].y, pos[i].z );
+	const float tGet = t.elapsed();
+	t.reset();
+	world->SetWriteMode( World::WRITE_SINGLE );
+	for (uint i = 0; i < N; i++) world->Set( pos[i].x, pos[i].y, pos[i].z, world->Get( pos[i].x, pos[i].y, pos[i].z ) );
+	world->SetWriteMode( World::WRITE_SHARED );
+	const float tSet = t.elapsed();
+	t.reset();
+	const uint R = 1 << 18;
+	atomic<uint> hits{ 0 };
+	TaskScheduler::Get()->ParallelFor( 0, R, 1024, [&]( uint first, uint last )
+	{
+		uint seed = first * 7919 + 1, h = 0;
+		for (uint i = first; i < last; i++)
+		{
+			Ray r;
+			r.O = make_float3( 512, 512, 512 );
+			r.D = normalize( make_float3( RandomFloat( seed ) - 0.5f, RandomFloat( seed ) - 0.5f, RandomFloat( seed ) - 0.5f ) );
+			r.t = 1e34f;
+			h += Trace( r ).GetVoxel() != 0;
+		}
+		hits += h;
+	} );
+	const float tTrace = t.elapsed();
+	printf( "world (%iKB brick pages): Get %4.1fM/s, Set %4.1fM/s, CPU trace %4.2fMrays/s (%u %u)\n", (int)(world->GetBrickPageSize() >> 10),
+		N / 1000000.0f / tGet, N / 1000000.0f / tSet, R / 1000000.0f / tTrace, sum & 1, hits.load() );
+	// the same access pattern on a separate store, per allocation option
+	const uint flags[4] = { 0, LARGE_HUGEPAGES, LARGE_PARALLELTOUCH, LARGE_HUGEPAGES | LARGE_PARALLELTOUCH };
+	const char* name[4] = { "regular", "huge", "touch", "huge+touch" };
+	const uint bricks = MEMSTORESIZE / (BRICKSIZE * PAYLOADSIZE);
+	for (int j = 0; j < 4; j++)
+	{
+		size_t page;
+		PAYLOAD* store = (PAYLOAD*)LargeAlloc( MEMSTORESIZE, flags[j], &page );
+		if (!store) continue;
+		if (!(flags[j] & LARGE_PARALLELTOUCH)) memset( store, 0, MEMSTORESIZE );
+		uint seed = 0x12345, s = 0;
+		t.reset();
+		for (uint i = 0; i < N; i++) s += store[(RandomUInt( seed ) % bricks) * BRICKSIZE + (i & (BRICKSIZE - 1))];
+		const float tRead = t.elapsed();
+		t.reset();
+		for (uint i = 0; i < N; i++) store[(RandomUInt( seed ) % bricks) * BRICKSIZE + (i & (BRICKSIZE - 1))] = (PAYLOAD)i;
+		const float tWrite = t.elapsed();
+		LargeFree( store );
+		printf( "  %-10s (%7iKB pages): random brick reads %5.1fM/s, writes %5.1fM/s (%u)\n", name[j], (int)(page >> 10), N / 1000000.0f / tRead, N / 1000000.0f / tWrite, s & 1 );
+	}
+}
+
+// -----------------------------------------------------------
+// Region query benchmark: random boxes, partly outside the
+// world, over the spheres with holes punched in them so the
+// brick summaries are stale supersets. Each query is checked
+// against a Read loop; FindFirstSolid must return the first
+// voxel in the order y (down), z, x.
+// -----------------------------------------------------------
+void Benchmark::RegionQueries()
+{
+	World* world = GetWorld();
+	static bool holes = false;
+	if (!holes)
+	{
+		for (int i = 0; i < 200000; i++) Plot( RandomUInt() % 800 + 100, RandomUInt() % 800 + 100, RandomUInt() % 800 + 100, 0 );
+		for (int i = 0; i < 20000; i++) Plot( RandomUInt() % 800 + 100, RandomUInt() % 800 + 100, RandomUInt() % 800 + 100, GREEN );
+		holes = true;
+	}
+	int badEmpty = 0, badCount = 0, badFirst = 0, badColors = 0, nonEmpty = 0;
+	float tQuery = 0, tBrute = 0;
+	for (int i = 0; i < QUERYCOUNT; i++)
+	{
+		const int3 bmin = make_int3( RandomUInt() % 1060, RandomUInt() % 1060, RandomUInt() % 1060 ) - 18;
+		const int3 bmax = bmin + make_int3( RandomUInt() % 48, RandomUInt() % 48, RandomUInt() % 48 );
+		Timer t;
+		int3 pos;
+		const bool empty = world->IsRegionEmpty( bmin, bmax ), found = world->FindFirstSolid( bmin, bmax, pos );
+		const uint count = world->CountSolid( bmin, bmax ), colors = world->RegionColors( bmin, bmax );
+		tQuery += t.elapsed();
+		t.reset();
+		uint refCount = 0, refColors = 0;
+		int3 refPos = make_int3( -1 );
+		for (int y = bmax.y - 1; y >= bmin.y; y--) for (int z = bmin.z; z < bmax.z; z++) for (int x = bmin.x; x < bmax.x; x++)
+		{
+			const uint v = (x >= 0 && y >= 0 && z >= 0 && x < MAPWIDTH && y < MAPHEIGHT && z < MAPDEPTH) ? Read( x, y, z ) : 0;
+			if (!v) continue;
+			if (!refCount++) refPos = make_int3( x, y, z );
+			refColors |= 1 << ColorBucket( v );
+		}
+		tBrute += t.elapsed();
+		nonEmpty += refCount > 0;
+		if (empty != (refCount == 0)) badEmpty++;
+		if (count != refCount) badCount++;
+		if (found != (refCount > 0) || (found && (pos.x != refPos.x || pos.y != refPos.y || pos.z != refPos.z))) badFirst++;
+		if ((colors & refColors) != refColors) badColors++;
+	}
+	printf( "region queries: %4.2fms, brute force %4.2fms (%i of %i boxes solid); mismatches: empty %i, count %i, first %i, colors %i\n",
+		tQuery * 1000, tBrute * 1000, nonEmpty, QUERYCOUNT, badEmpty, badCount, badFirst, badColors );
+}
+
+// -----------------------------------------------------------
+// Ranged query benchmark: random rays from inside the map with
+// a random [tmin..tmax] range, half of which starts beyond the
+// map exit. Solid walls on the map border make a traversal that
+// clamps such a start back into the map report a false hit.
+// Results are compared with RangedReference.
+// -----------------------------------------------------------
+void Benchmark::RangedQueries()
+{
+	World* world = GetWorld();
+	static bool walls = false;
+	if (!walls)
+	{
+		Box( MAPWIDTH - 8, 0, 0, MAPWIDTH, MAPHEIGHT / 2, MAPDEPTH, WHITE );
+		Box( 0, 0, 0, MAPWIDTH / 2, 8, MAPDEPTH, WHITE );
+		Box( 0, MAPHEIGHT - 8, MAPDEPTH / 2, MAPWIDTH, MAPHEIGHT, MAPDEPTH, WHITE );
+		walls = true;
+	}
+	int badHit = 0, badOcclusion = 0, hits = 0, beyondExit = 0;
+	float tRay = 0, tOcclusion = 0;
+	for (int i = 0; i < RANGECOUNT; i++)
+	{
+		const float3 O = make_float3( RandomFloat() * MAPWIDTH, RandomFloat() * MAPHEIGHT, RandomFloat() * MAPDEPTH ) * 0.9999f;
+		const float3 D = normalize( make_float3( RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f ) );
+		const float ex = max( -O.x / D.x, (MAPWIDTH - O.x) / D.x ), ey = max( -O.y / D.y, (MAPHEIGHT - O.y) / D.y );
+		const float ez = max( -O.z / D.z, (MAPDEPTH - O.z) / D.z ), exit = min( ex, min( ey, ez ) );
+		const float tmin = exit * RandomFloat() * 2, tmax = tmin + RandomFloat() * 400;
+		beyondExit += tmin >= exit;
+		float dist, refDist;
+		float3 N;
+		Timer t;
+		const uint v = world->TraceRay( make_float4( O, 0 ), make_float4( D, 0 ), dist, N, tmin, tmax );
+		tRay += t.elapsed();
+		t.reset();
+		const bool occluded = world->TraceOcclusion( make_float4( O, 0 ), make_float4( D, 0 ), tmin, tmax );
+		tOcclusion += t.elapsed();
+		const uint ref = RangedReference( O, D, tmin, tmax, refDist );
+		hits += ref != 0;
+		// the traversal restarts at A + tmin * D in float precision: allow for some rounding far out
+		if (v != ref || (ref && fabs( dist - refDist ) > 0.1f)) badHit++;
+		if (occluded != (ref != 0)) badOcclusion++;
+	}
+	printf( "ranged queries: TraceRay %4.2fms, TraceOcclusion %4.2fms (%i hits, %i of %i ranges beyond the exit); mismatches: ray %i, occlusion %i\n",
+		tRay * 1000, tOcclusion * 1000, hits, beyondExit, RANGECOUNT, badHit, badOcclusion );
+}
+
+// -----------------------------------------------------------
+// Sprite overlap benchmark: SpriteHit on pairs of sprites at
+// random offsets, compared with FramesOverlap. The sprites
+// are a hollow 64^3 ball, a sparse 130 voxel wide slab that
+// spans three 64-bit planes, and a 5x7x3 block that has fewer
+// than four rows. One in four offsets puts the overlap at a
+// multiple of 64, where the bit shift of A and/or B is 0.
+// -----------------------------------------------------------
+void Benchmark::SpriteOverlap()
+{
+	static uint shape[3] = { 0 }, seed = 0x5eed;
+	if (!shape[2])
+	{
+		// build the shapes in an empty corner of the world, then clear it again
+		Box( 0, 0, 0, 400, 80, 80, 0 );
+		for (int z = 0; z < 64; z++) for (int y = 0; y < 64; y++) for (int x = 0; x < 64; x++)
+		{
+			const float d = length( make_float3( x - 31.5f, y - 31.5f, z - 31.5f ) );
+			if (d < 31 && d > 27) Plot( x, y, z, RED );
+		}
+		for (int z = 0; z < 10; z++) for (int y = 0; y < 20; y++) for (int x = 0; x < 130; x++)
+			if ((x * 7 + y * 3 + z) % 11 == 0) Plot( 100 + x, y, z, GREEN );
+		Box( 250, 0, 0, 255, 7, 3, BLUE );
+		shape[0] = CreateSprite( 0, 0, 0, 64, 64, 64 );
+		shape[1] = CreateSprite( 100, 0, 0, 130, 20, 10 );
+		shape[2] = CreateSprite( 250, 0, 0, 5, 7, 3 );
+		Box( 0, 0, 0, 400, 80, 80, 0 );
+	}
+	int mismatches = 0, hits = 0;
+	float elapsed = 0;
+	for (int i = 0; i < 3000; i++)
+	{
+		const uint A = shape[i % 3], B = shape[(i / 3) % 3];
+		if (A == B) continue;
+		const int3 sizeA = GetSpriteFrameSize( A ), sizeB = GetSpriteFrameSize( B );
+		int3 offset = make_int3( RandomUInt( seed ) % (sizeA.x + sizeB.x), RandomUInt( seed ) % (sizeA.y + sizeB.y),
+			RandomUInt( seed ) % (sizeA.z + sizeB.z) ) - sizeB;
+		if ((i & 3) == 0) offset.x = (RandomUInt( seed ) & 1) ? -(int)(RandomUInt( seed ) % sizeB.x) : 64 * (int)(RandomUInt( seed ) % (sizeA.x / 64 + 1));
+		MoveSpriteTo( A, 500, 500, 500 );
+		MoveSpriteTo( B, make_int3( 500 ) + offset );
+		Timer t;
+		const bool hitAB = SpriteHit( A, B ), hitBA = SpriteHit( B, A );
+		elapsed += t.elapsed();
+		hits += hitAB;
+		if (hitAB != FramesOverlap( A, B )) mismatches++;
+		if (hitBA != hitAB) mismatches++;
+	}
+	for (int i = 0; i < 3; i++) RemoveSprite( shape[i] ); // out of the way until the next test
+	printf( "SpriteHit: %4.3fus per test, %i hits, %i mismatches\n", elapsed / 4000 * 1e6f, hits, mismatches );
+}
+
+// -----------------------------------------------------------
+// Sprite / world benchmark: SpriteWorldHit at random positions,
+// partly outside the world, and SweepSprite along random
+// paths, compared with FrameHitsWorld. The reference sweep
+// steps along the longest axis with rounding, like SweepSprite.
+// The tested sprite is removed after each Tick, so it is never
+// in the world itself. A second copy is left resident, sunk
+// into the ground, drawn in turn as spans, as bricks and
+// rotated; every third frame it is tested where it stands,
+// against the terrain saved before it was drawn.
+// -----------------------------------------------------------
+void Benchmark::SpriteWorldCollision()
+{
+	static uint shape = 0, prop = 0, phase = 0, seed = 0x5eed;
+	if (!shape)
+	{
+		// a sparse 70x24x24 block, then a ground plane of uniform grid cells under the spheres
+		Box( 0, 0, 0, 80, 30, 30, 0 );
+		for (int z = 0; z < 24; z++) for (int y = 0; y < 24; y++) for (int x = 0; x < 70; x++)
+			if (RandomUInt( seed ) % 10 < 3) Plot( x, y, z, RED );
+		shape = CreateSprite( 0, 0, 0, 70, 24, 24 ) + 1;
+		prop = CloneSprite( shape - 1 );
+		Box( 0, 0, 0, MAPWIDTH, 40, MAPDEPTH, WHITE );
+	}
+	const uint idx = shape - 1;
+	const int3 propPos[3] = { make_int3( 201, 30, 203 ), make_int3( 400, 32, 400 ), make_int3( 601, 30, 597 ) };
+	const int3 home = propPos[(phase / 3) % 3];
+	if (phase % 3 == 0)
+	{
+		// park the resident copy: save the terrain around its spot before Commit draws it there
+		savedMin = home - 40, savedSize = GetSpriteFrameSize( prop ) + 80, savedTerrain.clear();
+		for (int z = 0; z < savedSize.z; z++) for (int y = 0; y < savedSize.y; y++) for (int x = 0; x < savedSize.x; x++)
+			savedTerrain.push_back( Read( savedMin + make_int3( x, y, z ) ) );
+		MoveSpriteTo( prop, home );
+		TransformSprite( prop, (phase / 3) % 3 == 2 ? mat4::RotateY( 0.4f ) : mat4::Identity() );
+	}
+	else if (phase % 3 == 2)
+	{
+		// the copy is resident now (it did not move in the last Commit): test it around its spot, without its own voxels
+		const char* kind[3] = { "spans", "bricks", "rotated" };
+		int residentMismatches = 0, residentHits = 0;
+		for (int i = 0; i < 100; i++)
+		{
+			const int3 pos = home + (i ? make_int3( RandomUInt( seed ) % 25, RandomUInt( seed ) % 25, RandomUInt( seed ) % 25 ) - 12 : make_int3( 0 ));
+			MoveSpriteTo( prop, pos );
+			const bool hit = SpriteWorldHit( prop );
+			residentHits += hit;
+			if (hit != FrameHitsWorld( prop, pos, true )) residentMismatches++;
+			const int3 delta = make_int3( RandomUInt( seed ) % 61, RandomUInt( seed ) % 61, RandomUInt( seed ) % 61 ) - 30;
+			int3 reached, refReached;
+			const bool impact = SweepSprite( prop, delta, reached ), refImpact = SweepReference( prop, pos, delta, refReached, true );
+			if (impact != refImpact || reached.x != refReached.x || reached.y != refReached.y || reached.z != refReached.z) residentMismatches++;
+		}
+		MoveSpriteTo( prop, home ); // unchanged, so it stays resident
+		printf( "resident sprite (%s, resident %i): %i hits in 100 tests, %i mismatches\n", kind[(phase / 3) % 3],
+			(int)SpriteManager::GetSpriteManager()->sprite[prop]->resident, residentHits, residentMismatches );
+	}
+	phase++;
+	int hitMismatches = 0, hits = 0, sweepMismatches = 0, impacts = 0;
+	float tHit = 0, tSweep = 0;
+	for (int i = 0; i < 1000; i++)
+	{
+		const int3 pos = make_int3( RandomUInt( seed ) % 1100, RandomUInt( seed ) % 1100, RandomUInt( seed ) % 1100 ) - 60;
+		MoveSpriteTo( idx, pos );
+		Timer t;
+		const bool hit = SpriteWorldHit( idx );
+		tHit += t.elapsed();
+		hits += hit;
+		if (hit != FrameHitsWorld( idx, pos )) hitMismatches++;
+	}
+	for (int i = 0; i < 50; i++)
+	{
+		const int3 pos = make_int3( RandomUInt( seed ) % 900 + 50, RandomUInt( seed ) % 400 + 300, RandomUInt( seed ) % 900 + 50 );
+		const int3 delta = make_int3( RandomUInt( seed ) % 200 - 100, -(int)(RandomUInt( seed ) % 400), RandomUInt( seed ) % 200 - 100 );
+		MoveSpriteTo( idx, pos );
+		int3 reached;
+		Timer t;
+		const bool impact = SweepSprite( idx, delta, reached );
+		tSweep += t.elapsed();
+		impacts += impact;
+		int3 refReached;
+		const bool refImpact = SweepReference( idx, pos, delta, refReached );
+		if (impact != refImpact || reached.x != refReached.x || reached.y != refReached.y || reached.z != refReached.z) sweepMismatches++;
+	}
+	RemoveSprite( idx );
+	printf( "SpriteWorldHit: %4.2fus per test, %i hits, %i mismatches; SweepSprite: %4.3fms per sweep, %i impacts, %i mismatches\n",
+		tHit * 1000, hits, hitMismatches, tSweep / 50 * 1000, impacts, sweepMismatches );
+}
+
 // -----------------------------------------------------------
 // Main application tick function
 // -----------------------------------------------------------
 void Benchmark::Tick( float deltaTime )
 {
+#if SETBENCHMARK == 1
+	SetThroughput();
+#elif MEMBENCHMARK == 1
+	MemoryThroughput();
+#elif QUERYBENCHMARK == 1
+	RegionQueries();
+#elif RANGEBENCHMARK == 1
+	RangedQueries();
+#elif SPRITEHITBENCHMARK == 1
+	SpriteOverlap();
+#elif WORLDHITBENCHMARK == 1
+	SpriteWorldCollision();
+#elif BATCHBENCHMARK == 1
+	TraceToVoidBatch();
+#else
 	float s = GetRenderTime();
 	int rays = SCRWIDTH * SCRHEIGHT * AA_SAMPLES * AA_SAMPLES /* AA */;
 	float Mrays = rays / 1000000.0f;
 	static float smoothed = 0, frameIdx = 0;
 	if (++frameIdx < 10) smoothed = Mrays / s; else smoothed = 0.95f * smoothed + 0.05f * Mrays / s;
 	printf( "rendering statistics: %4.2fms, %4.1fMrays (%4.1fMrays/s)\n", s * 1000, Mrays, smoothed );
+#endif
 }
\ No newline at end of file
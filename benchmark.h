@@ -9,6 +9,13 @@ public:
 	// game flow methods
 	void Init();
 	void Tick( float deltaTime );
+	void TraceToVoidBatch();
+	void SetThroughput();
+	void MemoryThroughput();
+	void RegionQueries();
+	void RangedQueries();
+	void SpriteOverlap();
+	void SpriteWorldCollision();
 	void Shutdown() { /* implement if you want to do something on exit */ }
 	// input handling
 	void MouseUp( int button ) { /* implement if you want to detect mouse button presses */ }
@@ -26,7 +26,7 @@ float4 render_whitted( const float2 screenPos, __constant struct RenderParams* p
 		// trace primary ray
 		uint side = 0;
 		const float3 D = GenerateCameraRay( screenPos + (float2)((float)u * (1.0f / AA_SAMPLES), (float)v * (1.0f / AA_SAMPLES)), params );
-		const uint voxel = TraceRay( (float4)(params->E, 0), (float4)(D, 1), &dist, &side, grid, uberGrid, BRICKPARAMS, 999999 /* no cap needed */ );
+		const uint voxel = TraceRay( (float4)(params->E, 0), (float4)(D, 1), &dist, &side, grid, uberGrid, BRICKPARAMS );
 		// simple hardcoded directional lighting using arbitrary unit vector
 		if (voxel == 0) return (float4)(SampleSky( (float3)(D.x, D.z, D.y), sky, params->skyWidth, params->skyHeight ), 1e20f);
 		{	// scope limiting
@@ -55,7 +55,7 @@ float4 render_gi( const float2 screenPos, __constant struct RenderParams* params
 	float dist;
 	uint side = 0;
 	const float3 D = GenerateCameraRay( screenPos, params );
-	const uint voxel = TraceRay( (float4)(params->E, 0), (float4)(D, 1), &dist, &side, grid, uberGrid, BRICKPARAMS, 999999 /* no cap needed */ );
+	const uint voxel = TraceRay( (float4)(params->E, 0), (float4)(D, 1), &dist, &side, grid, uberGrid, BRICKPARAMS );
 	const float skyLightScale = params->skyLightScale;
 	// visualize result: simple hardcoded directional lighting using arbitrary unit vector
 	if (voxel == 0) return (float4)(SampleSky( (float3)(D.x, D.z, D.y), sky, params->skyWidth, params->skyHeight ), 1e20f);
@@ -72,7 +72,7 @@ float4 render_gi( const float2 screenPos, __constant struct RenderParams* params
 		const float4 R = (float4)(DiffuseReflectionCosWeighted( r0, r1, N ), 1);
 		uint side2;
 		float dist2;
-		const uint voxel2 = TraceRay( I + 0.1f * (float4)(N, 0), R, &dist2, &side2, grid, uberGrid, BRICKPARAMS, GRIDWIDTH / 12 );
+		const uint voxel2 = TraceRayCapped( I + 0.1f * (float4)(N, 0), R, &dist2, &side2, grid, uberGrid, BRICKPARAMS, GRIDWIDTH / 12 );
 		const float3 N2 = VoxelNormal( side2, R.xyz );
 		if (0 /* for comparing against ground truth */) // get_global_id( 0 ) % SCRWIDTH < SCRWIDTH / 2)
 		{
@@ -222,18 +222,18 @@ __kernel void traceBatch(
 	const float4 O4 = rayData[taskId * 2 + 0];
 	const float4 D4 = rayData[taskId * 2 + 1];
 	// trace ray
-	float3 N;
+	uint side = 0;
 	float dist;
-	const uint voxel = TraceRay( (float4)(O4.x, O4.y, O4.z, 0), (float4)(D4.x, D4.y, D4.z, 1),
-		&dist, &N, grid, uberGrid, BRICKPARAMS, 999999 );
+	const uint voxel = TraceRayRange( (float4)(O4.x, O4.y, O4.z, 0), (float4)(D4.x, D4.y, D4.z, 1),
+		&dist, &side, grid, uberGrid, BRICKPARAMS, 0, O4.w );
 	// store query result
-	hitData[taskId * 2 + 0] = as_uint( dist < O4.w ? dist : 1e34f );
+	hitData[taskId * 2 + 0] = as_uint( dist );
+	const float3 N = VoxelNormal( side, D4.xyz );
 	uint Nval = ((int)N.x + 1) + (((int)N.y + 1) << 2) + (((int)N.z + 1) << 4);
 	hitData[taskId * 2 + 1] = (voxel == 0 ? 0 : Nval) + (voxel << 16);
 }
 
 // traceBatchToVoid: trace a batch of rays to the first empty voxel.
-// TODO: probably broken; needs to be synchronized witht the regular traversal kernel.
 __kernel void traceBatchToVoid(
 	__read_only image3d_t grid,
 	__global const PAYLOAD* brick0, __global const PAYLOAD* brick1,
@@ -249,12 +249,13 @@ __kernel void traceBatchToVoid(
 	const float4 O4 = rayData[taskId * 2 + 0];
 	const float4 D4 = rayData[taskId * 2 + 1];
 	// trace ray
-	float3 N;
+	uint side;
 	float dist;
 	TraceRayToVoid( (float4)(O4.x, O4.y, O4.z, 0), (float4)(D4.x, D4.y, D4.z, 1),
-		&dist, &N, grid, BRICKPARAMS, uberGrid );
+		&dist, &side, grid, uberGrid, BRICKPARAMS );
 	// store query result
 	hitData[taskId * 2 + 0] = as_uint( dist < O4.w ? dist : 1e34f );
+	const float3 N = VoxelNormal( side, D4.xyz );
 	uint Nval = ((int)N.x + 1) + (((int)N.y + 1) << 2) + (((int)N.z + 1) << 4);
 	hitData[taskId * 2 + 1] = Nval;
 }
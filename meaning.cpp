@@ -9,7 +9,10 @@ Creature::Creature( const int idx, const float3& p, const float3& t )
 	position = p, cycle = -jump, target = t, id = idx, base = 0;
 	int ix = (int)p.x, iz = (int)p.z;
 	sprite = CloneSprite( spriteBase );
-	for (int y = 260; y > 0; y--) if (Read( ix, y, iz )) { position.y = base = (float)y + 1; break; }
+	// use the column height, unless the column reaches above the spawn height
+	const int h = GetSurfaceHeight( ix, iz );
+	const int groundY = h <= 261 ? h - 1 : VoxelCursor( GetWorld(), ix, 260, iz ).FindSolidDown( 1 );
+	if (groundY > 0) position.y = base = (float)groundY + 1;
 }
 
 void Creature::Tick( const float deltaTime )
@@ -26,8 +29,9 @@ void Creature::Tick( const float deltaTime )
 		float3 dir = deltaTime * 0.01f * normalize( target - position );
 		position.x += dir.x, position.z += dir.z;
 		int3 voxelPos = make_int3( position );
-		while (Read( voxelPos.x, voxelPos.y, voxelPos.z ) != 0 && voxelPos.y < 512) 
-			base = position.y = (float)(++voxelPos.y), cycle = -jump - 1.3f;
+		// nothing to climb if the column ends below us
+		const int freeY = GetSurfaceHeight( voxelPos.x, voxelPos.z ) <= voxelPos.y ? voxelPos.y : VoxelCursor( GetWorld(), voxelPos ).FindEmptyUp( 512 );
+		if (freeY > voxelPos.y) base = position.y = (float)(voxelPos.y = freeY), cycle = -jump - 1.3f;
 		MoveSpriteTo( sprite, voxelPos );
 	}
 }
@@ -56,6 +60,8 @@ void MeaningOfLife::Init()
 	skyDomeImage = "assets/sky_16.hdr";
 	skyDomeScale = 0.7f;
 	skyDomeLightScale = 2.0f;
+	// creatures snap to the terrain only, not to each other
+	KeepSpritesResident( false );
 	// clear world geometry
 	ClearWorld();
 	// produce landscape
@@ -1,13 +1,26 @@
 #include "precomp.h"
 #include "shmup.h"
+#if !HEADLESS
 #include "irrklang.h"
 using namespace irrklang;
+#else
+// no audio in headless builds: a silent stand-in for the irrKlang calls used below
+enum E_STREAM_MODE { ESM_AUTO_DETECT };
+struct ISoundSource {};
+struct ISoundEngine
+{
+	void play2D( ISoundSource*, bool = false ) {}
+	void play2D( const char*, bool = false ) {}
+	ISoundSource* addSoundSourceFromFile( const char*, E_STREAM_MODE, bool ) { return 0; }
+};
+inline ISoundEngine* createIrrKlangDevice() { static ISoundEngine silent; return &silent; }
+#endif
 
 Game* CreateGame() { return new SHMUP(); }
 
 ISoundEngine* engine;
 ISoundSource* pew = 0, * rumble = 0, * explosion = 0, * boom = 0, * shot = 0;
-ISoundSource* alarm = 0, * charge = 0;
+ISoundSource* alert = 0, * charge = 0;
 
 // actor implementations
 
@@ -152,7 +165,7 @@ bool Boss::Tick( int worldPos )
 	{
 		if (worldPos == startPos) 
 		{
-			engine->play2D( alarm );
+			engine->play2D( alert );
 			state = RISING, relPos = make_int3( 600, -150, 412 ) << 2;
 		}
 	}
@@ -262,7 +275,7 @@ void SHMUP::Init()
 	boom = engine->addSoundSourceFromFile( "assets/expl_huge.wav", ESM_AUTO_DETECT, true );
 	shot = engine->addSoundSourceFromFile( "assets/shot.wav", ESM_AUTO_DETECT, true );
 	charge = engine->addSoundSourceFromFile( "assets/charge.wav", ESM_AUTO_DETECT, true );
-	alarm = engine->addSoundSourceFromFile( "assets/alarm.wav", ESM_AUTO_DETECT, true );
+	alert = engine->addSoundSourceFromFile( "assets/alarm.wav", ESM_AUTO_DETECT, true );
 }
 
 // -----------------------------------------------------------
@@ -15,9 +15,32 @@
 #include <string>
 #include <thread>
 #include <math.h>
+#include <string.h>
 #include <algorithm>
 #include <assert.h>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#ifdef _WIN32
 #include <io.h>
+#else
+#include <unistd.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#endif
+
+// headless mode: no window, no OpenGL, no Win32. Drives the same Init/Tick/Render
+// loop against an offscreen target; default on platforms other than Windows.
+#ifndef HEADLESS
+#ifdef _WIN32
+#define HEADLESS 0
+#else
+#define HEADLESS 1
+#endif
+#endif
 
 #include "bluenoise.h"
 #include "lib/stb_image.h"
@@ -34,24 +57,59 @@
 using namespace std;
 
 // windows
+#ifdef _WIN32
 #define NOMINMAX
 #ifndef WIN32_LEAN_AND_MEAN
 #define WIN32_LEAN_AND_MEAN
 #define VC_EXTRALEAN
 #endif
 #include <windows.h>
+#else
+// the handful of msvc intrinsics used by the engine, mapped to gcc/clang builtins
+#define __forceinline inline __attribute__((always_inline))
+typedef int LONG;
+inline LONG InterlockedAdd( volatile LONG* a, LONG v ) { return __atomic_add_fetch( a, v, __ATOMIC_SEQ_CST ); }
+inline LONG InterlockedOr( volatile LONG* a, LONG v ) { return __atomic_fetch_or( a, v, __ATOMIC_SEQ_CST ); }
+inline LONG InterlockedCompareExchange( volatile LONG* a, LONG x, LONG c ) { __atomic_compare_exchange_n( a, &c, x, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ); return c; }
+inline char _InterlockedExchange8( volatile char* a, char v ) { return __atomic_exchange_n( a, v, __ATOMIC_SEQ_CST ); }
+inline short InterlockedExchange16( volatile short* a, short v ) { return __atomic_exchange_n( a, v, __ATOMIC_SEQ_CST ); }
+inline unsigned char _interlockedbittestandset( volatile LONG* a, LONG b ) { return (__atomic_fetch_or( a, 1 << b, __ATOMIC_SEQ_CST ) >> b) & 1; }
+inline unsigned char _interlockedbittestandreset( volatile LONG* a, LONG b ) { return (__atomic_fetch_and( a, ~(1 << b), __ATOMIC_SEQ_CST ) >> b) & 1; }
+inline void* _aligned_malloc( size_t s, size_t a ) { return aligned_alloc( a, (s + a - 1) & ~(a - 1) ); }
+inline void _aligned_free( void* p ) { free( p ); }
+inline long _filelength( int fd ) { struct stat s; return fstat( fd, &s ) ? -1 : (long)s.st_size; }
+#define _fileno fileno
+#define VK_LEFT		0x25
+#define VK_UP		0x26
+#define VK_RIGHT	0x27
+#define VK_DOWN		0x28
+#define VK_LSHIFT	0xA0
+#endif
 
 // OpenCL headers
+#ifdef _WIN32
 #include "cl/cl.h"
 #include <cl/cl_gl_ext.h>
+#else
+#include <CL/cl.h>
+#include <CL/cl_gl_ext.h>
+#endif
 
 // GLFW
+#if !HEADLESS
 #define GLFW_USE_CHDIR 0
 #define GLFW_EXPOSE_NATIVE_WIN32
 #define GLFW_EXPOSE_NATIVE_WGL
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <GLFW/glfw3native.h>
+#else
+// input stub: there is no keyboard; the frontend (or a test script) may set keys here
+inline bool headlessKeys[256] = {};
+inline short HeadlessKeyState( int key ) { return headlessKeys[key & 255] ? (short)0x8000 : 0; }
+#define GetAsyncKeyState HeadlessKeyState
+inline int ShowCursor( int ) { return 0; } // no cursor either
+#endif
 
 // zlib
 #include "zlib.h"
@@ -112,6 +170,16 @@ public:
 #define MALLOC64( x ) ( ( x ) == 0 ? 0 : aligned_alloc( 64, ( x ) ) )
 #define FREE64( x ) free( x )
 #endif
+
+// page-aligned allocations for the large world arrays. LARGE_HUGEPAGES asks for 1GB or 2MB
+// pages (falling back to transparent huge pages, then to regular pages); LARGE_PARALLELTOUCH
+// zeroes the memory from all worker threads, so first-touch placement spreads the pages over
+// the NUMA nodes of the workers; LARGE_INTERLEAVE asks the OS to interleave the pages over all
+// nodes instead (Linux only). pageSize receives the page size that was actually obtained.
+enum { LARGE_HUGEPAGES = 1, LARGE_PARALLELTOUCH = 2, LARGE_INTERLEAVE = 4 };
+void* LargeAlloc( const size_t size, const uint flags, size_t* pageSize = 0 );
+void LargeFree( void* p );
+
 #if defined(__GNUC__) && (__GNUC__ >= 4)
 #define CHECK_RESULT __attribute__ ((warn_unused_result))
 #elif defined(_MSC_VER) && (_MSC_VER >= 1700)
@@ -138,6 +206,8 @@ struct ALIGN( 4 ) uchar4 { uchar x, y, z, w; };
 #define FATALERROR_IN( prefix, errstr, fmt, ... ) FatalError( prefix " returned error '%s' at %s:%d" fmt "\n", errstr, __FILE__, __LINE__, ##__VA_ARGS__ );
 #define FATALERROR_IN_CALL( stmt, error_parser, fmt, ... ) do { auto ret = ( stmt ); if ( ret ) FATALERROR_IN( #stmt, error_parser( ret ), fmt, ##__VA_ARGS__ ) } while ( 0 )
 
+#if !HEADLESS
+
 // OpenGL texture wrapper
 class GLTexture
 {
@@ -192,6 +262,8 @@ void CheckShader( GLuint shader, const char* vshader, const char* fshader );
 void CheckProgram( GLuint id, const char* vshader, const char* fshader );
 void DrawQuad();
 
+#endif
+
 // timer
 struct Timer
 {
@@ -209,47 +281,59 @@ struct Timer
 // swap
 template <class T> void Swap( T& x, T& y ) { T t; t = x, x = y, y = t; }
 
-// Nils's jobmanager
+// Work-stealing task scheduler. Each worker thread owns a deque of jobs: it
+// takes work from the back of its own deque and steals from the front of the
+// others when it runs dry. A job may depend on other jobs; it is queued once
+// all of its prerequisites completed, which also serves as a continuation.
+// Threads that wait for jobs execute queued jobs meanwhile, so jobs can submit
+// and wait for jobs of their own.
 class Job
 {
 public:
+	virtual ~Job() = default;
 	virtual void Main() = 0;
+	// run this job after 'prerequisite'; declare before submitting this job, and
+	// submit prerequisites before their dependents
+	void DependsOn( Job* prerequisite );
+	bool Done() { return state.load( memory_order_acquire ) == DONE; }
 protected:
-	friend class JobThread;
-	void RunCodeWrapper();
-};
-class JobThread
-{
-public:
-	void CreateAndStartThread( unsigned int threadId );
-	void Go();
-	void BackgroundTask();
-	HANDLE m_GoSignal, m_ThreadHandle;
-	int m_ThreadID;
+	friend class TaskScheduler;
+	enum { IDLE = 0, SUBMITTED, DONE };
+	atomic<int> state{ IDLE };
+	atomic<int> blockers{ 1 };			// unfinished prerequisites, +1 until submitted
+	atomic_flag busy = ATOMIC_FLAG_INIT;	// guards successors and closed
+	vector<Job*> successors;			// jobs that wait for this one
+	bool closed = false;				// successors have been released
+	bool autoDelete = false;			// owned by the scheduler
 };
-class JobManager	// singleton class!
+class TaskScheduler	// singleton class!
 {
 protected:
-	JobManager( unsigned int numThreads );
+	TaskScheduler( const uint threads, const bool pinThreads );
 public:
-	~JobManager();
-	static void CreateJobManager( unsigned int numThreads );
-	static JobManager* GetJobManager();
+	static void Create( const uint numThreads, const bool pinThreads = false );
+	static TaskScheduler* Get();
 	static void GetProcessorCount( uint& cores, uint& logical );
-	void AddJob2( Job* a_Job );
-	unsigned int GetNumThreads() { return m_NumThreads; }
-	void RunJobs();
-	void ThreadDone( unsigned int n );
-	int MaxConcurrent() { return m_NumThreads; }
+	uint GetNumThreads() { return numThreads; }
+	static int GetWorkerIndex() { return workerIdx; }	// -1 for threads outside the pool
+	void Submit( Job* job );
+	void Wait( Job* job );
+	// split [first,last) into ranges of at least 'grain' items, execute 'body'
+	// on each range in parallel; returns when all ranges are done
+	void ParallelFor( const uint first, const uint last, const uint grain, const function<void( uint, uint )>& body );
 protected:
-	friend class JobThread;
-	Job* GetNextJob();
-	static JobManager* m_JobManager;
-	Job* m_JobList[256];
-	CRITICAL_SECTION m_CS;
-	HANDLE m_ThreadDone[64];
-	unsigned int m_NumThreads, m_JobCount;
-	JobThread* m_JobThreadList;
+	struct alignas(64) Deque { atomic_flag busy = ATOMIC_FLAG_INIT; deque<Job*> jobs; };
+	void Worker( const uint idx, const bool pin );
+	void Push( Job* job );
+	bool RunOne();
+	void Execute( Job* job );
+	static TaskScheduler* instance;
+	inline static thread_local int workerIdx = -1;	// -1 for threads outside the pool
+	Deque* queue;						// one per worker, plus one shared by outside threads
+	uint numThreads;
+	atomic<int> queued{ 0 }, sleeping{ 0 };
+	mutex sleepLock;
+	condition_variable wakeUp;
 };
 
 // random numbers
@@ -714,15 +798,9 @@ public:
 		return a;
 	}
 	// data members
-	union
-	{
-		struct
-		{
-			union { __m128 bmin4; float bmin[4]; struct { float3 bmin3; }; };
-			union { __m128 bmax4; float bmax[4]; struct { float3 bmax3; }; };
-		};
-		__m128 bounds[2] = { _mm_set_ps( 1e34f, 1e34f, 1e34f, 0 ), _mm_set_ps( -1e34f, -1e34f, -1e34f, 0 ) };
-	};
+	// (no anonymous struct around these: gcc rejects members with constructors there)
+	union { __m128 bmin4 = _mm_set_ps( 1e34f, 1e34f, 1e34f, 0 ); float bmin[4]; float3 bmin3; };
+	union { __m128 bmax4 = _mm_set_ps( -1e34f, -1e34f, -1e34f, 0 ); float bmax[4]; float3 bmax3; };
 	__inline void SetBounds( const __m128 min4, const __m128 max4 ) { bmin4 = min4; bmax4 = max4; }
 	__inline __m128 Center() const { return _mm_mul_ps( _mm_add_ps( bmin4, bmax4 ), _mm_set_ps1( 0.5f ) ); }
 	__inline float Center( uint axis ) const { return (bmin[axis] + bmax[axis]) * 0.5f; }
@@ -1052,21 +1130,22 @@ public:
 class Buffer
 {
 public:
-	enum { DEFAULT = 0, TEXTURE = 8, TARGET = 16, READONLY = 1, WRITEONLY = 2 };
+	enum { DEFAULT = 0, TEXTURE = 8, TARGET = 16, READONLY = 1, WRITEONLY = 2, PINNED = 32 };
 	// constructor / destructor
 	Buffer() : hostBuffer( 0 ) {}
 	Buffer( unsigned int N, unsigned int t = DEFAULT, void* ptr = 0 );
 	~Buffer();
 	cl_mem* GetDevicePtr() { return &deviceBuffer; }
 	unsigned int* GetHostPtr() { return hostBuffer; }
-	void CopyToDevice( bool blocking = true );
+	void CopyToDevice( bool blocking = true, const size_t s = 0 );
 	void CopyToDevice2( bool blocking, cl_event* e = 0, const size_t s = 0 );
-	void CopyFromDevice( bool blocking = true );
+	void CopyFromDevice( bool blocking = true, cl_event* eventToSet = 0, const size_t s = 0 );
 	void CopyTo( Buffer* buffer );
 	void Clear();
 	// data members
 	unsigned int* hostBuffer;
 	cl_mem deviceBuffer = 0;
+	cl_mem pinnedBuffer = 0; // page-locked host memory backing hostBuffer, for PINNED buffers
 	unsigned int type, size, textureID;
 	bool ownData;
 };
@@ -1151,14 +1230,14 @@ struct Intersection
 #include <iostream>
 #include <bitset>
 #include <array>
-#include <intrin.h>
 
 // instruction set detection
 #ifdef _WIN32
+#include <intrin.h>
 #define cpuid(info, x) __cpuidex(info, x, 0)
 #else
 #include <cpuid.h>
-void cpuid( int info[4], int InfoType ) { __cpuid_count( InfoType, 0, info[0], info[1], info[2], info[3] ); }
+inline void cpuid( int info[4], int InfoType ) { __cpuid_count( InfoType, 0, info[0], info[1], info[2], info[3] ); }
 #endif
 class CPUCaps // from https://github.com/Mysticial/FeatureDetector
 {
@@ -9,7 +9,17 @@
 #define STBI_NO_PNM
 #include "lib/stb_image.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if !defined(MAP_HUGE_1GB) && defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT) // glibc has the shift, <linux/mman.h> the sizes
+#endif
+#endif
+
+#if defined(_MSC_VER) && !HEADLESS
 #pragma comment( linker, "/subsystem:windows /ENTRY:mainCRTStartup" )
+#endif
 
 using namespace Tmpl8;
 
@@ -28,13 +38,16 @@ extern "C"
 }
 #endif
 
+#if !HEADLESS
 static GLFWwindow* window = 0;
-static bool hasFocus = true, running = true;
 static GLTexture* renderTarget = 0;
+static bool hasFocus = true;
 static int scrwidth = 0, scrheight = 0;
+static bool IGP_detected = false;
+#endif
+static bool running = true;
 static World* world = 0;
 static Game* game = 0;
-static bool IGP_detected = false;
 
 // static member data for instruction set support class
 static const CPUCaps cpucaps;
@@ -55,6 +68,7 @@ void Plot( const int3 pos, const uint c ) { world->Set( pos.x, pos.y, pos.z, c )
 uint Read( const int x, const int y, const int z ) { return world->Get( x, y, z ); }
 uint Read( const int3 pos ) { return world->Get( pos.x, pos.y, pos.z ); }
 uint Read( const uint3 pos ) { return world->Get( pos.x, pos.y, pos.z ); }
+int GetSurfaceHeight( const int x, const int z ) { return world->GetSurfaceHeight( x, z ); }
 void Sphere( const float x, const float y, const float z, const float r, const uint c )
 {
 	world->Sphere( x, y, z, r, c );
@@ -65,19 +79,30 @@ void Sphere( const float3 pos, const float r, const uint c )
 }
 void Box( const int x1, const int y1, const int z1, const int x2, const int y2, const int z2, const uint c )
 {
-	for (int y = y1; y < y2; y++) for (int z = z1; z < z2; z++) for (int x = x1; x < x2; x++) Plot( x, y, z, c );
+	// brick by brick; cells that the box covers completely become uniform cells
+	for (BrickIterator it( world, make_int3( x1, y1, z1 ), make_int3( x2, y2, z2 ) ); it.Next();) it.Fill( c );
 }
 void Box( const int3 pos1, const int3 pos2, const uint c )
 {
 	Box( pos1.x, pos1.y, pos1.z, pos2.x, pos2.y, pos2.z, c );
 }
+void ReadRegion( const int3 pos, const int3 size, PAYLOAD* data )
+{
+	world->ReadRegion( pos, size, data );
+}
+void WriteRegion( const int3 pos, const int3 size, const PAYLOAD* data, const bool skipUnchanged )
+{
+	world->WriteRegion( pos, size, data, skipUnchanged );
+}
 void Copy( const int3 s1, const int3 s2, const int3 D )
 {
-	const int3 e = s2 - s1;
-	for (int z = 0; z <= e.z; z++)
-		for (int y = 0; y <= e.y; y++)
-			for (int x = 0; x <= e.x; x++)
-				Plot( D + make_int3( x, y, z ), Read( s1 + make_int3( x, y, z ) ) );
+	// via a dense buffer, so overlapping source and destination regions copy correctly
+	const int3 size = s2 - s1 + 1;
+	if (size.x <= 0 || size.y <= 0 || size.z <= 0) return;
+	PAYLOAD* buffer = (PAYLOAD*)_aligned_malloc( (size_t)size.x * size.y * size.z * PAYLOADSIZE, 64 );
+	world->ReadRegion( s1, size, buffer );
+	world->WriteRegion( D, size, buffer, true );
+	_aligned_free( buffer );
 }
 void Copy( const int3 s1, const int3 s2, const int x, const int y, const int z )
 {
@@ -155,10 +180,32 @@ void SetParticle( const uint set, const uint idx, const uint x, const uint y, co
 {
 	world->SetParticle( set, idx, make_uint3( x, y, z ), v );
 }
+uint CreateParticleSystem( const uint capacity, const float3 gravity, const float drag, const bool collide )
+{
+	return ParticlesManager::GetParticlesManager()->CreateParticleSystem( capacity, gravity, drag, collide );
+}
+bool EmitParticle( const uint set, const float3 pos, const float3 velocity, const uint v, const float life )
+{
+	return world->EmitParticle( set, pos, velocity, v, life );
+}
+uint EmitSpriteBurst( const uint set, const uint sprite, const float3 velocity, const float3 spread, const float life, const uint stride )
+{
+	return world->EmitSpriteBurst( set, sprite, velocity, spread, life, stride );
+}
+void UpdateParticles( const uint set, const float dt ) { world->UpdateParticles( set, dt ); }
 void EnableShadow( const uint idx ) { SpriteManager::GetSpriteManager()->sprite[idx]->hasShadow = true; }
 void DisableShadow( const uint idx ) { SpriteManager::GetSpriteManager()->sprite[idx]->hasShadow = false; }
 void SetSpriteFrame( const uint idx, const uint frame ) { world->SetSpriteFrame( idx, frame ); }
 bool SpriteHit( const uint A, const uint B ) { return world->SpriteHit( A, B ); }
+void SetSpriteLayer( const uint idx, const uint layer, const uint mask )
+{
+	Sprite* s = SpriteManager::GetSpriteManager()->sprite[idx];
+	s->collisionLayer = layer, s->collisionMask = mask;
+}
+uint CollideSprites( vector<uint2>& hits, const bool exact ) { return world->CollideSprites( hits, exact ); }
+bool SpriteWorldHit( const uint idx ) { return world->SpriteWorldHit( idx ); }
+void KeepSpritesResident( const bool keep ) { world->KeepSpritesResident( keep ); }
+bool SweepSprite( const uint idx, const int3 delta, int3& reached ) { return world->SweepSprite( idx, delta, reached ); }
 void MoveSpriteTo( const uint idx, const uint x, const uint y, const uint z ) { world->MoveSpriteTo( idx, x, y, z ); }
 void MoveSpriteTo( const uint idx, const int3 pos ) { world->MoveSpriteTo( idx, pos.x, pos.y, pos.z ); }
 void MoveSpriteTo( const uint idx, const uint3 pos ) { world->MoveSpriteTo( idx, pos.x, pos.y, pos.z ); }
@@ -242,16 +289,15 @@ void ZLine( const uint3 pos, int l, const uint c ) { ZLine( pos.x, pos.y, pos.z,
 void ZLine( const int3 pos, int l, const uint c ) { ZLine( pos.x, pos.y, pos.z, l, c ); }
 bool IsOccluded( const float3 P1, const float3 P2 )
 {
-	float dist, len = length( P2 - P1 ) - 0.002f;
-	float3 dummy, D = (P2 - P1) * (1.0f / len); // normalize without recalculating square root
-	world->TraceRay( make_float4( P1 + 0.001f * D, 1 ), make_float4( D, 1 ), dist, dummy, 999999 );
-	return dist < len;
+	const float len = length( P2 - P1 );
+	const float3 D = (P2 - P1) * (1.0f / len); // normalize without recalculating square root
+	return world->TraceOcclusion( make_float4( P1, 1 ), make_float4( D, 1 ), 0.001f, len - 0.001f );
 }
 float Trace( const float3 P1, const float3 P2 )
 {
 	float dist;
 	float3 dummy, D = normalize( P2 - P1 );
-	world->TraceRay( make_float4( P1 + 0.001f * D, 1 ), make_float4( D, 1 ), dist, dummy, 999999 );
+	world->TraceRay( make_float4( P1, 1 ), make_float4( D, 1 ), dist, dummy, 0.001f, 1e34f );
 	return dist;
 }
 Intersection Trace( const Ray& r )
@@ -259,8 +305,8 @@ Intersection Trace( const Ray& r )
 	float3 N;
 	float dist;
 	Intersection i;
-	const uint voxel = world->TraceRay( make_float4( r.O, 1 ), make_float4( r.D, 1 ), dist, N, 999999 );
-	i.t = dist < r.t ? dist : 1e34f;
+	const uint voxel = world->TraceRay( make_float4( r.O, 1 ), make_float4( r.D, 1 ), dist, N, 0, r.t );
+	i.t = dist;
 	const uint Nval = ((int)N.x + 1) + (((int)N.y + 1) << 2) + (((int)N.z + 1) << 4);
 	i.N = (voxel == 0 ? 0 : Nval) + (voxel << 16);
 	return i;
@@ -291,6 +337,17 @@ Intersection* TraceBatchToVoid( const uint batchSize )
 	if (Game::autoRendering) FatalError( "disable autoRendering for inline ray batch processing." );
 	return world->TraceBatchToVoid( batchSize );
 }
+uint NewBatch( const uint maxRays )
+{
+	if (Game::autoRendering) FatalError( "disable autoRendering for inline ray batch processing." );
+	return world->NewBatch( maxRays );
+}
+Ray* GetBatchBuffer( const uint batch ) { return world->GetBatchBuffer( batch ); }
+void SubmitBatch( const uint batch, const uint batchSize, const bool reorder ) { world->SubmitBatch( batch, batchSize, false, reorder ); }
+void SubmitBatchToVoid( const uint batch, const uint batchSize, const bool reorder ) { world->SubmitBatch( batch, batchSize, true, reorder ); }
+bool BatchDone( const uint batch ) { return world->BatchDone( batch ); }
+Intersection* GetBatchResults( const uint batch ) { return world->GetBatchResults( batch ); }
+void FreeBatch( const uint batch ) { world->FreeBatch( batch ); }
 
 uint RGB32to8( const uint c ) { return ((c >> 6) & 3) + (((c >> 13) & 7) << 2) + (((c >> 21) & 7) << 5); }
 uint RGB32to16( const uint c ) { return ((c >> 4) & 15) + (((c >> 12) & 15) << 4) + (((c >> 20) & 15) << 8); }
@@ -298,6 +355,8 @@ uint BGR32to8( const uint c ) { return (((c >> 5) & 7) << 5) + (((c >> 13) & 7)
 uint RGB16to32( const uint c ) { return (((c >> 8) & 15) << 20) + (((c >> 4) & 15) << 12) + ((c & 15) << 4); }
 float GetRenderTime() { return world->GetRenderTime(); }
 
+#if !HEADLESS
+
 // GLFW callbacks
 void InitRenderTarget( int w, int h )
 {
@@ -428,97 +487,240 @@ void main()
 	glfwTerminate();
 }
 
-// Jobmanager implementation
-DWORD JobThreadProc( LPVOID lpParameter )
-{
-	JobThread* JobThreadInstance = (JobThread*)lpParameter;
-	JobThreadInstance->BackgroundTask();
-	return 0;
-}
+#else
 
-void JobThread::CreateAndStartThread( unsigned int threadId )
-{
-	m_GoSignal = CreateEvent( 0, FALSE, FALSE, 0 );
-	m_ThreadHandle = CreateThread( 0, 0, (LPTHREAD_START_ROUTINE)&JobThreadProc, (LPVOID)this, 0, 0 );
-	m_ThreadID = threadId;
-}
-void JobThread::BackgroundTask()
-{
-	while (1)
+// Headless entry point: the same Init / Render / Tick / Commit loop, without a window.
+// Rendering goes to an offscreen OpenCL image, or, without an OpenCL device, to a
+// surface via the CPU renderer. Run limits: --frames N and/or --seconds S; default
+// is to run forever. CPU rendering: --scale N divides the resolution by N, --ppm
+// file.ppm saves the last frame.
+int main( int argc, char** argv )
+{
+	int maxFrames = 0, scale = 1;
+	float maxSeconds = 0;
+	const char* ppmFile = 0;
+	for (int i = 1; i < argc - 1; i++)
 	{
-		WaitForSingleObject( m_GoSignal, INFINITE );
-		while (1)
+		if (!strcmp( argv[i], "--frames" )) maxFrames = atoi( argv[++i] );
+		else if (!strcmp( argv[i], "--seconds" )) maxSeconds = (float)atof( argv[++i] );
+		else if (!strcmp( argv[i], "--scale" )) scale = max( 1, atoi( argv[++i] ) );
+		else if (!strcmp( argv[i], "--ppm" )) ppmFile = argv[++i];
+	}
+	// initialize game
+	Surface* screen = new Surface( SCRWIDTH, SCRHEIGHT );
+	world = new World( 0 /* no GL texture; World creates an offscreen target */ );
+	Surface* cpuScreen = scale == 1 ? screen : new Surface( SCRWIDTH / scale, SCRHEIGHT / scale );
+	if (!Kernel::clStarted) world->SetCPURenderTarget( cpuScreen );
+	game = CreateGame();
+	game->screen = screen;
+	game->Init();
+	// add a skydome to the world
+	world->LoadSky( Game::skyDomeImage.c_str(), Game::skyDomeScale );
+	// after init, optimize world and sync all bricks to GPU
+	world->OptimizeBricks();
+	world->ForceSyncAllBricks();
+	// done, enter main loop
+	float deltaTime = 0;
+	int frameNr = 0;
+	Timer timer, runTime;
+	while (running)
+	{
+		deltaTime = min( 500.0f, 1000.0f * timer.elapsed() );
+		timer.reset();
+		world->Render();
+		game->Tick( deltaTime );
+		if (GetAsyncKeyState( VK_LSHIFT )) for (int i = 0; i < 3; i++) game->Tick( deltaTime );
+		world->Commit();
+		if (++frameNr == maxFrames) break;
+		if (maxSeconds > 0 && runTime.elapsed() >= maxSeconds) break;
+	}
+	printf( "headless run: %i frames in %.2fs\n", frameNr, runTime.elapsed() );
+	if (!Kernel::clStarted) printf( "cpu render time: %.2fms at %ix%i\n", world->GetRenderTime() * 1000.0f, cpuScreen->width, cpuScreen->height );
+	if (ppmFile && !Kernel::clStarted)
+	{
+		// binary ppm: no dependencies, good enough for previews and regression images
+		FILE* f = fopen( ppmFile, "wb" );
+		if (!f) FatalError( "Could not write %s.", ppmFile );
+		fprintf( f, "P6\n%i %i\n255\n", cpuScreen->width, cpuScreen->height );
+		for (int i = 0; i < cpuScreen->width * cpuScreen->height; i++)
 		{
-			Job* job = JobManager::GetJobManager()->GetNextJob();
-			if (!job)
-			{
-				JobManager::GetJobManager()->ThreadDone( m_ThreadID );
-				break;
-			}
-			job->RunCodeWrapper();
+			const uint c = cpuScreen->buffer[i];
+			const uchar rgb[3] = { (uchar)(c >> 16), (uchar)(c >> 8), (uchar)c };
+			fwrite( rgb, 1, 3, f );
 		}
+		fclose( f );
 	}
+	// close down
+	game->Shutdown();
+	delete world;
+	Kernel::KillCL();
+	return 0;
 }
 
-void JobThread::Go()
+#endif
+
+// Task scheduler implementation
+static void Lock( atomic_flag& f ) { while (f.test_and_set( memory_order_acquire )) _mm_pause(); }
+static void Unlock( atomic_flag& f ) { f.clear( memory_order_release ); }
+
+void Job::DependsOn( Job* prerequisite )
 {
-	SetEvent( m_GoSignal );
+	Lock( prerequisite->busy );
+	if (!prerequisite->closed) prerequisite->successors.push_back( this ), blockers++;
+	Unlock( prerequisite->busy );
 }
 
-void Job::RunCodeWrapper()
+TaskScheduler* TaskScheduler::instance = 0;
+
+TaskScheduler::TaskScheduler( const uint threads, const bool pinThreads ) : numThreads( threads )
 {
-	Main();
+	queue = new Deque[threads + 1];
+	for (uint i = 0; i < threads; i++) thread( &TaskScheduler::Worker, this, i, pinThreads ).detach();
 }
 
-JobManager* JobManager::m_JobManager = 0;
-
-JobManager::JobManager( unsigned int threads ) : m_NumThreads( threads )
+void TaskScheduler::Create( const uint numThreads, const bool pinThreads )
 {
-	InitializeCriticalSection( &m_CS );
+	if (instance) FatalError( "TaskScheduler::Create: scheduler already exists." );
+	instance = new TaskScheduler( max( 1u, numThreads ), pinThreads );
 }
 
-JobManager::~JobManager()
+TaskScheduler* TaskScheduler::Get()
 {
-	DeleteCriticalSection( &m_CS );
+	if (!instance)
+	{
+		uint c, l;
+		GetProcessorCount( c, l );
+		Create( l );
+	}
+	return instance;
 }
 
-void JobManager::CreateJobManager( unsigned int numThreads )
+void TaskScheduler::Worker( const uint idx, const bool pin )
 {
-	m_JobManager = new JobManager( numThreads );
-	m_JobManager->m_JobThreadList = new JobThread[numThreads];
-	for (unsigned int i = 0; i < numThreads; i++)
+	workerIdx = idx;
+	if (pin)
 	{
-		m_JobManager->m_JobThreadList[i].CreateAndStartThread( i );
-		m_JobManager->m_ThreadDone[i] = CreateEvent( 0, FALSE, FALSE, 0 );
+		// one worker per logical processor
+	#ifdef _WIN32
+		SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR)1 << (idx & 63) );
+	#else
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		CPU_SET( idx % CPU_SETSIZE, &set );
+		pthread_setaffinity_np( pthread_self(), sizeof( cpu_set_t ), &set );
+	#endif
+	}
+	while (1)
+	{
+		if (RunOne()) continue;
+		// nothing to steal; spin briefly, then sleep until a job gets pushed
+		bool found = false;
+		for (int i = 0; i < 64 && !found; i++) _mm_pause(), found = queued.load() > 0;
+		if (found) continue;
+		unique_lock<mutex> lock( sleepLock );
+		sleeping++;
+		wakeUp.wait( lock, [this] { return queued.load() > 0; } );
+		sleeping--;
 	}
-	m_JobManager->m_JobCount = 0;
 }
 
-void JobManager::AddJob2( Job* a_Job )
+void TaskScheduler::Push( Job* job )
 {
-	m_JobList[m_JobCount++] = a_Job;
+	Deque& q = queue[workerIdx < 0 ? numThreads : workerIdx];
+	Lock( q.busy );
+	q.jobs.push_back( job );
+	Unlock( q.busy );
+	queued++;
+	if (sleeping.load() > 0)
+	{
+		// taking the lock guarantees the sleeper is waiting, so it gets the notification
+		{ lock_guard<mutex> lock( sleepLock ); }
+		wakeUp.notify_one();
+	}
 }
 
-Job* JobManager::GetNextJob()
+bool TaskScheduler::RunOne()
 {
+	// newest job from our own deque, or else the oldest job of another deque
+	if (queued.load() == 0) return false;
+	const uint own = workerIdx < 0 ? numThreads : workerIdx;
 	Job* job = 0;
-	EnterCriticalSection( &m_CS );
-	if (m_JobCount > 0) job = m_JobList[--m_JobCount];
-	LeaveCriticalSection( &m_CS );
-	return job;
+	for (uint i = 0; i <= numThreads && !job; i++)
+	{
+		Deque& q = queue[(own + i) % (numThreads + 1)];
+		Lock( q.busy );
+		if (!q.jobs.empty())
+		{
+			if (i == 0) job = q.jobs.back(), q.jobs.pop_back();
+			else job = q.jobs.front(), q.jobs.pop_front();
+		}
+		Unlock( q.busy );
+	}
+	if (!job) return false;
+	queued--;
+	Execute( job );
+	return true;
+}
+
+void TaskScheduler::Execute( Job* job )
+{
+	job->blockers = 1; // ready for reuse
+	job->Main();
+	// release the jobs that waited for this one
+	vector<Job*> released;
+	Lock( job->busy );
+	job->closed = true;
+	released.swap( job->successors );
+	Unlock( job->busy );
+	for (Job* s : released) if (--s->blockers == 0) Push( s );
+	// after this a waiting thread may reuse or destroy the job
+	if (job->autoDelete) delete job; else job->state.store( Job::DONE, memory_order_release );
 }
 
-void JobManager::RunJobs()
+void TaskScheduler::Submit( Job* job )
 {
-	for (unsigned int i = 0; i < m_NumThreads; i++) m_JobThreadList[i].Go();
-	WaitForMultipleObjects( m_NumThreads, m_ThreadDone, TRUE, INFINITE );
+	job->state = Job::SUBMITTED, job->closed = false;
+	if (--job->blockers == 0) Push( job );
 }
 
-void JobManager::ThreadDone( unsigned int n )
+void TaskScheduler::Wait( Job* job )
+{
+	while (!job->Done()) if (!RunOne()) this_thread::yield();
+}
+
+// helper job for ParallelFor: splits its range until it reaches the grain size;
+// the halves it hands out are the large ones, which is what thieves take first
+class RangeJob : public Job
+{
+public:
+	RangeJob( uint f, uint l, uint g, const function<void( uint, uint )>* b, atomic<uint>* r ) :
+		first( f ), last( l ), grain( g ), body( b ), remaining( r ) { autoDelete = true; }
+	void Main()
+	{
+		while (last - first > grain)
+		{
+			const uint mid = first + (last - first) / 2;
+			TaskScheduler::Get()->Submit( new RangeJob( mid, last, grain, body, remaining ) );
+			last = mid;
+		}
+		(*body)( first, last );
+		*remaining -= last - first;
+	}
+	uint first, last, grain;
+	const function<void( uint, uint )>* body;
+	atomic<uint>* remaining;
+};
+
+void TaskScheduler::ParallelFor( const uint first, const uint last, const uint grain, const function<void( uint, uint )>& body )
 {
-	SetEvent( m_ThreadDone[n] );
+	if (last <= first) return;
+	atomic<uint> remaining{ last - first };
+	RangeJob* root = new RangeJob( first, last, max( 1u, grain ), &body, &remaining );
+	Execute( root ); // the calling thread takes the first slice
+	while (remaining.load() > 0) if (!RunOne()) this_thread::yield();
 }
 
+#ifdef _WIN32
 DWORD CountSetBits( ULONG_PTR bitMask )
 {
 	DWORD LSHIFT = sizeof( ULONG_PTR ) * 8 - 1, bitSetCount = 0;
@@ -527,7 +729,7 @@ DWORD CountSetBits( ULONG_PTR bitMask )
 	return bitSetCount;
 }
 
-void JobManager::GetProcessorCount( uint& cores, uint& logical )
+void TaskScheduler::GetProcessorCount( uint& cores, uint& logical )
 {
 	// https://github.com/GPUOpen-LibrariesAndSDKs/cpu-core-counts
 	cores = logical = 0;
@@ -558,18 +760,136 @@ void JobManager::GetProcessorCount( uint& cores, uint& logical )
 		}
 	}
 }
+#else
+void TaskScheduler::GetProcessorCount( uint& cores, uint& logical )
+{
+	// std::thread only reports logical processors
+	logical = max( 1u, (uint)thread::hardware_concurrency() );
+	cores = logical;
+}
+#endif
 
-JobManager* JobManager::GetJobManager()
+// large allocations: see precomp.h
+#ifndef _WIN32
+static mutex largeLock;
+static vector<pair<void*, size_t>> largeBlocks; // munmap needs the mapped size
+static size_t TransparentHugeBytes( void* p )
+{
+	// the kernel reports the huge pages behind a mapping in /proc/self/smaps
+	FILE* f = fopen( "/proc/self/smaps", "r" );
+	if (!f) return 0;
+	char line[256];
+	bool found = false;
+	size_t bytes = 0;
+	while (fgets( line, sizeof( line ), f ))
+	{
+		unsigned long long start, end, kB;
+		if (sscanf( line, "%llx-%llx ", &start, &end ) == 2) { if (found) break; found = (size_t)p >= start && (size_t)p < end; }
+		else if (found && sscanf( line, "AnonHugePages: %llu kB", &kB ) == 1) bytes = kB << 10;
+	}
+	fclose( f );
+	return bytes;
+}
+#endif
+void* LargeAlloc( const size_t size, const uint flags, size_t* pageSize )
 {
-	if (!m_JobManager)
+	size_t page = 4096;
+	void* p = 0;
+#ifdef _WIN32
+	if (flags & LARGE_HUGEPAGES)
 	{
-		uint c, l;
-		GetProcessorCount( c, l );
-		CreateJobManager( l );
+		// requires the 'lock pages in memory' privilege; without it, we get regular pages
+		const size_t large = GetLargePageMinimum();
+		if (large) p = VirtualAlloc( 0, (size + large - 1) & ~(large - 1), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+		if (p) page = large;
+	}
+	if (!p) p = VirtualAlloc( 0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+	if (!p) return 0;
+	// Windows places pages on first touch as well; LARGE_INTERLEAVE falls back to that
+	const uint touch = flags & (LARGE_PARALLELTOUCH | LARGE_INTERLEAVE);
+#else
+	const size_t huge = 2 << 20;
+	size_t mapped = (size + huge - 1) & ~(huge - 1);
+	if (flags & LARGE_HUGEPAGES)
+	{
+		// explicit huge pages only exist if they were reserved (vm.nr_hugepages)
+	#ifdef MAP_HUGE_1GB
+		const size_t gigantic = 1 << 30;
+		if (size >= gigantic)
+		{
+			const size_t m = (size + gigantic - 1) & ~(gigantic - 1);
+			p = mmap( 0, m, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0 );
+			if (p != MAP_FAILED) page = gigantic, mapped = m; else p = 0;
+		}
+	#endif
+		if (!p)
+		{
+			p = mmap( 0, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+			if (p != MAP_FAILED) page = huge; else p = 0;
+		}
+	}
+	if (!p)
+	{
+		// regular pages; the kernel may still back aligned 2MB ranges with transparent huge pages
+		p = mmap( 0, mapped + huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if (p == MAP_FAILED) return 0;
+		// align to 2MB and return the slack
+		char* aligned = (char*)(((size_t)p + huge - 1) & ~(huge - 1));
+		if (aligned > (char*)p) munmap( p, aligned - (char*)p );
+		if (aligned + mapped < (char*)p + mapped + huge) munmap( aligned + mapped, (char*)p + mapped + huge - (aligned + mapped) );
+		p = aligned;
+		if (flags & LARGE_HUGEPAGES) madvise( p, mapped, MADV_HUGEPAGE );
+	}
+	if (flags & LARGE_INTERLEAVE)
+	{
+		// MPOL_INTERLEAVE over all nodes; the kernel drops the ones we may not use
+		unsigned long nodes = ~0ul;
+		syscall( SYS_mbind, p, mapped, 3 /* MPOL_INTERLEAVE */, &nodes, sizeof( nodes ) * 8, 0 );
+	}
+	{
+		lock_guard<mutex> lock( largeLock );
+		largeBlocks.push_back( make_pair( p, mapped ) );
 	}
-	return m_JobManager;
+	const uint touch = flags & LARGE_PARALLELTOUCH;
+#endif
+	if (touch)
+	{
+		// first touch from all workers, in chunks of whole pages
+		const size_t chunk = max( page, (size_t)(2 << 20) );
+		TaskScheduler::Get()->ParallelFor( 0, (uint)((size + chunk - 1) / chunk), 1, [&]( uint first, uint last )
+		{
+			for (uint i = first; i < last; i++) memset( (char*)p + i * chunk, 0, min( chunk, size - i * chunk ) );
+		} );
+	}
+#ifndef _WIN32
+	if (page < huge && (flags & LARGE_HUGEPAGES))
+	{
+		// with transparent huge pages, what we got is only known after the first touch
+		if (!touch) *(volatile char*)p = 0;
+		if (TransparentHugeBytes( p ) >= (touch ? size / 2 : min( size, huge ))) page = huge;
+	}
+#endif
+	if (pageSize) *pageSize = page;
+	return p;
+}
+void LargeFree( void* p )
+{
+	if (!p) return;
+#ifdef _WIN32
+	VirtualFree( p, 0, MEM_RELEASE );
+#else
+	lock_guard<mutex> lock( largeLock );
+	for (size_t i = 0; i < largeBlocks.size(); i++) if (largeBlocks[i].first == p)
+	{
+		munmap( p, largeBlocks[i].second );
+		largeBlocks.erase( largeBlocks.begin() + i );
+		return;
+	}
+#endif
 }
 
+#if !HEADLESS
+
 // OpenGL helper functions
 void _CheckGL( const char* f, int l )
 {
@@ -818,6 +1138,8 @@ void Shader::SetUInt( const char* name, const uint v )
 	CheckGL();
 }
 
+#endif
+
 // RNG - Marsaglia's xor32
 static uint seed = 0x12345678;
 uint RandomUInt()
@@ -1026,9 +1348,9 @@ void FatalError( const char* fmt, ... )
 #ifdef _MSC_VER
 	MessageBox( NULL, t, "Fatal error", MB_OK );
 #else
-	fprintf( stderr, t );
+	fprintf( stderr, "%s", t );
 #endif
-	while (1) exit( 0 );
+	while (1) exit( 1 );
 }
 
 // source file information
@@ -1158,20 +1480,51 @@ Buffer::Buffer( unsigned int N, unsigned int t, void* ptr )
 	int rwFlags = CL_MEM_READ_WRITE;
 	if (t & READONLY) rwFlags = CL_MEM_READ_ONLY;
 	if (t & WRITEONLY) rwFlags = CL_MEM_WRITE_ONLY;
-	if ((t & (TEXTURE | TARGET)) == 0)
+	if (!Kernel::clStarted)
+	{
+		// no OpenCL device (headless): host memory only, device transfers are no-ops
+		size = N, textureID = 0;
+		hostBuffer = (uint*)ptr;
+		if (!ptr && (t & PINNED)) hostBuffer = new uint[N], ownData = true;
+		deviceBuffer = 0;
+	}
+	else if ((t & (TEXTURE | TARGET)) == 0)
 	{
 		size = N;
 		textureID = 0; // not representing a texture
 		deviceBuffer = clCreateBuffer( Kernel::GetContext(), rwFlags, size * 4, 0, 0 );
 		hostBuffer = (uint*)ptr;
+		if (t & PINNED)
+		{
+			// host side lives in page-locked memory, so transfers are direct DMA
+			cl_int error;
+			pinnedBuffer = clCreateBuffer( Kernel::GetContext(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size * 4, 0, &error );
+			CHECKCL( error );
+			hostBuffer = (uint*)clEnqueueMapBuffer( Kernel::GetQueue(), pinnedBuffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size * 4, 0, 0, 0, &error );
+			CHECKCL( error );
+		}
 	}
 	else
 	{
 		textureID = N; // representing texture N
-		if (!Kernel::candoInterop) FatalError( "didn't expect to get here." );
 		int error = 0;
-		if (t == TARGET) deviceBuffer = clCreateFromGLTexture( Kernel::GetContext(), CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, N, &error );
+		if (!Kernel::candoInterop)
+		{
+			// no GL context to share with: render to an offscreen image instead
+			if (t != TARGET) FatalError( "didn't expect to get here." );
+			cl_image_format fmt;
+			fmt.image_channel_order = CL_BGRA;
+			fmt.image_channel_data_type = CL_UNORM_INT8;
+			cl_image_desc desc;
+			memset( &desc, 0, sizeof( cl_image_desc ) );
+			desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+			desc.image_width = SCRWIDTH, desc.image_height = SCRHEIGHT;
+			deviceBuffer = clCreateImage( Kernel::GetContext(), CL_MEM_WRITE_ONLY, &fmt, &desc, 0, &error );
+		}
+	#if !HEADLESS
+		else if (t == TARGET) deviceBuffer = clCreateFromGLTexture( Kernel::GetContext(), CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, N, &error );
 		else deviceBuffer = clCreateFromGLTexture( Kernel::GetContext(), CL_MEM_READ_ONLY, GL_TEXTURE_2D, 0, N, &error );
+	#endif
 		CHECKCL( error );
 		hostBuffer = 0;
 	}
@@ -1183,40 +1536,50 @@ Buffer::~Buffer()
 {
 	if (ownData)
 	{
-		delete hostBuffer;
+		delete[] hostBuffer;
 		hostBuffer = 0;
 	}
-	if ((type & (TEXTURE | TARGET)) == 0) clReleaseMemObject( deviceBuffer );
+	if (pinnedBuffer)
+	{
+		clEnqueueUnmapMemObject( Kernel::GetQueue(), pinnedBuffer, hostBuffer, 0, 0, 0 );
+		clFinish( Kernel::GetQueue() );
+		clReleaseMemObject( pinnedBuffer );
+	}
+	if (deviceBuffer && ((type & (TEXTURE | TARGET)) == 0 || !Kernel::candoInterop)) clReleaseMemObject( deviceBuffer );
 }
 
 // CopyToDevice method
 // ----------------------------------------------------------------------------
-void Buffer::CopyToDevice( bool blocking )
+void Buffer::CopyToDevice( bool blocking, const size_t s )
 {
+	if (!deviceBuffer) return;
 	cl_int error;
-	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue(), deviceBuffer, blocking, 0, size * 4, hostBuffer, 0, 0, 0 ) );
+	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue(), deviceBuffer, blocking, 0, s == 0 ? (size * 4) : (s * 4), hostBuffer, 0, 0, 0 ) );
 }
 
 // CopyToDevice2 method (uses 2nd queue)
 // ----------------------------------------------------------------------------
 void Buffer::CopyToDevice2( bool blocking, cl_event* eventToSet, const size_t s )
 {
+	if (!deviceBuffer) return;
 	cl_int error;
 	CHECKCL( error = clEnqueueWriteBuffer( Kernel::GetQueue2(), deviceBuffer, blocking ? CL_TRUE : CL_FALSE, 0, s == 0 ? (size * 4) : (s * 4), hostBuffer, 0, 0, eventToSet ) );
 }
 
 // CopyFromDevice method
 // ----------------------------------------------------------------------------
-void Buffer::CopyFromDevice( bool blocking )
+void Buffer::CopyFromDevice( bool blocking, cl_event* eventToSet, const size_t s )
 {
+	if (!deviceBuffer) return;
 	cl_int error;
-	CHECKCL( error = clEnqueueReadBuffer( Kernel::GetQueue(), deviceBuffer, blocking, 0, size * 4, hostBuffer, 0, 0, 0 ) );
+	CHECKCL( error = clEnqueueReadBuffer( Kernel::GetQueue(), deviceBuffer, blocking, 0, s == 0 ? (size * 4) : (s * 4), hostBuffer, 0, 0, eventToSet ) );
 }
 
 // CopyTo
 // ----------------------------------------------------------------------------
 void Buffer::CopyTo( Buffer* buffer )
 {
+	if (!deviceBuffer) return;
 	clEnqueueCopyBuffer( Kernel::GetQueue(), deviceBuffer, buffer->deviceBuffer, 0, 0, size * 4, 0, 0, 0 );
 }
 
@@ -1225,6 +1588,7 @@ void Buffer::CopyTo( Buffer* buffer )
 void Buffer::Clear()
 {
 	uint value = 0;
+	if (!deviceBuffer) return;
 #if 0
 	memset( hostBuffer, 0, size * 4 );
 	CopyToDevice();
@@ -1417,13 +1781,32 @@ bool Kernel::InitCL()
 	cl_device_id* devices;
 	cl_uint devCount;
 	cl_int error;
+#if HEADLESS
+	// build servers may have no OpenCL runtime at all; let the caller continue without it
+	cl_uint platformCount = 0;
+	if (clGetPlatformIDs( 0, 0, &platformCount ) != CL_SUCCESS || platformCount == 0) return false;
+#endif
 	if (!CHECKCL( error = getPlatformID( &platform ) )) return false;
+	if (!platform) return false;
 	if (!CHECKCL( error = clGetDeviceIDs( platform, CL_DEVICE_TYPE_ALL, 0, NULL, &devCount ) )) return false;
 	devices = new cl_device_id[devCount];
 	if (!CHECKCL( error = clGetDeviceIDs( platform, CL_DEVICE_TYPE_ALL, devCount, devices, NULL ) )) return false;
 	uint deviceUsed = -1;
-	// search a capable OpenCL device
 	char device_string[1024], device_platform[1024];
+#if HEADLESS
+	// no GL context to share: any device will do, but prefer a GPU
+	for (uint i = 0; i < devCount && deviceUsed == ~0u; i++)
+	{
+		cl_device_type type;
+		clGetDeviceInfo( devices[i], CL_DEVICE_TYPE, sizeof( cl_device_type ), &type, 0 );
+		if (type & CL_DEVICE_TYPE_GPU) deviceUsed = i;
+	}
+	if (deviceUsed == ~0u) deviceUsed = 0;
+	cl_context_properties props[] = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0 };
+	context = clCreateContext( props, 1, &devices[deviceUsed], NULL, NULL, &error );
+	if (error != CL_SUCCESS) return false;
+#else
+	// search a capable OpenCL device
 	for (uint i = 0; i < devCount; i++)
 	{
 		// CHECKCL( error = clGetDeviceInfo( devices[i], CL_DEVICE_NAME, 1024, &device_string, NULL ) );
@@ -1463,6 +1846,7 @@ bool Kernel::InitCL()
 		}
 	}
 	if (deviceUsed == -1) FatalError( "No capable OpenCL device found." );
+#endif
 	device = getFirstDevice( context );
 	if (!CHECKCL( error )) return false;
 	// print device name
@@ -1578,7 +1962,9 @@ void Kernel::SetArgument( int idx, float4 value ) { clSetKernelArg( kernel, idx,
 // ----------------------------------------------------------------------------
 void Kernel::Run( cl_event* eventToWaitFor, cl_event* eventToSet )
 {
+#if !HEADLESS
 	glFinish();
+#endif
 	cl_int error = clEnqueueNDRangeKernel( queue, kernel, 2, 0, workSize, localSize, eventToWaitFor ? 1 : 0, eventToWaitFor, eventToSet );
 	CHECKCL( error );
 	clFinish( queue );
@@ -1613,7 +1999,8 @@ void Kernel::Run( Buffer* buffer, const int2 tileSize, cl_event* eventToWaitFor,
 	}
 	else
 	{
-		CHECKCL( error = clEnqueueNDRangeKernel( queue, kernel, 2, 0, workSize, localSize, 0, eventToWaitFor, eventToSet ) );
+		size_t localSize[2] = { (size_t)tileSize.x, (size_t)tileSize.y };
+		CHECKCL( error = clEnqueueNDRangeKernel( queue, kernel, 2, 0, workSize, localSize, eventToWaitFor ? 1 : 0, eventToWaitFor, eventToSet ) );
 	}
 }
 
@@ -1805,6 +2192,8 @@ void Surface::InitCharset()
 	for (i = 0; i < 50; i++) s_Transl[(unsigned char)c[i]] = i;
 }
 
+#if !HEADLESS
+
 /*
 
 	OpenGL loader generated by glad 0.1.34 on Thu Jan 28 16:18:15 2021.
@@ -2974,4 +3363,6 @@ int gladLoadGLLoader( GLADloadproc load ) {
 	return GLVersion.major != 0 || GLVersion.minor != 0;
 }
 
+#endif
+
 // EOF
\ No newline at end of file
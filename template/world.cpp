@@ -44,105 +44,130 @@ float SphericalPhi( const float3& v ) { const float p = atan2f( v.y, v.x ); retu
 World::World( const uint targetID )
 {
 	// create the staging buffer, used to sync CPU-side changes to the GPU
-	if (!Kernel::InitCL()) FATALERROR( "Failed to initialize OpenCL" );
-	devmem = clCreateBuffer( Kernel::GetContext(), CL_MEM_READ_ONLY, commitSize, 0, 0 );
+	if (!Kernel::InitCL())
+	{
+	#if HEADLESS
+		// carry on without a device: the world lives on the CPU, batches are traced there
+		printf( "No OpenCL device; running without GPU.\n" );
+	#else
+		FATALERROR( "Failed to initialize OpenCL" );
+	#endif
+	}
 	modified = new uint[BRICKCOUNT / 32]; // 1 bit per brick, to track 'dirty' bricks
-	// store top-level grid in a 3D texture
-	cl_image_format fmt;
-	fmt.image_channel_order = CL_R;
-	fmt.image_channel_data_type = CL_UNSIGNED_INT32;
-	cl_image_desc desc;
-	memset( &desc, 0, sizeof( cl_image_desc ) );
-	desc.image_type = CL_MEM_OBJECT_IMAGE3D;
-	desc.image_width = GRIDWIDTH, desc.image_height = GRIDHEIGHT, desc.image_depth = GRIDDEPTH;
-	gridMap = clCreateImage( Kernel::GetContext(), CL_MEM_HOST_NO_ACCESS, &fmt, &desc, 0, 0 );
+	shared = new uint[BRICKCOUNT / 32]; // 1 bit per brick, for bricks that hold a tile
+	memset( shared, 0, BRICKCOUNT / 8 );
+	if (Kernel::clStarted)
+	{
+		devmem = clCreateBuffer( Kernel::GetContext(), CL_MEM_READ_ONLY, commitSize, 0, 0 );
+		// store top-level grid in a 3D texture
+		cl_image_format fmt;
+		fmt.image_channel_order = CL_R;
+		fmt.image_channel_data_type = CL_UNSIGNED_INT32;
+		cl_image_desc desc;
+		memset( &desc, 0, sizeof( cl_image_desc ) );
+		desc.image_type = CL_MEM_OBJECT_IMAGE3D;
+		desc.image_width = GRIDWIDTH, desc.image_height = GRIDHEIGHT, desc.image_depth = GRIDDEPTH;
+		gridMap = clCreateImage( Kernel::GetContext(), CL_MEM_HOST_NO_ACCESS, &fmt, &desc, 0, 0 );
+	}
 	// create brick storage
-	brick = (PAYLOAD*)_aligned_malloc( CHUNKCOUNT * CHUNKSIZE, 64 );
+	const uint largeFlags = (HUGEPAGES ? LARGE_HUGEPAGES : 0) | (NUMAPLACEMENT == 1 ? LARGE_PARALLELTOUCH : 0) | (NUMAPLACEMENT == 2 ? LARGE_INTERLEAVE : 0);
+	size_t gridPageSize;
+	brick = (PAYLOAD*)LargeAlloc( (size_t)CHUNKCOUNT * CHUNKSIZE, largeFlags, &brickPageSize );
+	if (!brick) FatalError( "World: failed to allocate %iMB for the bricks.", (int)(((size_t)CHUNKCOUNT * CHUNKSIZE) >> 20) );
 #if ONEBRICKBUFFER == 1
 	brickBuffer = new Buffer( CHUNKSIZE * CHUNKCOUNT / 4 /* dwords */, Buffer::DEFAULT, (uchar*)brick );
 	brickBuffer->CopyToDevice();
 #else
-	brick = (PAYLOAD*)_aligned_malloc( CHUNKCOUNT * CHUNKSIZE, 64 );
 	for (int i = 0; i < CHUNKCOUNT; i++)
 	{
 		brickBuffer[i] = new Buffer( CHUNKSIZE / 4 /* dwords */, Buffer::DEFAULT, (uchar*)brick + CHUNKSIZE * i );
 		brickBuffer[i]->CopyToDevice();
 	}
 #endif
-	brickInfo = (BrickInfo*)_aligned_malloc( BRICKCOUNT * sizeof( BrickInfo ), 64 );
+	brickInfo = (BrickInfo*)LargeAlloc( BRICKCOUNT * sizeof( BrickInfo ), largeFlags );
+	brickRefs = (uint*)_aligned_malloc( BRICKCOUNT * 4, 64 );
+	memset( brickRefs, 0, BRICKCOUNT * 4 );
 	// create a cyclic array for unused bricks (all of them, for now)
 	trash = (uint*)_aligned_malloc( BRICKCOUNT * 4, 64 );
 	memset( trash, 0, BRICKCOUNT * 4 );
 	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * 31 /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
+#if THREADSAFEWORLD
+	emptied = (uint*)_aligned_malloc( BRICKCOUNT * 4, 64 );
+#endif
 	// prepare a test world
-	grid = gridOrig = (uint*)_aligned_malloc( GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH * 4, 64 );
+	grid = gridOrig = (uint*)LargeAlloc( GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH * 4, largeFlags, &gridPageSize );
 	memset( grid, 0, GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH * sizeof( uint ) );
+	surface = (uint*)_aligned_malloc( MAPWIDTH * MAPDEPTH * 4, 64 );
 	DummyWorld();
 	ClearMarks(); // clear 'modified' bit array
 	// report memory usage
-	printf( "Allocated %iMB on CPU and GPU for the top-level grid.\n", (int)(gridSize >> 20) );
-	printf( "Allocated %iMB on CPU and GPU for %ik bricks.\n", (int)((BRICKCOUNT * BRICKSIZE) >> 20), (int)(BRICKCOUNT >> 10) );
+	printf( "Allocated %iMB on CPU and GPU for the top-level grid (%iKB pages).\n", (int)(gridSize >> 20), (int)(gridPageSize >> 10) );
+	printf( "Allocated %iMB on CPU and GPU for %ik bricks (%iKB pages).\n", (int)((BRICKCOUNT * BRICKSIZE) >> 20), (int)(BRICKCOUNT >> 10), (int)(brickPageSize >> 10) );
 	printf( "Allocated %iKB on CPU for bitfield.\n", (int)(BRICKCOUNT >> 15) );
 	printf( "Allocated %iMB on CPU for brickInfo.\n", (int)((BRICKCOUNT * sizeof( BrickInfo )) >> 20) );
+	printf( "Allocated %iMB on CPU for column heights.\n", (int)((MAPWIDTH * MAPDEPTH * 4) >> 20) );
 	// initialize kernels
 	paramBuffer = new Buffer( sizeof( RenderParams ) / 4, Buffer::DEFAULT | Buffer::READONLY, &params );
 	history[0] = new Buffer( 4 * SCRWIDTH * SCRHEIGHT );
 	history[1] = new Buffer( 4 * SCRWIDTH * SCRHEIGHT );
 	tmpFrame = new Buffer( 4 * SCRWIDTH * SCRHEIGHT );
-#if TAA == 1
-	renderer = new Kernel( "cl/kernels.cl", "renderTAA" );
-#else
-	renderer = new Kernel( "cl/kernels.cl", "renderNoTAA" );
-#endif
-	finalizer = new Kernel( renderer->GetProgram(), "finalize" );
-	unsharpen = new Kernel( renderer->GetProgram(), "unsharpen" );
-	committer = new Kernel( renderer->GetProgram(), "commit" );
-	batchTracer = new Kernel( renderer->GetProgram(), "traceBatch" );
-	batchToVoidTracer = new Kernel( renderer->GetProgram(), "traceBatchToVoid" );
-#if MORTONBRICKS == 1
-	encodeBricks = new Kernel( renderer->GetProgram(), "encodeBricks" );
-#endif
-	uberGrid = clCreateBuffer( Kernel::GetContext(), CL_MEM_READ_WRITE, UBERWIDTH * UBERHEIGHT * UBERDEPTH, 0, 0 );
-	uberGridUpdater = new Kernel( renderer->GetProgram(), "updateUberGrid" );
-	uberGridUpdater->SetArgument( 0, &devmem );
-	uberGridUpdater->SetArgument( 1, &uberGrid );
 	targetTextureID = targetID;
-	committer->SetArgument( 1, &devmem );
-#if ONEBRICKBUFFER == 1
-	committer->SetArgument( 2, brickBuffer );
-	committer->SetArgument( 3, brickBuffer );
-	committer->SetArgument( 4, brickBuffer );
-	committer->SetArgument( 5, brickBuffer );
-#else
-	committer->SetArgument( 2, brickBuffer[0] );
-	committer->SetArgument( 3, brickBuffer[1] );
-	committer->SetArgument( 4, brickBuffer[2] );
-	committer->SetArgument( 5, brickBuffer[3] );
-#endif
-	batchTracer->SetArgument( 0, &gridMap );
-#if ONEBRICKBUFFER == 1
-	batchTracer->SetArgument( 1, brickBuffer );
-	batchTracer->SetArgument( 2, brickBuffer );
-	batchTracer->SetArgument( 3, brickBuffer );
-	batchTracer->SetArgument( 4, brickBuffer );
-#else
-	batchTracer->SetArgument( 1, brickBuffer[0] );
-	batchTracer->SetArgument( 2, brickBuffer[1] );
-	batchTracer->SetArgument( 3, brickBuffer[2] );
-	batchTracer->SetArgument( 4, brickBuffer[3] );
-#endif
-	batchToVoidTracer->SetArgument( 0, &gridMap );
-#if ONEBRICKBUFFER == 1
-	batchToVoidTracer->SetArgument( 1, brickBuffer );
-	batchToVoidTracer->SetArgument( 2, brickBuffer );
-	batchToVoidTracer->SetArgument( 3, brickBuffer );
-	batchToVoidTracer->SetArgument( 4, brickBuffer );
-#else
-	batchToVoidTracer->SetArgument( 1, brickBuffer[0] );
-	batchToVoidTracer->SetArgument( 2, brickBuffer[1] );
-	batchToVoidTracer->SetArgument( 3, brickBuffer[2] );
-	batchToVoidTracer->SetArgument( 4, brickBuffer[3] );
-#endif
+	if (Kernel::clStarted)
+	{
+	#if TAA == 1
+		renderer = new Kernel( "cl/kernels.cl", "renderTAA" );
+	#else
+		renderer = new Kernel( "cl/kernels.cl", "renderNoTAA" );
+	#endif
+		finalizer = new Kernel( renderer->GetProgram(), "finalize" );
+		unsharpen = new Kernel( renderer->GetProgram(), "unsharpen" );
+		committer = new Kernel( renderer->GetProgram(), "commit" );
+		batchTracer = new Kernel( renderer->GetProgram(), "traceBatch" );
+		batchToVoidTracer = new Kernel( renderer->GetProgram(), "traceBatchToVoid" );
+	#if MORTONBRICKS == 1
+		encodeBricks = new Kernel( renderer->GetProgram(), "encodeBricks" );
+	#endif
+		uberGrid = clCreateBuffer( Kernel::GetContext(), CL_MEM_READ_WRITE, UBERWIDTH * UBERHEIGHT * UBERDEPTH, 0, 0 );
+		uberGridUpdater = new Kernel( renderer->GetProgram(), "updateUberGrid" );
+		uberGridUpdater->SetArgument( 0, &devmem );
+		uberGridUpdater->SetArgument( 1, &uberGrid );
+		committer->SetArgument( 1, &devmem );
+	#if ONEBRICKBUFFER == 1
+		committer->SetArgument( 2, brickBuffer );
+		committer->SetArgument( 3, brickBuffer );
+		committer->SetArgument( 4, brickBuffer );
+		committer->SetArgument( 5, brickBuffer );
+	#else
+		committer->SetArgument( 2, brickBuffer[0] );
+		committer->SetArgument( 3, brickBuffer[1] );
+		committer->SetArgument( 4, brickBuffer[2] );
+		committer->SetArgument( 5, brickBuffer[3] );
+	#endif
+		batchTracer->SetArgument( 0, &gridMap );
+	#if ONEBRICKBUFFER == 1
+		batchTracer->SetArgument( 1, brickBuffer );
+		batchTracer->SetArgument( 2, brickBuffer );
+		batchTracer->SetArgument( 3, brickBuffer );
+		batchTracer->SetArgument( 4, brickBuffer );
+	#else
+		batchTracer->SetArgument( 1, brickBuffer[0] );
+		batchTracer->SetArgument( 2, brickBuffer[1] );
+		batchTracer->SetArgument( 3, brickBuffer[2] );
+		batchTracer->SetArgument( 4, brickBuffer[3] );
+	#endif
+		batchToVoidTracer->SetArgument( 0, &gridMap );
+	#if ONEBRICKBUFFER == 1
+		batchToVoidTracer->SetArgument( 1, brickBuffer );
+		batchToVoidTracer->SetArgument( 2, brickBuffer );
+		batchToVoidTracer->SetArgument( 3, brickBuffer );
+		batchToVoidTracer->SetArgument( 4, brickBuffer );
+	#else
+		batchToVoidTracer->SetArgument( 1, brickBuffer[0] );
+		batchToVoidTracer->SetArgument( 2, brickBuffer[1] );
+		batchToVoidTracer->SetArgument( 3, brickBuffer[2] );
+		batchToVoidTracer->SetArgument( 4, brickBuffer[3] );
+	#endif
+	}
 	// prepare the bluenoise data
 	const uchar* data8 = (const uchar*)sob256_64; // tables are 8 bit per entry
 	uint* data32 = new uint[65536 * 5]; // we want a full uint per entry
@@ -153,7 +178,7 @@ World::World( const uint targetID )
 	for (int i = 0; i < (128 * 128 * 8); i++) data32[i + 3 * 65536] = data8[i];
 	blueNoise = new Buffer( 65536 * 5, Buffer::READONLY, data32 );
 	blueNoise->CopyToDevice();
-	delete[] data32;
+	blueNoise->ownData = true; // host copy is kept for the cpu renderer
 	// load a bitmap font for the print command
 	font = new Surface( "assets/font.png" );
 }
@@ -162,30 +187,44 @@ World::World( const uint targetID )
 // ----------------------------------------------------------------------------
 World::~World()
 {
-	cl_program sharedProgram = renderer->GetProgram();
+	cl_program sharedProgram = renderer ? renderer->GetProgram() : 0;
 	delete committer;
 	delete renderer;
-	_aligned_free( gridOrig ); // grid itself gets changed after allocation
-	_aligned_free( brick );
+	LargeFree( gridOrig ); // grid itself gets changed after allocation
+	LargeFree( brick );
 #if ONEBRICKBUFFER == 1
 	delete brickBuffer;
 #else
 	for (int i = 0; i < 4; i++) delete brickBuffer[i];
 #endif
-	_aligned_free( brickInfo );
+	LargeFree( brickInfo );
+	_aligned_free( brickRefs );
+	delete[] shared;
 	_aligned_free( trash );
+	_aligned_free( surface );
+#if THREADSAFEWORLD
+	_aligned_free( emptied );
+	for (uint i = 0; i < dirtyLists; i++) _aligned_free( dirtyList[i].idx );
+	delete[] dirtyList;
+#endif
+	delete[] spriteJob;
+	delete[] particleJob;
 	delete screen;
 	delete paramBuffer;
 	delete sky;
 	delete blueNoise;
 	delete font;
-	clReleaseProgram( sharedProgram );
+	_aligned_free( cpuFrame );
+	_aligned_free( cpuHistory[0] );
+	_aligned_free( cpuHistory[1] );
+	if (sharedProgram) clReleaseProgram( sharedProgram );
 }
 
 // World::ForceSyncAllBricks: send brick array to GPU
 // ----------------------------------------------------------------------------
 void World::ForceSyncAllBricks()
 {
+	if (!Kernel::clStarted) return;
 #if ONEBRICKBUFFER == 1
 	brickBuffer->CopyToDevice();
 #if MORTONBRICKS == 1
@@ -203,31 +242,42 @@ void World::ForceSyncAllBricks()
 void World::OptimizeBricks()
 {
 	Timer t;
-	int replaced = 0;
-	for( int i = 0; i < GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH; i++ )
-	{
-		const uint value = grid[i];
-		if (!(value & 1)) continue; // already solid, or empty
-		bool solid = true; // let's start with this assumption
-		uint brickOffset = (value >> 1) * BRICKSIZE;
-		uint firstVoxel = brick[brickOffset];
-		for( int j = 1; j < BRICKSIZE; j++ ) if (brick[brickOffset + j] != firstVoxel)
-		{
-			// we found a voxel that is not identical to the first one; stop
-			solid = false;
-			break;
-		}
-		if (solid)
+	atomic<int> replaced{ 0 };
+	auto optimize = [&]( uint first, uint last ) {
+		int count = 0;
+		for (uint i = first; i < last; i++)
 		{
-			// this one has 8x8x8 times the same voxel; replace by solid brick in grid
-			grid[i] = firstVoxel << 1;
-			// recycle brick
-			FreeBrick( value >> 1 );
-			// statistics
-			replaced++;
+			const uint value = grid[i];
+			if (!(value & 1)) continue; // already solid, or empty
+			if (IsShared( value >> 1 )) continue; // tile bricks stay; other cells refer to them
+			bool solid = true; // let's start with this assumption
+			uint brickOffset = (value >> 1) * BRICKSIZE;
+			uint firstVoxel = brick[brickOffset];
+			for (int j = 1; j < BRICKSIZE; j++) if (brick[brickOffset + j] != firstVoxel)
+			{
+				// we found a voxel that is not identical to the first one; stop
+				solid = false;
+				break;
+			}
+			if (solid)
+			{
+				// this one has 8x8x8 times the same voxel; replace by solid brick in grid
+				grid[i] = firstVoxel << 1;
+				// recycle brick
+				FreeBrick( value >> 1 );
+				// statistics
+				count++;
+			}
 		}
-	}
-	printf( "optimizing world data took %5.2fms; replaced %i bricks.\n", t.elapsed() * 1000.0f, replaced );
+		replaced += count;
+	};
+#if THREADSAFEWORLD
+	// cells are independent; FreeBrick is thread-safe
+	TaskScheduler::Get()->ParallelFor( 0, GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH, 4096, optimize );
+#else
+	optimize( 0, GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH );
+#endif
+	printf( "optimizing world data took %5.2fms; replaced %i bricks.\n", t.elapsed() * 1000.0f, replaced.load() );
 }
 
 // World::DummyWorld: box
@@ -259,10 +309,8 @@ void World::Clear()
 {
 	// easiest top just clear the top-level grid and recycle all bricks
 	memset( grid, 0, GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH * sizeof( uint ) );
-	memset( trash, 0, BRICKCOUNT * 4 );
-	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * 31 /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
-	trashHead = BRICKCOUNT, trashTail = 0;
-	ClearMarks();
+	memset( surface, 0, MAPWIDTH * MAPDEPTH * sizeof( uint ) );
+	ResetTrash();
 }
 
 // World::Fill
@@ -272,10 +320,289 @@ void World::Fill( const uint c )
 	// fill the top-level grid and recycle all bricks
 	for (int y = 0; y < GRIDHEIGHT; y++) for (int z = 0; z < GRIDDEPTH; z++) for (int x = 0; x < GRIDWIDTH; x++)
 		grid[x + z * GRIDWIDTH + y * GRIDWIDTH * GRIDDEPTH] = c << 1;
+	for (uint i = 0; i < MAPWIDTH * MAPDEPTH; i++) surface[i] = c ? MAPHEIGHT : 0;
+	ResetTrash();
+}
+
+// World::ResetTrash (private)
+// ----------------------------------------------------------------------------
+void World::ResetTrash()
+{
+	// the grid no longer refers to any brick: recycle all of them, except the shared bricks
+	// of the tiles, which stay valid for future DrawTile calls
 	memset( trash, 0, BRICKCOUNT * 4 );
-	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * 31 /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
-	trashHead = BRICKCOUNT, trashTail = 0;
+	uint count = 0;
+	for (uint i = 0; i < BRICKCOUNT; i++)
+	{
+		if (IsShared( i )) { brickRefs[i] = 1; continue; }
+	#if THREADSAFEWORLD
+		trash[(count++ * 31 /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
+	#else
+		trash[count++] = i;
+	#endif
+	}
+#if THREADSAFEWORLD
+	trashHead = count * 31, trashTail = 0; // NewBrick and FreeBrick step through the list by 31
+	emptiedCount = 0;
+#else
+	trashHead = count, trashTail = 0;
+#endif
 	ClearMarks();
+	// a tile brick may not have reached the GPU yet
+	for (uint i = 0; i < BRICKCOUNT / 32; i++) if (shared[i]) for (uint j = 0; j < 32; j++)
+		if (shared[i] & (1 << j)) Mark( i * 32 + j );
+}
+
+// World::SetWriteMode
+// ----------------------------------------------------------------------------
+void World::SetWriteMode( const uint mode )
+{
+	if (mode == writeMode) return;
+#if THREADSAFEWORLD
+	if (writeMode == WRITE_PARTITIONED)
+	{
+		// the partitioned phase is over; merge the per-thread marks into the bitfield
+		for (uint i = 0; i < dirtyLists; i++)
+		{
+			DirtyList& list = dirtyList[i];
+			for (uint j = 0; j < list.count; j++) modified[list.idx[j] >> 5] |= 1 << (list.idx[j] & 31);
+			list.count = 0;
+		}
+	}
+	if (mode == WRITE_PARTITIONED && !dirtyList)
+	{
+		dirtyLists = TaskScheduler::Get()->GetNumThreads() + 1;
+		dirtyList = new DirtyList[dirtyLists];
+		for (uint i = 0; i < dirtyLists; i++) dirtyList[i].idx = (uint*)_aligned_malloc( DIRTYLISTSIZE * 4, 64 );
+	}
+	// forget recent marks; the bitfield may have been cleared since
+	if (mode == WRITE_PARTITIONED) for (uint i = 0; i < dirtyLists; i++) memset( dirtyList[i].recent, 255, 64 * 4 );
+#endif
+	writeMode = mode;
+}
+
+// World::SetSpan / SetRow (private)
+// ----------------------------------------------------------------------------
+void World::SetSpan( int x, const int y, const int z, int n, const PAYLOAD* v, PAYLOAD* old, const PAYLOAD* expect )
+{
+	// write n voxels along x, clipped to the world. Optionally, the old values are stored in
+	// 'old', and voxels that no longer hold the value in 'expect' are left alone.
+	if ((uint)y >= MAPHEIGHT || (uint)z >= MAPDEPTH || x >= MAPWIDTH || x + n <= 0) return;
+	if (x < 0) { v -= x, n += x; if (old) old -= x; if (expect) expect -= x; x = 0; }
+	n = min( n, MAPWIDTH - x );
+#if THREADSAFEWORLD
+	if (writeMode == WRITE_SHARED)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			const uint cv = Get( x + i, y, z );
+			if (old) old[i] = cv;
+			if (!expect || cv == expect[i]) Set( x + i, y, z, v[i] );
+		}
+		return;
+	}
+#endif
+	// one brick row at a time
+	while (n > 0)
+	{
+		const int m = min( n, BRICKDIM - (x & (BRICKDIM - 1)) );
+		SetRow( x, y, z, m, v, old, expect );
+		x += m, n -= m, v += m;
+		if (old) old += m;
+		if (expect) expect += m;
+	}
+}
+void World::SetRow( const uint x, const uint y, const uint z, const uint n, const PAYLOAD* v, PAYLOAD* old, const PAYLOAD* expect )
+{
+	// Set for up to BRICKDIM voxels in a single brick row, for WRITE_SINGLE and WRITE_PARTITIONED
+	const uint cellIdx = x / BRICKDIM + (z / BRICKDIM) * GRIDWIDTH + (y / BRICKDIM) * GRIDWIDTH * GRIDDEPTH;
+	uint g = grid[cellIdx], g1 = g >> 1;
+	if ((g & 1) == 0 /* this is currently a 'solid' grid cell */)
+	{
+		bool same = true;
+		for (uint i = 0; i < n; i++)
+		{
+			if (old) old[i] = g1;
+			same &= v[i] == g1 || (expect && expect[i] != g1);
+		}
+		if (same) return;
+		const uint newIdx = NewBrick();
+		FillBrick( newIdx, g1 );
+		InitBrickInfo( newIdx, g1 );
+		g1 = newIdx, grid[cellIdx] = (newIdx << 1) | 1;
+	}
+	const uint lx = x & (BRICKDIM - 1), ly = y & (BRICKDIM - 1), lz = z & (BRICKDIM - 1);
+	if (IsShared( g1 ))
+	{
+		// tile bricks are read-only: make a private copy, unless nothing changes
+		const PAYLOAD* voxel = brick + g1 * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM;
+		bool same = true;
+		for (uint i = 0; i < n; i++)
+		{
+			if (old) old[i] = voxel[i];
+			same &= voxel[i] == v[i] || (expect && voxel[i] != expect[i]);
+		}
+		if (same) return;
+		g1 = CopySharedBrick( cellIdx, g ) >> 1;
+	}
+	PAYLOAD* voxel = brick + g1 * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM;
+	BrickInfo& info = brickInfo[g1];
+	bool changed = false;
+	for (uint i = 0; i < n; i++)
+	{
+		const uint cv = voxel[i], nv = v[i];
+		if (old) old[i] = cv;
+		if (cv == nv || (expect && cv != expect[i])) continue;
+		if (nv && !cv) RaiseSurface( x + i, y, z ), info.zeroes--; else if (!nv && cv) LowerSurface( x + i, y, z ), info.zeroes++;
+		if (nv) info.occupied |= OccupiedBits( lx + i, ly, lz ), info.colors |= 1 << ColorBucket( nv );
+		voxel[i] = nv, changed = true;
+	}
+	if (!changed) return;
+	if (info.zeroes < BRICKSIZE) { Mark( g1 ); return; }
+	grid[cellIdx] = 0;	// brick just became completely zeroed; recycle
+	UnMark( g1 );
+	FreeBrick( g1 );
+}
+
+// World::SetCellVoxels (private)
+// ----------------------------------------------------------------------------
+void World::SetCellVoxels( const uint cellIdx, const ushort* local, const uint n, const PAYLOAD* v, PAYLOAD* old )
+{
+	// Set for n voxels of a single grid cell, in order, with one grid lookup and one Mark;
+	// local holds voxel indices within the brick. For WRITE_SINGLE and WRITE_PARTITIONED.
+	uint g = grid[cellIdx], g1 = g >> 1;
+	if ((g & 1) == 0 /* this is currently a 'solid' grid cell */)
+	{
+		bool same = true;
+		for (uint i = 0; i < n; i++)
+		{
+			if (old) old[i] = g1;
+			same &= v[i] == g1;
+		}
+		if (same) return;
+		const uint newIdx = NewBrick();
+		FillBrick( newIdx, g1 );
+		InitBrickInfo( newIdx, g1 );
+		g1 = newIdx, grid[cellIdx] = (newIdx << 1) | 1;
+	}
+	if (IsShared( g1 ))
+	{
+		// tile bricks are read-only: make a private copy, unless nothing changes
+		const PAYLOAD* voxels = brick + g1 * BRICKSIZE;
+		bool same = true;
+		for (uint i = 0; i < n; i++)
+		{
+			if (old) old[i] = voxels[local[i]];
+			same &= voxels[local[i]] == v[i];
+		}
+		if (same) return;
+		g1 = CopySharedBrick( cellIdx, g ) >> 1;
+	}
+	PAYLOAD* voxels = brick + g1 * BRICKSIZE;
+	BrickInfo& info = brickInfo[g1];
+	bool changed = false;
+	for (uint i = 0; i < n; i++)
+	{
+		const uint l = local[i], cv = voxels[l], nv = v[i];
+		if (old) old[i] = cv;
+		if (cv == nv) continue;
+		const uint lx = l & (BRICKDIM - 1), ly = (l >> BDIMLOG2) & (BRICKDIM - 1), lz = l >> (2 * BDIMLOG2);
+		if (!nv || !cv)
+		{
+			const uint x = (cellIdx % GRIDWIDTH) * BRICKDIM + lx, z = ((cellIdx / GRIDWIDTH) % GRIDDEPTH) * BRICKDIM + lz;
+			const uint y = (cellIdx / (GRIDWIDTH * GRIDDEPTH)) * BRICKDIM + ly;
+			if (nv) RaiseSurface( x, y, z ), info.zeroes--; else LowerSurface( x, y, z ), info.zeroes++;
+		}
+		if (nv) info.occupied |= OccupiedBits( lx, ly, lz ), info.colors |= 1 << ColorBucket( nv );
+		voxels[l] = nv, changed = true;
+	}
+	if (!changed) return;
+	if (info.zeroes < BRICKSIZE) { Mark( g1 ); return; }
+	grid[cellIdx] = 0;	// brick just became completely zeroed; recycle
+	UnMark( g1 );
+	FreeBrick( g1 );
+}
+
+// SummarizeBrick
+// ----------------------------------------------------------------------------
+static BrickInfo SummarizeBrick( const PAYLOAD* voxels )
+{
+	// exact zero count, occupied rows and color buckets of a brick
+	BrickInfo info = { BRICKSIZE, 0, 0 };
+	uint last = 0; // voxels mostly repeat the previous color
+	for (int z = 0; z < BRICKDIM; z++) for (int y = 0; y < BRICKDIM; y++)
+	{
+		const PAYLOAD* row = voxels + y * BRICKDIM + z * BRICKDIM * BRICKDIM;
+	#if BRICKDIM == 8 && PAYLOADSIZE == 2
+		// one row is one SSE register; only rows with new colors take the scalar path
+		const __m128i r = _mm_loadu_si128( (const __m128i*)row ), empty = _mm_cmpeq_epi16( r, _mm_setzero_si128() );
+		const uint xs = ~_mm_movemask_epi8( _mm_packs_epi16( empty, empty ) ) & 255;
+		if (_mm_movemask_epi8( _mm_or_si128( empty, _mm_cmpeq_epi16( r, _mm_set1_epi16( (short)last ) ) ) ) != 0xffff)
+			for (int x = 0; x < BRICKDIM; x++) if (row[x] && row[x] != last) last = row[x], info.colors |= 1 << ColorBucket( last );
+	#else
+		uint xs = 0;
+		for (int x = 0; x < BRICKDIM; x++)
+		{
+			const uint v = row[x];
+			xs |= (v != 0) << x;
+			if (v != last) { last = v; if (v) info.colors |= 1 << ColorBucket( v ); }
+		}
+	#endif
+		if (xs) info.occupied |= xs | (256 << y) | (65536 << z), info.zeroes -= _mm_popcnt_u32( xs );
+	}
+	return info;
+}
+
+// BrickIterator::BeginWrite / EndWrite / Fill
+// ----------------------------------------------------------------------------
+PAYLOAD* BrickIterator::BeginWrite()
+{
+	if (!IsBrick())
+	{
+		// expand the uniform cell; EndWrite updates the summary
+		const uint newIdx = world->NewBrick();
+		world->FillBrick( newIdx, g >> 1 );
+		world->grid[cellIdx] = g = (newIdx << 1) | 1;
+	}
+	else if (world->IsShared( g >> 1 )) g = world->CopySharedBrick( cellIdx, g ); // tile bricks are read-only
+	return world->brick + (g >> 1) * BRICKSIZE;
+}
+void BrickIterator::EndWrite()
+{
+	if (!IsBrick() || world->IsShared( g >> 1 )) return;
+	const uint idx = g >> 1;
+	const BrickInfo info = SummarizeBrick( world->brick + idx * BRICKSIZE );
+	if (info.zeroes < BRICKSIZE)
+	{
+		world->brickInfo[idx] = info;
+		world->UpdateSurface( origin, world->brick + idx * BRICKSIZE, 0 );
+		world->Mark( idx ); // tag to be synced with GPU
+		return;
+	}
+	world->UpdateSurface( origin, 0, 0 );
+	world->grid[cellIdx] = g = 0;	// brick became completely zeroed; recycle
+	world->UnMark( idx );
+	world->FreeBrick( idx );
+}
+void BrickIterator::Fill( const uint v )
+{
+	if (Covered())
+	{
+		// the whole cell gets one color: no brick needed
+		if (IsBrick()) world->ReleaseBrick( g >> 1 );
+		world->grid[cellIdx] = g = v << 1;
+		world->gridChanged = true;
+		world->UpdateSurface( origin, 0, v );
+		return;
+	}
+	if (!IsBrick() && Color() == v) return;
+	PAYLOAD* voxels = BeginWrite();
+	for (int z = lo.z; z < hi.z; z++) for (int y = lo.y; y < hi.y; y++)
+	{
+		PAYLOAD* row = voxels + y * BRICKDIM + z * BRICKDIM * BRICKDIM;
+		for (int x = lo.x; x < hi.x; x++) row[x] = v;
+	}
+	EndWrite();
 }
 
 // World::ScrollX
@@ -301,6 +628,13 @@ void World::ScrollX( const int offset )
 			for (int x = 0; x < o; x++) line[x] = backup[x];
 		}
 	}
+	// the column heights move along
+	for (uint z = 0; z < MAPDEPTH; z++)
+	{
+		uint* line = surface + z * MAPWIDTH;
+		if (offset < 0) rotate( line, line + o * BRICKDIM, line + MAPWIDTH );
+		else rotate( line, line + MAPWIDTH - o * BRICKDIM, line + MAPWIDTH );
+	}
 }
 
 // World::ScrollX
@@ -319,6 +653,34 @@ void World::ScrollZ( const int offset )
 	// TODO
 }
 
+// World::RescanSurface / UpdateSurface
+// ----------------------------------------------------------------------------
+int World::RescanSurface( const int x, const int z )
+{
+	// the top voxel of the column was removed: nothing is above it, so search down from there
+	volatile LONG* h = (volatile LONG*)surface + x + z * MAPWIDTH;
+	while (1)
+	{
+		const LONG old = *h;
+		if (!(old & SURFACESTALE)) return old;
+		const int top = VoxelCursor( this, x, (old & ~SURFACESTALE) - 1, z ).FindSolidDown();
+		if (InterlockedCompareExchange( h, top + 1, old ) == old) return top + 1;
+	}
+}
+void World::UpdateSurface( const int3 origin, const PAYLOAD* voxels, const uint v )
+{
+	// a bulk write replaced the cell at origin with voxels, or with color v if voxels is 0
+	const uint y0 = origin.y, y1 = origin.y + BRICKDIM;
+	for (int z = 0; z < BRICKDIM; z++) for (int x = 0; x < BRICKDIM; x++)
+	{
+		int top = v ? (BRICKDIM - 1) : -1;
+		if (voxels) for (int y = BRICKDIM - 1; y >= 0; y--) if (voxels[x + y * BRICKDIM + z * BRICKDIM * BRICKDIM]) { top = y; break; }
+		const uint wx = origin.x + x, wz = origin.z + z, h = surface[wx + wz * MAPWIDTH] & ~SURFACESTALE;
+		if (top >= 0 && y0 + top >= h) RaiseSurface( wx, y0 + top, wz );
+		else if (h > y0 && h <= y1 && h != y0 + top + 1) LowerSurface( wx, h - 1, wz ); // old top was in this cell
+	}
+}
+
 // World::LoadSky
 // ----------------------------------------------------------------------------
 void World::LoadSky( const char* filename, const float scale )
@@ -328,6 +690,7 @@ void World::LoadSky( const char* filename, const float scale )
 	printf( "loading hdr data... " );
 	int bpp; // bytes per pixel
 	float* pixels = stbi_loadf( filename, &skySize.x, &skySize.y, &bpp, 0 );
+	if (!pixels) FatalError( "LoadSky: could not load %s.", filename );
 	printf( " completed in %5.2fms\n", t.elapsed() * 1000.0f );
 	// add a checkerboard. Note: could really use a blur.
 	if (Game::checkerBoard)
@@ -502,17 +865,294 @@ void World::Print( const char* text, const uint x, const uint y, const uint z, c
 	}
 }
 
+// helpers for ReadRegion / WriteRegion: a part of a brick row; a full row is a
+// single 128-bit load / store
+static __forceinline void CopyRow( PAYLOAD* dst, const PAYLOAD* src, const int n )
+{
+#if BRICKDIM == 8 && PAYLOADSIZE == 2
+	if (n == BRICKDIM) { _mm_storeu_si128( (__m128i*)dst, _mm_loadu_si128( (const __m128i*)src ) ); return; }
+#elif BRICKDIM == 8 && PAYLOADSIZE == 1
+	if (n == BRICKDIM) { _mm_storel_epi64( (__m128i*)dst, _mm_loadl_epi64( (const __m128i*)src ) ); return; }
+#endif
+	memcpy( dst, src, n * PAYLOADSIZE );
+}
+static __forceinline void FillRow( PAYLOAD* dst, const PAYLOAD v, const int n )
+{
+#if BRICKDIM == 8 && PAYLOADSIZE == 2
+	if (n == BRICKDIM) { _mm_storeu_si128( (__m128i*)dst, _mm_set1_epi16( (short)v ) ); return; }
+#endif
+	for (int x = 0; x < n; x++) dst[x] = v;
+}
+static __forceinline bool SameRow( const PAYLOAD* a, const PAYLOAD* b, const int n )
+{
+#if BRICKDIM == 8 && PAYLOADSIZE == 2
+	if (n == BRICKDIM) return _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*)a ), _mm_loadu_si128( (const __m128i*)b ) ) ) == 0xffff;
+#endif
+	return memcmp( a, b, n * PAYLOADSIZE ) == 0;
+}
+static __forceinline bool UniformRow( const PAYLOAD* a, const PAYLOAD v, const int n )
+{
+	PAYLOAD d = 0;
+	for (int x = 0; x < n; x++) d |= a[x] ^ v;
+	return d == 0;
+}
+
+// World::ReadRegion / World::WriteRegion
+// ----------------------------------------------------------------------------
+// 'data' is a dense array of size.x * size.y * size.z voxels: x first, then y, then
+// z, like SpriteFrame::buffer. Voxels outside the world read as empty; writing them
+// has no effect. Cells are processed in parallel; WriteRegion must not overlap with
+// other threads writing to the world.
+void World::ReadRegion( const int3 pos, const int3 size, PAYLOAD* data )
+{
+	const size_t rowStride = size.x, sliceStride = (size_t)size.x * size.y;
+	if (pos.x < 0 || pos.y < 0 || pos.z < 0 || pos.x + size.x > MAPWIDTH || pos.y + size.y > MAPHEIGHT || pos.z + size.z > MAPDEPTH)
+		memset( data, 0, sliceStride * size.z * PAYLOADSIZE ); // the iterator skips the outside
+	BrickIterator region( this, pos, pos + size );
+	TaskScheduler::Get()->ParallelFor( 0, region.Cells(), 16, [&]( uint first, uint last )
+	{
+		BrickIterator it = region;
+		it.Seek( first );
+		for (uint i = first; i < last && it.Next(); i++)
+		{
+			const PAYLOAD* voxels = it.Voxels();
+			const int3 d = it.origin - pos; // cell location in data
+			const int n = it.hi.x - it.lo.x;
+			for (int z = it.lo.z; z < it.hi.z; z++) for (int y = it.lo.y; y < it.hi.y; y++)
+			{
+				PAYLOAD* dst = data + (d.x + it.lo.x) + (d.y + y) * rowStride + (d.z + z) * sliceStride;
+				if (voxels) CopyRow( dst, voxels + it.lo.x + y * BRICKDIM + z * BRICKDIM * BRICKDIM, n );
+				else FillRow( dst, (PAYLOAD)it.Color(), n );
+			}
+		}
+	} );
+}
+void World::WriteRegion( const int3 pos, const int3 size, const PAYLOAD* data, const bool skipUnchanged )
+{
+	const size_t rowStride = size.x, sliceStride = (size_t)size.x * size.y;
+	BrickIterator region( this, pos, pos + size );
+	const uint cells = region.Cells();
+#if THREADSAFEWORLD
+	const uint grain = 16;
+#else
+	const uint grain = cells; // brick allocation is not thread-safe; stay on this thread
+#endif
+	// every job writes to its own cells
+	const uint gameWriteMode = writeMode;
+	SetWriteMode( WRITE_PARTITIONED );
+	TaskScheduler::Get()->ParallelFor( 0, cells, grain, [&]( uint first, uint last )
+	{
+		BrickIterator it = region;
+		it.Seek( first );
+		for (uint i = first; i < last && it.Next(); i++)
+		{
+			const int3 d = it.origin - pos; // cell location in data
+			const int n = it.hi.x - it.lo.x;
+			auto src = [&]( const int y, const int z ) { return data + (d.x + it.lo.x) + (d.y + y) * rowStride + (d.z + z) * sliceStride; };
+			if (it.Covered())
+			{
+				// collapse a cell that receives a single color
+				const PAYLOAD v = *src( 0, 0 );
+				bool uniform = true;
+				for (int z = 0; z < BRICKDIM && uniform; z++) for (int y = 0; y < BRICKDIM && uniform; y++) uniform = UniformRow( src( y, z ), v, n );
+				if (uniform) { if (it.IsBrick() || it.Color() != v) it.Fill( v ); continue; }
+			}
+			if (skipUnchanged)
+			{
+				// leave the cell alone, and unmarked, if the data matches it already
+				const PAYLOAD* voxels = it.Voxels();
+				bool same = true;
+				for (int z = it.lo.z; z < it.hi.z && same; z++) for (int y = it.lo.y; y < it.hi.y && same; y++)
+					same = voxels ? SameRow( src( y, z ), voxels + it.lo.x + y * BRICKDIM + z * BRICKDIM * BRICKDIM, n ) : UniformRow( src( y, z ), it.Color(), n );
+				if (same) continue;
+			}
+			PAYLOAD* voxels = it.BeginWrite();
+			for (int z = it.lo.z; z < it.hi.z; z++) for (int y = it.lo.y; y < it.hi.y; y++)
+				CopyRow( voxels + it.lo.x + y * BRICKDIM + z * BRICKDIM * BRICKDIM, src( y, z ), n );
+			it.EndWrite();
+		}
+	} );
+	SetWriteMode( gameWriteMode );
+}
+
+// helper for the region queries: narrow [lo,hi) on one axis to the rows that a brick
+// summary marks as occupied; false if none remain
+static __forceinline bool ClipToOccupied( const uint occupied, int& lo, int& hi )
+{
+	const uint bits = occupied & 255 & ((1 << hi) - 1) & ~((1 << lo) - 1);
+	if (!bits) return false;
+	while (!(bits & (1 << lo))) lo++;
+	while (!(bits & (1 << (hi - 1)))) hi--;
+	return true;
+}
+static __forceinline bool ClipToOccupied( const BrickInfo& info, int3& lo, int3& hi )
+{
+	return ClipToOccupied( info.occupied, lo.x, hi.x ) && ClipToOccupied( info.occupied >> 8, lo.y, hi.y ) &&
+		ClipToOccupied( info.occupied >> 16, lo.z, hi.z );
+}
+
+// World::IsRegionEmpty / CountSolid / FindFirstSolid / RegionColors
+// ----------------------------------------------------------------------------
+bool World::IsRegionEmpty( const int3 bmin, const int3 bmax )
+{
+	for (BrickIterator it( this, bmin, bmax ); it.Next();)
+	{
+		if (!it.IsBrick()) { if (it.Color()) return false; continue; }
+		const BrickInfo& info = brickInfo[it.BrickIndex()];
+		if (info.zeroes == BRICKSIZE) continue;
+		if (it.Covered()) return false;
+		// partial brick: check the voxels in the occupied part of the overlap
+		int3 lo = it.lo, hi = it.hi;
+		if (!ClipToOccupied( info, lo, hi )) continue;
+		const PAYLOAD* voxels = it.Voxels();
+		for (int z = lo.z; z < hi.z; z++) for (int y = lo.y; y < hi.y; y++) for (int x = lo.x; x < hi.x; x++)
+			if (voxels[x + y * BRICKDIM + z * BRICKDIM * BRICKDIM]) return false;
+	}
+	return true;
+}
+uint World::CountSolid( const int3 bmin, const int3 bmax )
+{
+	uint count = 0;
+	for (BrickIterator it( this, bmin, bmax ); it.Next();)
+	{
+		if (!it.IsBrick())
+		{
+			if (it.Color()) count += (it.hi.x - it.lo.x) * (it.hi.y - it.lo.y) * (it.hi.z - it.lo.z);
+			continue;
+		}
+		const BrickInfo& info = brickInfo[it.BrickIndex()];
+		if (it.Covered()) { count += BRICKSIZE - info.zeroes; continue; }
+		int3 lo = it.lo, hi = it.hi;
+		if (!ClipToOccupied( info, lo, hi )) continue;
+		const PAYLOAD* voxels = it.Voxels();
+		for (int z = lo.z; z < hi.z; z++) for (int y = lo.y; y < hi.y; y++) for (int x = lo.x; x < hi.x; x++)
+			count += voxels[x + y * BRICKDIM + z * BRICKDIM * BRICKDIM] != 0;
+	}
+	return count;
+}
+bool World::FindFirstSolid( const int3 bmin, const int3 bmax, int3& pos )
+{
+	// visit the region one layer of cells at a time, from the top down; within a layer,
+	// the highest voxel wins, with ties going to the lowest z, then the lowest x
+	const int y0 = max( bmin.y, 0 );
+	for (int y1 = min( bmax.y, MAPHEIGHT ); y1 > y0;)
+	{
+		const int layerBase = max( y0, (y1 - 1) & ~(BRICKDIM - 1) );
+		bool found = false;
+		auto Consider = [&]( const int3 p ) {
+			if (!found || p.y > pos.y || (p.y == pos.y && (p.z < pos.z || (p.z == pos.z && p.x < pos.x)))) pos = p, found = true;
+		};
+		for (BrickIterator it( this, make_int3( bmin.x, layerBase, bmin.z ), make_int3( bmax.x, y1, bmax.z ) ); it.Next();)
+		{
+			if (!it.IsBrick())
+			{
+				if (it.Color()) Consider( it.origin + make_int3( it.lo.x, it.hi.y - 1, it.lo.z ) );
+				continue;
+			}
+			int3 lo = it.lo, hi = it.hi;
+			if (!ClipToOccupied( brickInfo[it.BrickIndex()], lo, hi )) continue;
+			const PAYLOAD* voxels = it.Voxels();
+			for (int y = hi.y - 1; y >= lo.y && (!found || it.origin.y + y >= pos.y); y--)
+			{
+				for (int z = lo.z; z < hi.z; z++) for (int x = lo.x; x < hi.x; x++) if (voxels[x + y * BRICKDIM + z * BRICKDIM * BRICKDIM])
+				{
+					Consider( it.origin + make_int3( x, y, z ) );
+					goto next_cell;
+				}
+			}
+		next_cell:;
+		}
+		if (found) return true;
+		y1 = layerBase;
+	}
+	return false;
+}
+uint World::RegionColors( const int3 bmin, const int3 bmax )
+{
+	uint colors = 0;
+	for (BrickIterator it( this, bmin, bmax ); it.Next();)
+	{
+		if (!it.IsBrick()) { if (it.Color()) colors |= 1 << ColorBucket( it.Color() ); continue; }
+		const BrickInfo& info = brickInfo[it.BrickIndex()];
+		int3 lo = it.lo, hi = it.hi;
+		if (ClipToOccupied( info, lo, hi )) colors |= info.colors;
+	}
+	return colors;
+}
+
+// SpriteFrame::BuildSpans
+// ----------------------------------------------------------------------------
+void SpriteFrame::BuildSpans()
+{
+	// sprites are mostly solid runs along x; drawing and erasing them per run lets
+	// World::SetSpan handle a brick row at a time
+	vector<uint> pos;
+	vector<ushort> length;
+	vector<PAYLOAD> voxel;
+	for (int i = 0, z = 0; z < size.z; z++) for (int y = 0; y < size.y; y++) for (int x = 0; x < size.x; x++, i++)
+	{
+		if (!buffer[i]) continue;
+		if (x == 0 || !buffer[i - 1]) pos.push_back( x + (y << 10) + (z << 20) ), length.push_back( 0 );
+		length.back()++;
+		voxel.push_back( buffer[i] );
+	}
+	_aligned_free( spanPos ), _aligned_free( spanLength ), _aligned_free( drawVal );
+	spanCount = (uint)pos.size(), drawListSize = (uint)voxel.size();
+	spanPos = (uint*)_aligned_malloc( spanCount * sizeof( uint ), 64 );
+	spanLength = (ushort*)_aligned_malloc( spanCount * sizeof( ushort ), 64 );
+	drawVal = (PAYLOAD*)_aligned_malloc( drawListSize * PAYLOADSIZE, 64 );
+	memcpy( spanPos, pos.data(), spanCount * sizeof( uint ) );
+	memcpy( spanLength, length.data(), spanCount * sizeof( ushort ) );
+	memcpy( drawVal, voxel.data(), drawListSize * PAYLOADSIZE );
+	// the same voxels split in brick-sized blocks, for sprites drawn at multiples of BRICKDIM
+	vector<BrickInfo> info;
+	pos.clear(), voxel.clear();
+	PAYLOAD block[BRICKSIZE];
+	for (int bz = 0; bz < size.z; bz += BRICKDIM) for (int by = 0; by < size.y; by += BRICKDIM) for (int bx = 0; bx < size.x; bx += BRICKDIM)
+	{
+		BrickInfo summary = { BRICKSIZE, 0, 0 };
+		for (int z = 0; z < BRICKDIM; z++) for (int y = 0; y < BRICKDIM; y++) for (int x = 0; x < BRICKDIM; x++)
+		{
+			const bool inside = bx + x < size.x && by + y < size.y && bz + z < size.z;
+			const PAYLOAD v = inside ? buffer[bx + x + (by + y) * size.x + (bz + z) * size.x * size.y] : 0;
+			block[x + y * BRICKDIM + z * BRICKDIM * BRICKDIM] = v;
+			if (v) summary.zeroes--, summary.occupied |= (1 << x) | (256 << y) | (65536 << z), summary.colors |= 1 << ColorBucket( v );
+		}
+		if (summary.zeroes == BRICKSIZE) continue;
+		pos.push_back( bx / BRICKDIM + ((by / BRICKDIM) << 10) + ((bz / BRICKDIM) << 20) );
+		voxel.insert( voxel.end(), block, block + BRICKSIZE );
+		info.push_back( summary );
+	}
+	_aligned_free( blockPos ), _aligned_free( blockVal ), _aligned_free( blockInfo );
+	blockCount = (uint)pos.size();
+	blockPos = (uint*)_aligned_malloc( blockCount * sizeof( uint ), 64 );
+	blockVal = (PAYLOAD*)_aligned_malloc( blockCount * BRICKSIZE * PAYLOADSIZE, 64 );
+	blockInfo = (BrickInfo*)_aligned_malloc( blockCount * sizeof( BrickInfo ), 64 );
+	memcpy( blockPos, pos.data(), blockCount * sizeof( uint ) );
+	memcpy( blockVal, voxel.data(), blockCount * BRICKSIZE * PAYLOADSIZE );
+	memcpy( blockInfo, info.data(), blockCount * sizeof( BrickInfo ) );
+	// occupancy bits, for SpriteHit
+	const int rows = size.y * size.z, planes = (size.x + 63) / 64 + 1;
+	_aligned_free( occupancy );
+	occupancy = (uint64_t*)_aligned_malloc( planes * rows * sizeof( uint64_t ), 64 );
+	memset( occupancy, 0, planes * rows * sizeof( uint64_t ) );
+	for (int i = 0, z = 0; z < size.z; z++) for (int y = 0; y < size.y; y++) for (int x = 0; x < size.x; x++, i++)
+		if (buffer[i]) occupancy[(x >> 6) * rows + y + z * size.y] |= 1ull << (x & 63);
+}
+
 // SpriteManager::LoadSprite
 // ----------------------------------------------------------------------------
 uint SpriteManager::LoadSprite( const char* voxFile, bool largeModel )
 {
 	if (strstr( voxFile, ".vx" ))
 	{
-		// load it from our custom file format
+		// load it from our custom file format; files that start with VXSPANS store runs of
+		// voxels, older files a position per voxel
 		Sprite* newSprite = new Sprite();
 		gzFile f = gzopen( voxFile, "rb" );
-		int frames, pls;
-		gzread( f, &pls, 4 );
+		int frames, pls, tag;
+		gzread( f, &tag, 4 );
+		if (tag == VXSPANS) gzread( f, &pls, 4 ); else pls = tag;
 		gzread( f, &frames, 4 );
 		if (pls != PAYLOADSIZE) FatalError( "File was saved with a different voxel size." );
 		int3 maxSize = make_int3( 0 );
@@ -522,10 +1162,41 @@ uint SpriteManager::LoadSprite( const char* voxFile, bool largeModel )
 			newSprite->frame.push_back( sf );
 			gzread( f, &sf->size, 12 );
 			gzread( f, &sf->drawListSize, 4 );
-			sf->drawPos = new uint[sf->drawListSize];
-			sf->drawVal = new PAYLOAD[sf->drawListSize];
-			gzread( f, sf->drawPos, sf->drawListSize * sizeof( uint ) );
-			gzread( f, sf->drawVal, sf->drawListSize * PAYLOADSIZE );
+			const int3 s = sf->size;
+			sf->buffer = (PAYLOAD*)_aligned_malloc( s.x * s.y * s.z * PAYLOADSIZE, 64 );
+			memset( sf->buffer, 0, s.x * s.y * s.z * PAYLOADSIZE );
+			if (tag == VXSPANS)
+			{
+				gzread( f, &sf->spanCount, 4 );
+				sf->spanPos = (uint*)_aligned_malloc( sf->spanCount * sizeof( uint ), 64 );
+				sf->spanLength = (ushort*)_aligned_malloc( sf->spanCount * sizeof( ushort ), 64 );
+				sf->drawVal = (PAYLOAD*)_aligned_malloc( sf->drawListSize * PAYLOADSIZE, 64 );
+				gzread( f, sf->spanPos, sf->spanCount * sizeof( uint ) );
+				gzread( f, sf->spanLength, sf->spanCount * sizeof( ushort ) );
+				gzread( f, sf->drawVal, sf->drawListSize * PAYLOADSIZE );
+				// restore the frame buffer, used for transformed drawing and SpriteHit
+				for (uint j = 0, k = 0; j < sf->spanCount; j++)
+				{
+					const uint p = sf->spanPos[j];
+					memcpy( sf->buffer + (p & 1023) + ((p >> 10) & 1023) * s.x + (p >> 20) * s.x * s.y, sf->drawVal + k, sf->spanLength[j] * PAYLOADSIZE );
+					k += sf->spanLength[j];
+				}
+			}
+			else
+			{
+				uint* drawPos = new uint[sf->drawListSize];
+				PAYLOAD* drawVal = new PAYLOAD[sf->drawListSize];
+				gzread( f, drawPos, sf->drawListSize * sizeof( uint ) );
+				gzread( f, drawVal, sf->drawListSize * PAYLOADSIZE );
+				for (uint j = 0; j < sf->drawListSize; j++)
+				{
+					const uint p = drawPos[j];
+					sf->buffer[(p & 1023) + ((p >> 10) & 1023) * s.x + (p >> 20) * s.x * s.y] = drawVal[j];
+				}
+				delete[] drawPos;
+				delete[] drawVal;
+				sf->BuildSpans();
+			}
 			maxSize.x = max( maxSize.x, sf->size.x );
 			maxSize.y = max( maxSize.y, sf->size.y );
 			maxSize.z = max( maxSize.z, sf->size.z );
@@ -534,7 +1205,7 @@ uint SpriteManager::LoadSprite( const char* voxFile, bool largeModel )
 		// create the backup frame for sprite movement
 		SpriteFrame* backupFrame = new SpriteFrame();
 		backupFrame->size = maxSize;
-		backupFrame->buffer = new PAYLOAD[maxSize.x * maxSize.y * maxSize.z];
+		backupFrame->buffer = (PAYLOAD*)_aligned_malloc( maxSize.x * maxSize.y * maxSize.z * PAYLOADSIZE, 64 );
 		newSprite->backup = backupFrame;
 		sprite.push_back( newSprite );
 	}
@@ -592,8 +1263,6 @@ uint SpriteManager::LoadSprite( const char* voxFile, bool largeModel )
 			}
 		}
 		// finalize frame
-		vector<uint> drawList;
-		vector<PAYLOAD> voxel;
 		for (int i = 0, z = 0; z < frame->size.z; z++)
 		{
 			for (int y = 0; y < frame->size.y; y++)
@@ -617,23 +1286,16 @@ uint SpriteManager::LoadSprite( const char* voxFile, bool largeModel )
 						const PAYLOAD v = (p == 0) ? 1 : p;
 					#endif
 						frame->buffer[i] = v;
-						drawList.push_back( x + (y << 10) + (z << 20) );
-						voxel.push_back( frame->buffer[i] );
 					}
 				}
 			}
 		}
-		frame->drawPos = (uint*)_aligned_malloc( drawList.size() * sizeof( uint ), 64 );
-		frame->drawVal = (PAYLOAD*)_aligned_malloc( drawList.size() * PAYLOADSIZE, 64 );
-		for (size_t s = drawList.size(), i = 0; i < s; i++)
-			frame->drawPos[i] = drawList[i],
-			frame->drawVal[i] = voxel[i];
-		frame->drawListSize = (uint)drawList.size();
+		frame->BuildSpans();
 		newSprite->frame.push_back( frame );
 		// create the backup frame for sprite movement
 		SpriteFrame* backupFrame = new SpriteFrame();
 		backupFrame->size = frame->size;
-		backupFrame->buffer = new PAYLOAD[frame->size.x * frame->size.y * frame->size.z];
+		backupFrame->buffer = (PAYLOAD*)_aligned_malloc( frame->size.x * frame->size.y * frame->size.z * PAYLOADSIZE, 64 );
 		newSprite->backup = backupFrame;
 		sprite.push_back( newSprite );
 		// clear ogt_vox_scene
@@ -752,8 +1414,6 @@ uint SpriteManager::LoadSprite( const char* voxFile, bool largeModel )
 		{
 			// efficient sprite rendering: B&H'21
 			SpriteFrame* frame = newSprite->frame[f];
-			vector<uint> drawList;
-			vector<PAYLOAD> voxel;
 			for (int i = 0, z = 0; z < frame->size.z; z++)
 			{
 				for (int y = 0; y < frame->size.y; y++)
@@ -777,26 +1437,19 @@ uint SpriteManager::LoadSprite( const char* voxFile, bool largeModel )
 							const PAYLOAD v = (p == 0) ? 1 : p;
 						#endif
 							frame->buffer[i] = v;
-							drawList.push_back( x + (y << 10) + (z << 20) );
-							voxel.push_back( frame->buffer[i] );
 						}
 					}
 				}
 			}
+			frame->BuildSpans();
 			maxSize.x = max( maxSize.x, frame->size.x );
 			maxSize.y = max( maxSize.y, frame->size.y );
 			maxSize.z = max( maxSize.z, frame->size.z );
-			frame->drawPos = (uint*)_aligned_malloc( drawList.size() * sizeof( uint ), 64 );
-			frame->drawVal = (PAYLOAD*)_aligned_malloc( drawList.size() * PAYLOADSIZE, 64 );
-			for (size_t s = drawList.size(), i = 0; i < s; i++)
-				frame->drawPos[i] = drawList[i],
-				frame->drawVal[i] = voxel[i];
-			frame->drawListSize = (uint)drawList.size();
 		}
 		// create the backup frame for sprite movement
 		SpriteFrame* backupFrame = new SpriteFrame();
 		backupFrame->size = maxSize;
-		backupFrame->buffer = new PAYLOAD[maxSize.x * maxSize.y * maxSize.z];
+		backupFrame->buffer = (PAYLOAD*)_aligned_malloc( maxSize.x * maxSize.y * maxSize.z * PAYLOADSIZE, 64 );
 		newSprite->backup = backupFrame;
 		sprite.push_back( newSprite );
 	}
@@ -812,7 +1465,8 @@ void SpriteManager::SaveSprite( const uint idx, const char* vxFile )
 	// save the sprite to custom file format
 	Sprite* s = sprite[idx];
 	gzFile f = gzopen( vxFile, "wb" );
-	int frames = (int)s->frame.size(), pls = PAYLOADSIZE;
+	int frames = (int)s->frame.size(), pls = PAYLOADSIZE, tag = VXSPANS;
+	gzwrite( f, &tag, 4 );
 	gzwrite( f, &pls, 4 );
 	gzwrite( f, &frames, 4 );
 	for (int i = 0; i < frames; i++)
@@ -820,7 +1474,9 @@ void SpriteManager::SaveSprite( const uint idx, const char* vxFile )
 		SpriteFrame* sf = s->frame[i];
 		gzwrite( f, &sf->size, 12 );
 		gzwrite( f, &sf->drawListSize, 4 );
-		gzwrite( f, sf->drawPos, sf->drawListSize * sizeof( uint ) );
+		gzwrite( f, &sf->spanCount, 4 );
+		gzwrite( f, sf->spanPos, sf->spanCount * sizeof( uint ) );
+		gzwrite( f, sf->spanLength, sf->spanCount * sizeof( ushort ) );
 		gzwrite( f, sf->drawVal, sf->drawListSize * PAYLOADSIZE );
 	}
 	gzclose( f );
@@ -835,10 +1491,12 @@ uint SpriteManager::CloneSprite( const uint idx )
 	Sprite* newSprite = new Sprite();
 	newSprite->frame = sprite[idx]->frame;
 	newSprite->hasShadow = sprite[idx]->hasShadow;
+	newSprite->collisionLayer = sprite[idx]->collisionLayer;
+	newSprite->collisionMask = sprite[idx]->collisionMask;
 	// clone backup frame, which will be unique per instance
 	SpriteFrame* backupFrame = new SpriteFrame();
 	backupFrame->size = sprite[idx]->backup->size;
-	backupFrame->buffer = new PAYLOAD[backupFrame->size.x * backupFrame->size.y * backupFrame->size.z];
+	backupFrame->buffer = (PAYLOAD*)_aligned_malloc( backupFrame->size.x * backupFrame->size.y * backupFrame->size.z * PAYLOADSIZE, 64 );
 	newSprite->backup = backupFrame;
 	sprite.push_back( newSprite );
 	return (uint)sprite.size() - 1;
@@ -855,31 +1513,15 @@ uint World::CreateSprite( const int3 pos, const int3 size, const int frames )
 	{
 		SpriteFrame* frame = new SpriteFrame();
 		frame->size = size;
-		vector<uint> drawList( voxelsPerFrame / 4 /* estimate */ );
-		vector<PAYLOAD> voxel( voxelsPerFrame / 4 );
 		frame->buffer = (PAYLOAD*)_aligned_malloc( voxelsPerFrame * PAYLOADSIZE, 64 );
-		for (int x = 0; x < size.x; x++) for (int y = 0; y < size.y; y++) for (int z = 0; z < size.z; z++)
-		{
-			uint v = Get( i * size.x + x + pos.x, y + pos.y, z + pos.z );
-			frame->buffer[x + y * size.x + z * size.x * size.y] = v;
-			if (v != 0)
-			{
-				drawList.push_back( x + (y << 10) + (z << 20) );
-				voxel.push_back( v );
-			}
-		}
-		frame->drawListSize = (uint)drawList.size();
-		frame->drawPos = (uint*)_aligned_malloc( drawList.size() * sizeof( uint ), 64 );
-		frame->drawVal = (PAYLOAD*)_aligned_malloc( drawList.size() * PAYLOADSIZE, 64 );
-		for (size_t s = drawList.size(), i = 0; i < s; i++)
-			frame->drawPos[i] = drawList[i],
-			frame->drawVal[i] = voxel[i];
+		ReadRegion( make_int3( i * size.x + pos.x, pos.y, pos.z ), size, frame->buffer );
+		frame->BuildSpans();
 		newSprite->frame.push_back( frame );
 	}
 	// create the backup frame for sprite movement
 	SpriteFrame* backupFrame = new SpriteFrame();
 	backupFrame->size = size;
-	backupFrame->buffer = new PAYLOAD[voxelsPerFrame];
+	backupFrame->buffer = (PAYLOAD*)_aligned_malloc( voxelsPerFrame * PAYLOADSIZE, 64 );
 	newSprite->backup = backupFrame;
 	auto& sprite = GetSpriteList();
 	sprite.push_back( newSprite );
@@ -898,6 +1540,35 @@ uint World::SpriteFrameCount( const uint idx )
 	return (uint)sprite[idx]->frame.size();
 }
 
+// helpers for transformed sprites: a sprite rotates and scales around the center of its
+// box. TransformedBounds yields the world voxels [wmin,wmax) that the current frame may
+// cover, clipped to the world and to the +/-512 voxels that a backup entry can address.
+static bool IsTransformed( const mat4& M ) { return M.cell[0] != 1 || M.cell[5] != 1 || M.cell[10] != 1; }
+static void TransformedBounds( const Sprite* s, int3& wmin, int3& wmax )
+{
+	const float3 half = make_float3( s->frame[s->currFrame]->size ) * 0.5f, C = make_float3( s->currPos ) + half;
+	float3 bmin = make_float3( 1e34f ), bmax = make_float3( -1e34f );
+	for (int i = 0; i < 8; i++)
+	{
+		const float3 p = s->transform.TransformVector( make_float3( i & 1 ? half.x : -half.x, i & 2 ? half.y : -half.y, i & 4 ? half.z : -half.z ) );
+		bmin = fminf( bmin, p ), bmax = fmaxf( bmax, p );
+	}
+	wmin = make_int3( (int)floorf( C.x + bmin.x ), (int)floorf( C.y + bmin.y ), (int)floorf( C.z + bmin.z ) );
+	wmax = make_int3( (int)ceilf( C.x + bmax.x ), (int)ceilf( C.y + bmax.y ), (int)ceilf( C.z + bmax.z ) );
+	wmin = max( max( wmin, make_int3( 0 ) ), s->currPos - 512 );
+	wmax = min( min( wmax, make_int3( MAPWIDTH, MAPHEIGHT, MAPDEPTH ) ), s->currPos + 512 );
+}
+// narrow [first,last) to the steps i for which b + i * s is in [0,size); this is conservative
+// by a voxel on both sides, the exact test is done per voxel
+static __forceinline bool ClipSpan( const float b, const float s, const int size, int& first, int& last )
+{
+	if (fabsf( s ) < 1e-6f) return b >= 0 && b < size;
+	float t0 = -b / s, t1 = (size - b) / s;
+	if (t0 > t1) swap( t0, t1 );
+	first = (int)max( (float)first, floorf( t0 ) - 1 ), last = (int)min( (float)last, ceilf( t1 ) + 1 );
+	return first < last;
+}
+
 // World::EraseSprite (private; called from World::Commit)
 // ----------------------------------------------------------------------------
 void World::EraseSprite( const uint idx )
@@ -906,68 +1577,369 @@ void World::EraseSprite( const uint idx )
 	auto& sprite = GetSpriteList();
 	const int3 lastPos = sprite[idx]->lastPos;
 	if (lastPos.x == OUTOFRANGE) return;
+	// voxels that no longer hold what the sprite drew were written to by the game while
+	// the sprite stayed in the world; those keep their new value
 	const SpriteFrame* backup = sprite[idx]->backup;
-	const SpriteFrame* frame = sprite[idx]->frame[sprite[idx]->currFrame];
-	const uint* localPos = frame->drawPos;
-	for (uint i = 0; i < frame->drawListSize; i++)
+	if (IsTransformed( sprite[idx]->drawnTransform ))
+	{
+		// transformed sprite: DrawSprite kept a compacted list of what it overwrote
+		const PAYLOAD* val = sprite[idx]->drawnVal;
+		for (uint i = 0; i < backup->drawListSize; i++)
+		{
+			const uint v = backup->drawPos[i];
+			const int vx = (v & 1023) - 512 + lastPos.x, vy = ((v >> 10) & 1023) - 512 + lastPos.y, vz = (v >> 20) - 512 + lastPos.z;
+			if (Get( vx, vy, vz ) == val[i]) Set( vx, vy, vz, backup->drawVal[i] );
+		}
+		return;
+	}
+	const SpriteFrame* frame = sprite[idx]->frame[sprite[idx]->drawnFrame];
+	if (((lastPos.x | lastPos.y | lastPos.z) & (BRICKDIM - 1)) == 0) { EraseSpriteBlocks( idx, frame, lastPos ); return; }
+	for (uint i = 0, k = 0; i < frame->spanCount; k += frame->spanLength[i++])
 	{
-		const uint v = localPos[i];
-		const uint vx = v & 1023, vy = (v >> 10) & 1023, vz = (v >> 20) & 1023;
-		Set( vx + lastPos.x, vy + lastPos.y, vz + lastPos.z, backup->buffer[i] );
+		const uint p = frame->spanPos[i];
+		SetSpan( (p & 1023) + lastPos.x, ((p >> 10) & 1023) + lastPos.y, (p >> 20) + lastPos.z, frame->spanLength[i], backup->buffer + k, 0, frame->drawVal + k );
 	}
 }
 
-// World::DrawSprite (private; called from World::Commit)
+// World::DrawSpriteBlocks / EraseSpriteBlocks (private; called from World::Commit)
 // ----------------------------------------------------------------------------
-void World::DrawSprite( const uint idx )
+#if PAYLOADSIZE == 1
+#define CMPEQ_PAYLOAD _mm256_cmpeq_epi8
+#else
+#define CMPEQ_PAYLOAD _mm256_cmpeq_epi16
+#endif
+void World::DrawSpriteBlocks( const uint idx, const SpriteFrame* frame, const int3 pos )
+{
+	// the sprite is at a multiple of BRICKDIM: its blocks map one-to-one onto bricks. Each
+	// brick is copied to the backup and blended with the block; zero is transparent.
+	Sprite* s = GetSpriteList()[idx];
+	if (frame->blockCount > s->blockBackupCapacity)
+	{
+		_aligned_free( s->blockBackup );
+		s->blockBackup = (PAYLOAD*)_aligned_malloc( frame->blockCount * BRICKSIZE * PAYLOADSIZE, 64 );
+		s->blockBackupCapacity = frame->blockCount;
+	}
+	const int3 cell = make_int3( pos.x >> BDIMLOG2, pos.y >> BDIMLOG2, pos.z >> BDIMLOG2 );
+	const __m256i zero = _mm256_setzero_si256();
+	for (uint i = 0; i < frame->blockCount; i++)
+	{
+		const uint p = frame->blockPos[i];
+		const int bx = cell.x + (p & 1023), by = cell.y + ((p >> 10) & 1023), bz = cell.z + (p >> 20);
+		if ((uint)bx >= GRIDWIDTH || (uint)by >= GRIDHEIGHT || (uint)bz >= GRIDDEPTH) continue;
+		const uint cellIdx = bx + bz * GRIDWIDTH + by * GRIDWIDTH * GRIDDEPTH;
+		uint g = grid[cellIdx];
+		if ((g & 1) == 0 /* this is currently a 'solid' grid cell */)
+		{
+			const uint newIdx = NewBrick();
+			FillBrick( newIdx, g >> 1 );
+			InitBrickInfo( newIdx, g >> 1 );
+			grid[cellIdx] = g = (newIdx << 1) | 1;
+		}
+		else if (IsShared( g >> 1 )) g = CopySharedBrick( cellIdx, g );
+		const uint b = g >> 1;
+		__m256i* voxels = (__m256i*)(brick + b * BRICKSIZE);
+		__m256i* saved = (__m256i*)(s->blockBackup + i * BRICKSIZE);
+		const __m256i* val = (const __m256i*)(frame->blockVal + i * BRICKSIZE);
+		uint zeroBytes = 0;
+		for (int j = 0; j < BRICKSIZE * PAYLOADSIZE / 32; j++)
+		{
+			const __m256i d = _mm256_load_si256( voxels + j ), v = _mm256_load_si256( val + j );
+			const __m256i r = _mm256_blendv_epi8( v, d, CMPEQ_PAYLOAD( v, zero ) );
+			_mm256_store_si256( saved + j, d );
+			_mm256_store_si256( voxels + j, r );
+			zeroBytes += _mm_popcnt_u32( _mm256_movemask_epi8( CMPEQ_PAYLOAD( r, zero ) ) );
+		}
+		BrickInfo& info = brickInfo[b];
+		info.zeroes = zeroBytes / PAYLOADSIZE;
+		info.occupied |= frame->blockInfo[i].occupied, info.colors |= frame->blockInfo[i].colors;
+		UpdateSurface( make_int3( bx, by, bz ) * BRICKDIM, brick + b * BRICKSIZE, 0 );
+		Mark( b );
+	}
+}
+void World::EraseSpriteBlocks( const uint idx, const SpriteFrame* frame, const int3 pos )
+{
+	// restore the bricks saved by DrawSpriteBlocks, where they still hold the sprite
+	const Sprite* s = GetSpriteList()[idx];
+	const int3 cell = make_int3( pos.x >> BDIMLOG2, pos.y >> BDIMLOG2, pos.z >> BDIMLOG2 );
+	const __m256i zero = _mm256_setzero_si256();
+	for (uint i = 0; i < frame->blockCount; i++)
+	{
+		const uint p = frame->blockPos[i];
+		const int bx = cell.x + (p & 1023), by = cell.y + ((p >> 10) & 1023), bz = cell.z + (p >> 20);
+		if ((uint)bx >= GRIDWIDTH || (uint)by >= GRIDHEIGHT || (uint)bz >= GRIDDEPTH) continue;
+		const uint cellIdx = bx + bz * GRIDWIDTH + by * GRIDWIDTH * GRIDDEPTH;
+		uint g = grid[cellIdx];
+		if ((g & 1) == 0) continue; // the game replaced the whole cell
+		if (IsShared( g >> 1 )) g = CopySharedBrick( cellIdx, g );
+		const uint b = g >> 1;
+		__m256i* voxels = (__m256i*)(brick + b * BRICKSIZE);
+		const __m256i* saved = (const __m256i*)(s->blockBackup + i * BRICKSIZE);
+		const __m256i* val = (const __m256i*)(frame->blockVal + i * BRICKSIZE);
+		for (int j = 0; j < BRICKSIZE * PAYLOADSIZE / 32; j++)
+		{
+			const __m256i d = _mm256_load_si256( voxels + j ), v = _mm256_load_si256( val + j );
+			const __m256i drawn = _mm256_andnot_si256( CMPEQ_PAYLOAD( v, zero ), CMPEQ_PAYLOAD( d, v ) );
+			_mm256_store_si256( voxels + j, _mm256_blendv_epi8( d, _mm256_load_si256( saved + j ), drawn ) );
+		}
+		const BrickInfo info = SummarizeBrick( brick + b * BRICKSIZE );
+		const int3 origin = make_int3( bx, by, bz ) * BRICKDIM;
+		if (info.zeroes < BRICKSIZE)
+		{
+			brickInfo[b] = info;
+			UpdateSurface( origin, brick + b * BRICKSIZE, 0 );
+			Mark( b );
+			continue;
+		}
+		grid[cellIdx] = 0;	// brick became completely zeroed; recycle
+		UpdateSurface( origin, 0, 0 );
+		UnMark( b );
+		FreeBrick( b );
+	}
+}
+
+// World::DrawSprite (private; called from World::Commit)
+// ----------------------------------------------------------------------------
+void World::DrawSprite( const uint idx )
 {
 	// draw sprite at new location
 	auto& sprite = GetSpriteList();
 	const int3& pos = sprite[idx]->currPos;
+	SpriteFrame* backup = sprite[idx]->backup;
+	backup->drawListSize = 0; // EraseSprite: no transformed voxels to restore
+	sprite[idx]->drawnFrame = sprite[idx]->currFrame;
+	sprite[idx]->drawnTransform = sprite[idx]->transform;
 	if (pos.x != OUTOFRANGE)
 	{
-		mat4 M = sprite[idx]->transform;
-		if (M.cell[0] == 1 && M.cell[5] == 1 && M.cell[10] == 1)
+		if (!IsTransformed( sprite[idx]->transform ))
 		{
-			// no rotation / scaling; use regular rendering code
+			// no rotation / scaling; use regular rendering code, or whole bricks if the sprite
+			// is aligned to the grid
 			const SpriteFrame* frame = sprite[idx]->frame[sprite[idx]->currFrame];
-			SpriteFrame* backup = sprite[idx]->backup;
-			const uint* localPos = frame->drawPos;
-			const PAYLOAD* val = frame->drawVal;
-			for (uint i = 0; i < frame->drawListSize; i++)
+			if (((pos.x | pos.y | pos.z) & (BRICKDIM - 1)) == 0) DrawSpriteBlocks( idx, frame, pos );
+			else for (uint i = 0, k = 0; i < frame->spanCount; k += frame->spanLength[i++])
 			{
-				const uint v = localPos[i];
-				const uint vx = v & 1023, vy = (v >> 10) & 1023, vz = (v >> 20) & 1023;
-				backup->buffer[i] = Get( vx + pos.x, vy + pos.y, vz + pos.z );
-				Set( vx + pos.x, vy + pos.y, vz + pos.z, val[i] );
+				const uint p = frame->spanPos[i];
+				SetSpan( (p & 1023) + pos.x, ((p >> 10) & 1023) + pos.y, (p >> 20) + pos.z, frame->spanLength[i], frame->drawVal + k, backup->buffer + k );
 			}
 		}
 		else
 		{
-			// draw sprite with specified transform
+			// draw sprite with specified transform: visit the world voxels in the transformed
+			// box, and fetch the nearest frame voxel through the inverse transform. What gets
+			// overwritten goes to a compacted list in the backup frame.
 			const SpriteFrame* frame = sprite[idx]->frame[sprite[idx]->currFrame];
-			float a = frame->size.x * 0.5f, b = frame->size.y * 0.5f, c = frame->size.z * 0.5f;
-			float3 p[8] = {
-				M.TransformVector( make_float3( -a, -b, -c ) ), M.TransformVector( make_float3( a, -b, -c ) ),
-				M.TransformVector( make_float3( a, b, -c ) ), M.TransformVector( make_float3( -a, b, -c ) ),
-				M.TransformVector( make_float3( -a, -b, c ) ), M.TransformVector( make_float3( a, -b, c ) ),
-				M.TransformVector( make_float3( a, b, c ) ), M.TransformVector( make_float3( -a, b, c ) )
-			};
-			aabb bounds;
-			for (int i = 0; i < 8; i++) bounds.Grow( p[i] );
-			int3 A = make_int3( bounds.bmin3 );
-			int3 B = make_int3( bounds.bmax3 );
-			mat4 iM = M.Inverted();
-			for (int z = A.z; z < B.z; z++) for (int y = A.y; y < B.y; y++) for (int x = A.x; x < B.x; x++)
+			int3 A, B;
+			TransformedBounds( sprite[idx], A, B );
+			const uint volume = max( 0, B.x - A.x ) * max( 0, B.y - A.y ) * max( 0, B.z - A.z );
+			if (volume > sprite[idx]->backupCapacity)
 			{
-				// TODO
+				_aligned_free( backup->drawPos );
+				_aligned_free( backup->drawVal );
+				_aligned_free( sprite[idx]->drawnVal );
+				backup->drawPos = (uint*)_aligned_malloc( volume * sizeof( uint ), 64 );
+				backup->drawVal = (PAYLOAD*)_aligned_malloc( volume * PAYLOADSIZE, 64 );
+				sprite[idx]->drawnVal = (PAYLOAD*)_aligned_malloc( volume * PAYLOADSIZE, 64 );
+				sprite[idx]->backupCapacity = volume;
 			}
+			const mat4 iM = sprite[idx]->transform.Inverted();
+			const int3 size = frame->size;
+			const float3 half = make_float3( size ) * 0.5f, C = make_float3( pos ) + half;
+			const float3 dx = iM.TransformVector( make_float3( 1, 0, 0 ) ); // frame step per world voxel over x
+			const __m256 lane = _mm256_set_ps( 7, 6, 5, 4, 3, 2, 1, 0 );
+			const __m256 dx8 = _mm256_set1_ps( dx.x ), dy8 = _mm256_set1_ps( dx.y ), dz8 = _mm256_set1_ps( dx.z );
+			const __m256i sx8 = _mm256_set1_epi32( size.x ), sy8 = _mm256_set1_epi32( size.y ), sz8 = _mm256_set1_epi32( size.z );
+			const __m256i sxy8 = _mm256_set1_epi32( size.x * size.y ), none8 = _mm256_set1_epi32( -1 );
+			ALIGN( 32 ) int voxelIdx[8];
+			uint n = 0;
+			for (int z = A.z; z < B.z; z++) for (int y = A.y; y < B.y; y++)
+			{
+				// frame position of the center of world voxel (A.x,y,z); skip the empty ends of the row
+				const float3 L = iM.TransformVector( make_float3( A.x + 0.5f, y + 0.5f, z + 0.5f ) - C ) + half;
+				int first = 0, last = B.x - A.x;
+				if (!ClipSpan( L.x, dx.x, size.x, first, last ) || !ClipSpan( L.y, dx.y, size.y, first, last ) ||
+					!ClipSpan( L.z, dx.z, size.z, first, last )) continue;
+				const __m256 Lx = _mm256_set1_ps( L.x ), Ly = _mm256_set1_ps( L.y ), Lz = _mm256_set1_ps( L.z );
+				for (int i = first; i < last; i += 8)
+				{
+					// eight frame indices at once; -1 where the voxel falls outside the frame
+					const __m256 t = _mm256_add_ps( _mm256_set1_ps( (float)i ), lane );
+					const __m256i lx = _mm256_cvtps_epi32( _mm256_floor_ps( _mm256_add_ps( Lx, _mm256_mul_ps( t, dx8 ) ) ) );
+					const __m256i ly = _mm256_cvtps_epi32( _mm256_floor_ps( _mm256_add_ps( Ly, _mm256_mul_ps( t, dy8 ) ) ) );
+					const __m256i lz = _mm256_cvtps_epi32( _mm256_floor_ps( _mm256_add_ps( Lz, _mm256_mul_ps( t, dz8 ) ) ) );
+					const __m256i inside = _mm256_and_si256(
+						_mm256_and_si256( _mm256_and_si256( _mm256_cmpgt_epi32( lx, none8 ), _mm256_cmpgt_epi32( sx8, lx ) ),
+							_mm256_and_si256( _mm256_cmpgt_epi32( ly, none8 ), _mm256_cmpgt_epi32( sy8, ly ) ) ),
+						_mm256_and_si256( _mm256_cmpgt_epi32( lz, none8 ), _mm256_cmpgt_epi32( sz8, lz ) ) );
+					const __m256i index = _mm256_add_epi32( lx, _mm256_add_epi32( _mm256_mullo_epi32( ly, sx8 ), _mm256_mullo_epi32( lz, sxy8 ) ) );
+					_mm256_store_si256( (__m256i*)voxelIdx, _mm256_or_si256( index, _mm256_andnot_si256( inside, none8 ) ) );
+					for (int j = 0; j < 8 && i + j < last; j++)
+					{
+						if (voxelIdx[j] < 0) continue;
+						const uint v = frame->buffer[voxelIdx[j]];
+						if (!v) continue;
+						const int x = A.x + i + j;
+						backup->drawPos[n] = (x - pos.x + 512) + ((y - pos.y + 512) << 10) + ((z - pos.z + 512) << 20);
+						backup->drawVal[n] = Get( x, y, z );
+						sprite[idx]->drawnVal[n++] = v;
+						Set( x, y, z, v );
+					}
+				}
+			}
+			backup->drawListSize = n;
 		}
 	}
 	// store this location so we can remove the sprite later
 	sprite[idx]->lastPos = sprite[idx]->currPos;
 }
 
+// World::DrawSprites / World::EraseSprites (private; called from World::Commit)
+// ----------------------------------------------------------------------------
+void World::SpriteJob::Main()
+{
+	const bool hasShadow = world->GetSpriteList()[idx]->hasShadow;
+	if (!erase)
+	{
+		if (hasShadow) world->DrawSpriteShadow( idx );
+		world->DrawSprite( idx );
+	}
+	else
+	{
+		world->EraseSprite( idx );
+		if (hasShadow) world->RemoveSpriteShadow( idx );
+	}
+}
+bool World::SpriteJob::Overlaps( const SpriteJob& o ) const
+{
+	return bmin.x <= o.bmax.x && o.bmin.x <= bmax.x && bmin.y <= o.bmax.y &&
+		o.bmin.y <= bmax.y && bmin.z <= o.bmax.z && o.bmin.z <= bmax.z;
+}
+void World::RunSpriteJobs( const bool erase )
+{
+	// the active sprites that touch different grid cells are processed in parallel; where
+	// they overlap, a dependency keeps the list order (reversed for erasing), so backups nest
+	const int count = (int)GetSpriteList().size();
+#if THREADSAFEWORLD
+	TaskScheduler* scheduler = TaskScheduler::Get();
+	for (int k = 0; k < count; k++)
+	{
+		SpriteJob& job = spriteJob[erase ? count - 1 - k : k];
+		if (!job.active) continue;
+		job.erase = erase;
+		for (int l = 0; l < k; l++)
+		{
+			SpriteJob& prev = spriteJob[erase ? count - 1 - l : l];
+			if (prev.active && job.Overlaps( prev )) job.DependsOn( &prev );
+		}
+		scheduler->Submit( &job );
+	}
+	for (int i = 0; i < count; i++) if (spriteJob[i].active) scheduler->Wait( spriteJob + i );
+#else
+	for (int k = 0; k < count; k++)
+	{
+		SpriteJob& job = spriteJob[erase ? count - 1 - k : k];
+		if (job.active) job.erase = erase, job.Main();
+	}
+#endif
+}
+bool World::SpriteEdited( const Sprite* s )
+{
+	// a resident sprite was written over if a brick in its cells got dirty, or a cell changed
+	uint k = 0;
+	for (int y = s->drawnMin.y; y <= s->drawnMax.y; y++) for (int z = s->drawnMin.z; z <= s->drawnMax.z; z++)
+		for (int x = s->drawnMin.x; x <= s->drawnMax.x; x++)
+		{
+			const uint g = grid[x + z * GRIDWIDTH + y * GRIDWIDTH * GRIDDEPTH];
+			if (g != s->drawnCells[k++] || ((g & 1) && IsDirty( g >> 1 ))) return true;
+		}
+	return false;
+}
+void World::DrawSprites()
+{
+	// sprites that stayed in the world since the last Commit (see EraseSprites) and did not
+	// change are left alone. The others are erased and drawn again; since the backups of
+	// later sprites in the list nest in theirs, overlapping resident sprites after them in
+	// the list are erased and drawn again as well.
+	auto& sprite = GetSpriteList();
+	const uint count = (uint)sprite.size();
+	if (count > spriteJobCapacity)
+	{
+		delete[] spriteJob;
+		spriteJob = new SpriteJob[spriteJobCapacity = count * 2];
+	}
+	for (uint i = 0; i < count; i++)
+	{
+		// grid cells that the sprite and its shadow may touch; nothing if out of range
+		SpriteJob& job = spriteJob[i];
+		Sprite* s = sprite[i];
+		const int3 pos = s->currPos, size = s->frame[s->currFrame]->size;
+		int3 lo = pos, hi = pos + size - 1;
+		if (pos.x != OUTOFRANGE && IsTransformed( s->transform )) TransformedBounds( s, lo, hi ), hi -= 1;
+		if (s->hasShadow) lo = make_int3( min( lo.x, pos.x - 12 ), 0, min( lo.z, pos.z - 12 ) ),
+			hi = make_int3( max( hi.x, pos.x + 11 ), hi.y, max( hi.z, pos.z + 11 ) );
+		job.world = this, job.idx = i;
+		job.bmin = make_int3( max( 0, lo.x ) / BRICKDIM, max( 0, lo.y ) / BRICKDIM, max( 0, lo.z ) / BRICKDIM );
+		job.bmax = make_int3( min( hi.x / BRICKDIM, GRIDWIDTH - 1 ), min( hi.y / BRICKDIM, GRIDHEIGHT - 1 ), min( hi.z / BRICKDIM, GRIDDEPTH - 1 ) );
+		if (pos.x == OUTOFRANGE || hi.x < 0 || hi.y < 0 || hi.z < 0) job.bmax = make_int3( -1 );
+		job.moved = pos.x != s->lastPos.x || pos.y != s->lastPos.y || pos.z != s->lastPos.z ||
+			s->currFrame != s->drawnFrame || !(s->transform == s->drawnTransform);
+		job.redraw = !s->resident || job.moved || SpriteEdited( s );
+	}
+	for (uint j = 0; j < count; j++) if (sprite[j]->resident && !spriteJob[j].redraw)
+		for (uint i = 0; i < j; i++)
+		{
+			// the erased sprite covers its old cells, the drawn sprite its new cells
+			const SpriteJob& job = spriteJob[i];
+			if (!job.redraw) continue;
+			const int3 &a = sprite[i]->drawnMin, &b = sprite[i]->drawnMax, &c = spriteJob[j].bmin, &d = spriteJob[j].bmax;
+			const bool oldOverlaps = a.x <= d.x && c.x <= b.x && a.y <= d.y && c.y <= b.y && a.z <= d.z && c.z <= b.z;
+			if (job.Overlaps( spriteJob[j] ) || (sprite[i]->resident && oldOverlaps)) { spriteJob[j].redraw = true; break; }
+		}
+	// erase, using the cells of the previous draw
+	vector<int3> newMin( count ), newMax( count );
+	for (uint i = 0; i < count; i++)
+	{
+		SpriteJob& job = spriteJob[i];
+		newMin[i] = job.bmin, newMax[i] = job.bmax;
+		job.active = job.redraw && sprite[i]->resident;
+		if (job.active) job.bmin = sprite[i]->drawnMin, job.bmax = sprite[i]->drawnMax, sprite[i]->resident = false;
+	}
+	RunSpriteJobs( true );
+	// draw
+	for (uint i = 0; i < count; i++)
+	{
+		SpriteJob& job = spriteJob[i];
+		job.bmin = newMin[i], job.bmax = newMax[i], job.active = job.redraw;
+		if (job.redraw) sprite[i]->drawnMin = job.bmin, sprite[i]->drawnMax = job.bmax, sprite[i]->resident = sprite[i]->currPos.x != OUTOFRANGE;
+	}
+	RunSpriteJobs( false );
+}
+void World::EraseSprites()
+{
+	// sprites that changed in this Commit are erased, in reverse order; stationary sprites
+	// stay, unless an erased sprite before them in the list overlaps them, or residency is off
+	auto& sprite = GetSpriteList();
+	const uint count = (uint)sprite.size();
+	for (uint i = 0; i < count; i++)
+	{
+		SpriteJob& job = spriteJob[i];
+		job.bmin = sprite[i]->drawnMin, job.bmax = sprite[i]->drawnMax;
+		job.active = sprite[i]->resident && (!residentSprites || job.moved || sprite[i]->hasShadow /* depends on the terrain */);
+		if (!job.active && sprite[i]->resident) for (uint j = 0; j < i; j++)
+			if (spriteJob[j].active && spriteJob[j].Overlaps( job )) { job.active = true; break; }
+	}
+	RunSpriteJobs( true );
+	// remember the grid cells of the remaining sprites, to detect writes to them
+	for (uint i = 0; i < count; i++)
+	{
+		Sprite* s = sprite[i];
+		if (spriteJob[i].active) s->resident = false;
+		if (!s->resident) continue;
+		s->drawnCells.clear();
+		for (int y = s->drawnMin.y; y <= s->drawnMax.y; y++) for (int z = s->drawnMin.z; z <= s->drawnMax.z; z++)
+			for (int x = s->drawnMin.x; x <= s->drawnMax.x; x++) s->drawnCells.push_back( grid[x + z * GRIDWIDTH + y * GRIDWIDTH * GRIDDEPTH] );
+	}
+}
+
 // World::DrawSpriteShadow
 // ----------------------------------------------------------------------------
 void World::DrawSpriteShadow( const uint idx )
@@ -986,16 +1958,21 @@ void World::DrawSpriteShadow( const uint idx )
 		{
 			// shadow intensity
 			int i = (d2 / 3) + 150 + 16 * ((x + z) & 1);
-			// find height
-			for (int v, y = pos.y; y >= 0; y--) if (v = Read( x, y, z ))
+			// find height; the column height is enough unless something is above the sprite
+			const int h = GetSurfaceHeight( x, z );
+			if (h == 0) continue;
+			int y = h - 1, v;
+			if (y <= pos.y) v = Get( x, y, z ); else
 			{
-				sprite[idx]->preShadow[sprite[idx]->shadowVoxels++] = make_uint4( x, y, z, v );
-				int r = (((v >> 5) & 7) * i) >> 8;
-				int g = (((v >> 2) & 7) * i) >> 8;
-				int b = ((v & 3) * i) >> 8;
-				Plot( x, y, z, max( 1, (r << 5) + (g << 2) + b ) );
-				break;
+				VoxelCursor cursor( this, x, pos.y, z );
+				if ((y = cursor.FindSolidDown()) < 0) continue;
+				v = cursor.Get();
 			}
+			sprite[idx]->preShadow[sprite[idx]->shadowVoxels++] = make_uint4( x, y, z, v );
+			int r = (((v >> 5) & 7) * i) >> 8;
+			int g = (((v >> 2) & 7) * i) >> 8;
+			int b = ((v & 3) * i) >> 8;
+			Plot( x, y, z, max( 1, (r << 5) + (g << 2) + b ) );
 		}
 	}
 }
@@ -1055,13 +2032,10 @@ void World::StampSpriteTo( const uint idx, const uint x, const uint y, const uin
 	const int3& pos = make_int3( x, y, z );
 	if (pos.x == OUTOFRANGE) return;
 	const SpriteFrame* frame = sprite[idx]->frame[sprite[idx]->currFrame];
-	const uint* localPos = frame->drawPos;
-	const PAYLOAD* val = frame->drawVal;
-	for (uint i = 0; i < frame->drawListSize; i++)
+	for (uint i = 0, k = 0; i < frame->spanCount; k += frame->spanLength[i++])
 	{
-		const uint v = localPos[i];
-		const uint vx = v & 1023, vy = (v >> 10) & 1023, vz = (v >> 20) & 1023;
-		Set( vx + pos.x, vy + pos.y, vz + pos.z, val[i] );
+		const uint p = frame->spanPos[i];
+		SetSpan( (p & 1023) + pos.x, ((p >> 10) & 1023) + pos.y, (p >> 20) + pos.z, frame->spanLength[i], frame->drawVal + k );
 	}
 }
 
@@ -1090,22 +2064,228 @@ bool World::SpriteHit( const uint A, const uint B )
 	int3 b1 = make_int3( max( b1A.x, b1B.x ), max( b1A.y, b1B.y ), max( b1A.z, b1B.z ) );
 	int3 b2 = make_int3( min( b2A.x, b2B.x ), min( b2A.y, b2B.y ), min( b2A.z, b2B.z ) );
 	if (b1.x > b2.x || b1.y > b2.y || b1.z > b2.z) return false;
-	// check individual voxels
-	int3 pA = b1 - b1A, pB = b1 - b1B;
-	int3 sizeA = frameA->size, sizeB = frameB->size, sizeI = b2 - b1;
-	for (int z = 0; z < sizeI.z; z++)
+	// check the occupancy bits of both frames, 64 voxels along x and four rows along y at a time
+	const int3 lo = b1 - b1A, hi = b2 - b1A, offset = b1A - b1B, sizeA = frameA->size, sizeB = frameB->size;
+	const int rowsA = sizeA.y * sizeA.z, rowsB = sizeB.y * sizeB.z;
+	for (int x = lo.x; x < hi.x; x += 64)
 	{
-		PAYLOAD* dA = frameA->buffer + pA.x + pA.y * sizeA.x + (pA.z + z) * sizeA.x * sizeA.y;
-		PAYLOAD* dB = frameB->buffer + pB.x + pB.y * sizeB.x + (pB.z + z) * sizeB.x * sizeB.y;
-		for (int y = 0; y < sizeI.y; y++)
+		// bits x..x+63 of a row are the high part of word x >> 6 and the low part of the next
+		const int n = min( 64, hi.x - x ), xB = x + offset.x, sA = x & 63, sB = xB & 63;
+		const uint64_t keep = n == 64 ? ~0ull : ((1ull << n) - 1);
+		const uint64_t* A0 = frameA->occupancy + (x >> 6) * rowsA, * A1 = A0 + rowsA;
+		const uint64_t* B0 = frameB->occupancy + (xB >> 6) * rowsB, * B1 = B0 + rowsB;
+		const __m128i shiftA = _mm_cvtsi32_si128( sA ), shiftA1 = _mm_cvtsi32_si128( 64 - sA );
+		const __m128i shiftB = _mm_cvtsi32_si128( sB ), shiftB1 = _mm_cvtsi32_si128( 64 - sB );
+		const __m256i keep4 = _mm256_set1_epi64x( (long long)keep );
+		for (int z = lo.z; z < hi.z; z++)
 		{
-			for (int x = 0; x < sizeI.x; x++) if (dA[x] * dB[x]) return true;
-			dA += sizeA.x, dB += sizeB.x;
+			const int rA = z * sizeA.y, rB = (z + offset.z) * sizeB.y + offset.y;
+			int y = lo.y;
+			for (; y + 4 <= hi.y; y += 4)
+			{
+				const __m256i a = _mm256_or_si256( _mm256_srl_epi64( _mm256_loadu_si256( (const __m256i*)(A0 + rA + y) ), shiftA ),
+					_mm256_sll_epi64( _mm256_loadu_si256( (const __m256i*)(A1 + rA + y) ), shiftA1 ) );
+				const __m256i b = _mm256_or_si256( _mm256_srl_epi64( _mm256_loadu_si256( (const __m256i*)(B0 + rB + y) ), shiftB ),
+					_mm256_sll_epi64( _mm256_loadu_si256( (const __m256i*)(B1 + rB + y) ), shiftB1 ) );
+				if (!_mm256_testz_si256( _mm256_and_si256( a, b ), keep4 )) return true;
+			}
+			for (; y < hi.y; y++)
+			{
+				const uint64_t a = (A0[rA + y] >> sA) | (sA ? A1[rA + y] << (64 - sA) : 0);
+				const uint64_t b = (B0[rB + y] >> sB) | (sB ? B1[rB + y] << (64 - sB) : 0);
+				if (a & b & keep) return true;
+			}
 		}
 	}
 	return false;
 }
 
+// World::CollideSprites
+// ----------------------------------------------------------------------------
+uint World::CollideSprites( vector<uint2>& hits, const bool exact )
+{
+	// broad phase: sweep and prune over the sprite bounds along x. Pairs whose collision
+	// layers do not match are skipped, the others go to SpriteHit unless 'exact' is false.
+	// Each pair is reported once, as (lowest index, highest index).
+	auto& sprite = GetSpriteList();
+	hits.clear();
+	while (sweepOrder.size() < sprite.size()) sweepOrder.push_back( (uint)sweepOrder.size() );
+	// sprites move little between frames, so the order of the last call is nearly sorted;
+	// insertion sort is close to linear then
+	const int count = (int)sweepOrder.size();
+	for (int i = 1; i < count; i++)
+	{
+		const uint s = sweepOrder[i];
+		const int x = sprite[s]->currPos.x;
+		int j = i - 1;
+		for (; j >= 0 && sprite[sweepOrder[j]]->currPos.x > x; j--) sweepOrder[j + 1] = sweepOrder[j];
+		sweepOrder[j + 1] = s;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		const uint a = sweepOrder[i];
+		const Sprite* A = sprite[a];
+		if (A->currPos.x == OUTOFRANGE || (A->collisionLayer | A->collisionMask) == 0) continue;
+		const int3 minA = A->currPos, maxA = minA + A->frame[A->currFrame]->size;
+		for (int j = i + 1; j < count; j++)
+		{
+			const uint b = sweepOrder[j];
+			const Sprite* B = sprite[b];
+			if (B->currPos.x >= maxA.x) break; // this and all later sprites start beyond A
+			if (B->currPos.x == OUTOFRANGE) continue;
+			if (!(A->collisionLayer & B->collisionMask) && !(B->collisionLayer & A->collisionMask)) continue;
+			const int3 minB = B->currPos, maxB = minB + B->frame[B->currFrame]->size;
+			if (minB.y >= maxA.y || minA.y >= maxB.y || minB.z >= maxA.z || minA.z >= maxB.z) continue;
+			if (!exact || SpriteHit( a, b )) hits.push_back( make_uint2( min( a, b ), max( a, b ) ) );
+		}
+	}
+	return (uint)hits.size();
+}
+
+// World::SpriteWorldHit / SweepSprite
+// ----------------------------------------------------------------------------
+static __forceinline uint64_t FrameBits( const SpriteFrame* f, int x, const int y, const int z, const int n )
+{
+	// occupancy of voxels x..x+n-1 (n <= 64) of frame row (y,z); zero outside the frame
+	if ((uint)y >= (uint)f->size.y || (uint)z >= (uint)f->size.z || x >= f->size.x || x + n <= 0) return 0;
+	int shift = 0;
+	if (x < 0) shift = -x, x = 0;
+	const int rows = f->size.y * f->size.z, s = x & 63;
+	const uint64_t* w = f->occupancy + (x >> 6) * rows + y + z * f->size.y;
+	const uint64_t bits = ((w[0] >> s) | (s ? w[rows] << (64 - s) : 0)) << shift;
+	return n == 64 ? bits : (bits & ((1ull << n) - 1));
+}
+static __forceinline uint RowBits( const PAYLOAD* row )
+{
+	// solid voxels in a brick row
+#if BRICKDIM == 8 && PAYLOADSIZE == 2
+	const __m128i empty = _mm_cmpeq_epi16( _mm_loadu_si128( (const __m128i*)row ), _mm_setzero_si128() );
+	return ~_mm_movemask_epi8( _mm_packs_epi16( empty, empty ) ) & 255;
+#else
+	uint bits = 0;
+	for (int x = 0; x < BRICKDIM; x++) bits |= (row[x] != 0) << x;
+	return bits;
+#endif
+}
+bool World::FrameHitsWorld( const uint idx, const SpriteFrame* frame, const int3 pos )
+{
+	// overlap of the frame at pos with solid world voxels, a brick row at a time. Empty cells
+	// and the empty rows of bricks, according to their summaries, are skipped. A sprite that
+	// stays in the world between commits (see DrawSprites) does not hit its own voxels: where
+	// it covers the world, the value it saved there is tested instead.
+	const Sprite* s = GetSpriteList()[idx];
+	const SpriteFrame* own = s->resident ? s->frame[s->drawnFrame] : 0, * backup = s->backup;
+	const int3 last = s->lastPos;
+	const bool transformed = own && IsTransformed( s->drawnTransform );
+	const bool blocks = own && !transformed && ((last.x | last.y | last.z) & (BRICKDIM - 1)) == 0;
+	vector<uint64_t> ownVoxels;			// transformed draw: position << 32 + index in the backup list
+	vector<uint> spanFirst;				// span draw: index of the first voxel of each span in the backup
+	if (transformed)
+	{
+		for (uint i = 0; i < backup->drawListSize; i++)
+		{
+			const uint v = backup->drawPos[i];
+			const int x = (v & 1023) - 512 + last.x, y = ((v >> 10) & 1023) - 512 + last.y, z = (v >> 20) - 512 + last.z;
+			ownVoxels.push_back( ((uint64_t)(x + (y << 10) + (z << 20)) << 32) + i );
+		}
+		sort( ownVoxels.begin(), ownVoxels.end() );
+	}
+	auto hitsUnder = [&]( const int x, const int y, const int z, const uint value )
+	{
+		// solid world voxel x,y,z covered by the resident sprite: the game may have written
+		// to it since the draw; otherwise, test what the sprite saved there
+		uint drawn, saved;
+		if (transformed)
+		{
+			const uint64_t key = (uint64_t)(x + (y << 10) + (z << 20)) << 32;
+			auto it = lower_bound( ownVoxels.begin(), ownVoxels.end(), key );
+			if (it == ownVoxels.end() || (*it >> 32) != (key >> 32)) return true;
+			drawn = s->drawnVal[(uint)*it], saved = backup->drawVal[(uint)*it];
+		}
+		else if (blocks)
+		{
+			const int lx = x - last.x, ly = y - last.y, lz = z - last.z;
+			const uint key = (lx >> BDIMLOG2) + ((ly >> BDIMLOG2) << 10) + ((lz >> BDIMLOG2) << 20);
+			const uint i = (uint)(lower_bound( own->blockPos, own->blockPos + own->blockCount, key ) - own->blockPos);
+			const uint v = i * BRICKSIZE + (lx & (BRICKDIM - 1)) + (ly & (BRICKDIM - 1)) * BRICKDIM + (lz & (BRICKDIM - 1)) * BRICKDIM * BRICKDIM;
+			drawn = own->blockVal[v], saved = s->blockBackup[v];
+		}
+		else
+		{
+			if (spanFirst.empty()) for (uint i = 0, k = 0; i < own->spanCount; k += own->spanLength[i++]) spanFirst.push_back( k );
+			const int lx = x - last.x;
+			const uint key = lx + ((y - last.y) << 10) + ((z - last.z) << 20);
+			const uint i = (uint)(upper_bound( own->spanPos, own->spanPos + own->spanCount, key ) - own->spanPos) - 1;
+			const uint k = spanFirst[i] + lx - (own->spanPos[i] & 1023);
+			drawn = own->drawVal[k], saved = backup->buffer[k];
+		}
+		return value != drawn || saved != 0;
+	};
+	for (BrickIterator it( this, pos, pos + frame->size ); it.Next();)
+	{
+		int3 lo = it.lo, hi = it.hi;
+		if (!it.IsBrick()) { if (!it.Color()) continue; }
+		else if (!ClipToOccupied( brickInfo[it.BrickIndex()], lo, hi )) continue;
+		const PAYLOAD* voxels = it.Voxels();
+		const int n = hi.x - lo.x;
+		for (int z = lo.z; z < hi.z; z++) for (int y = lo.y; y < hi.y; y++)
+		{
+			const int3 w = it.origin + make_int3( lo.x, y, z );
+			uint64_t bits = FrameBits( frame, w.x - pos.x, w.y - pos.y, w.z - pos.z, n ) << lo.x;
+			if (!bits) continue;
+			const PAYLOAD* row = voxels ? voxels + y * BRICKDIM + z * BRICKDIM * BRICKDIM : 0;
+			if (row) bits &= RowBits( row );
+			if (!own) { if (bits) return true; continue; }
+			if (!transformed)
+			{
+				// voxels outside the last draw hit; the others depend on what is under the sprite
+				const uint64_t covered = FrameBits( own, w.x - last.x, w.y - last.y, w.z - last.z, n ) << lo.x;
+				if (bits & ~covered) return true;
+			}
+			for (int x = lo.x; x < hi.x; x++) if (bits & (1ull << x))
+				if (hitsUnder( it.origin.x + x, w.y, w.z, row ? row[x] : it.Color() )) return true;
+		}
+	}
+	return false;
+}
+bool World::SpriteWorldHit( const uint idx )
+{
+	// overlap of the current frame at the current position with the world; like SpriteHit,
+	// this ignores the sprite transform
+	auto& sprite = GetSpriteList();
+	if (idx >= sprite.size() || sprite[idx]->currPos.x == OUTOFRANGE) return false;
+	return FrameHitsWorld( idx, sprite[idx]->frame[sprite[idx]->currFrame], sprite[idx]->currPos );
+}
+bool World::SweepSprite( const uint idx, const int3 delta, int3& reached )
+{
+	// continuous collision: move the current frame from the current position along delta, a
+	// voxel at a time along the dominant axis, so fast sprites can not skip thin walls. Returns
+	// true if it hits the world; 'reached' is the last position on the way where it fits.
+	auto& sprite = GetSpriteList();
+	if (idx >= sprite.size()) return false;
+	const Sprite* s = sprite[idx];
+	const int3 pos = reached = s->currPos;
+	if (pos.x == OUTOFRANGE) return false;
+	const SpriteFrame* frame = s->frame[s->currFrame];
+	const int steps = max( abs( delta.x ), max( abs( delta.y ), abs( delta.z ) ) );
+	if (steps == 0) return false;
+	// nothing in the swept box: the whole move is free
+	if (!s->resident && IsRegionEmpty( min( pos, pos + delta ), max( pos, pos + delta ) + frame->size ))
+	{
+		reached = pos + delta;
+		return false;
+	}
+	const float3 step = make_float3( delta ) * (1.0f / steps);
+	for (int i = 1; i <= steps; i++)
+	{
+		const float3 p = make_float3( pos ) + step * (float)i;
+		const int3 q = make_int3( (int)floorf( p.x + 0.5f ), (int)floorf( p.y + 0.5f ), (int)floorf( p.z + 0.5f ) );
+		if (FrameHitsWorld( idx, frame, q )) return true;
+		reached = q;
+	}
+	return false;
+}
+
 // ParticlesManager::CreateParticles
 // ----------------------------------------------------------------------------
 uint ParticlesManager::CreateParticles( const uint count )
@@ -1115,6 +2295,20 @@ uint ParticlesManager::CreateParticles( const uint count )
 	return (uint)(particles.size() - 1);
 }
 
+// ParticlesManager::CreateParticleSystem
+// ----------------------------------------------------------------------------
+uint ParticlesManager::CreateParticleSystem( const uint capacity, const float3 gravity, const float drag, const bool collide )
+{
+	// a set of particles that is simulated by World::UpdateParticles; starts empty
+	Particles* p = new Particles( capacity );
+	const uint padded = (capacity + 7) & ~7u;
+	float** arrays[] = { &p->px, &p->py, &p->pz, &p->vx, &p->vy, &p->vz, &p->life };
+	for (float** a : arrays) *a = (float*)_aligned_malloc( padded * sizeof( float ), 32 ), memset( *a, 0, padded * sizeof( float ) );
+	p->simulated = true, p->active = 0, p->gravity = gravity, p->drag = drag, p->collide = collide;
+	particles.push_back( p );
+	return (uint)(particles.size() - 1);
+}
+
 // World::SetParticle
 // ----------------------------------------------------------------------------
 void World::SetParticle( const uint set, const uint idx, const uint3 pos, const uint v )
@@ -1123,30 +2317,209 @@ void World::SetParticle( const uint set, const uint idx, const uint3 pos, const
 	particles[set]->voxel[idx] = make_uint4( pos, v );
 }
 
+// World::EmitParticle
+// ----------------------------------------------------------------------------
+bool World::EmitParticle( const uint set, const float3 pos, const float3 velocity, const uint v, const float life )
+{
+	// add a particle to a simulated set; returns false if the set is full
+	Particles* p = GetParticlesList()[set];
+	if (!p->simulated || p->active == p->count) return false;
+	const uint i = p->active++;
+	p->px[i] = pos.x, p->py[i] = pos.y, p->pz[i] = pos.z;
+	p->vx[i] = velocity.x, p->vy[i] = velocity.y, p->vz[i] = velocity.z;
+	p->life[i] = life;
+	p->voxel[i] = make_uint4( (uint)(int)floorf( pos.x ), (uint)(int)floorf( pos.y ), (uint)(int)floorf( pos.z ), v );
+	return true;
+}
+
+// World::EmitSpriteBurst
+// ----------------------------------------------------------------------------
+uint World::EmitSpriteBurst( const uint set, const uint sprite, const float3 velocity, const float3 spread, const float life, const uint stride )
+{
+	// turn every stride-th voxel of the current frame of a sprite into a particle, at its
+	// (untransformed) location in the world. Velocities get a random offset of up to
+	// 'spread' per axis. A removed sprite bursts where it was last drawn.
+	Sprite* s = GetSpriteList()[sprite];
+	const int3 pos = s->currPos.x != OUTOFRANGE ? s->currPos : s->lastPos;
+	if (pos.x == OUTOFRANGE) return 0;
+	const SpriteFrame* f = s->frame[s->currFrame];
+	uint emitted = 0;
+	for (uint i = 0, j = 0, k = 0; i < f->spanCount; i++)
+	{
+		const uint sp = f->spanPos[i];
+		const int3 p = pos + make_int3( sp & 1023, (sp >> 10) & 1023, sp >> 20 );
+		for (uint n = f->spanLength[i], x = 0; x < n; x++, j++) if (k++ % stride == 0)
+		{
+			const float3 r = make_float3( RandomFloat() * 2 - 1, RandomFloat() * 2 - 1, RandomFloat() * 2 - 1 );
+			if (!EmitParticle( set, make_float3( p.x + x + 0.5f, p.y + 0.5f, p.z + 0.5f ), velocity + r * spread, f->drawVal[j], life )) return emitted;
+			emitted++;
+		}
+	}
+	return emitted;
+}
+
+// World::UpdateParticles
+// ----------------------------------------------------------------------------
+void World::UpdateParticles( const uint set, const float dt )
+{
+	// advance a simulated set by dt: apply gravity and drag, move, optionally stop on solid
+	// voxels, and remove particles that ran out of time or left the world
+	Particles* p = GetParticlesList()[set];
+	if (!p->simulated || p->active == 0) return;
+	const __m256 damp8 = _mm256_set1_ps( max( 0.0f, 1 - p->drag * dt ) ), dt8 = _mm256_set1_ps( dt );
+	const __m256 gx8 = _mm256_set1_ps( p->gravity.x * dt ), gy8 = _mm256_set1_ps( p->gravity.y * dt );
+	const __m256 gz8 = _mm256_set1_ps( p->gravity.z * dt );
+	for (uint i = 0; i < p->active; i += 8) // arrays are padded to a multiple of 8
+	{
+		const __m256 vx8 = _mm256_add_ps( _mm256_mul_ps( _mm256_load_ps( p->vx + i ), damp8 ), gx8 );
+		const __m256 vy8 = _mm256_add_ps( _mm256_mul_ps( _mm256_load_ps( p->vy + i ), damp8 ), gy8 );
+		const __m256 vz8 = _mm256_add_ps( _mm256_mul_ps( _mm256_load_ps( p->vz + i ), damp8 ), gz8 );
+		_mm256_store_ps( p->vx + i, vx8 ), _mm256_store_ps( p->vy + i, vy8 ), _mm256_store_ps( p->vz + i, vz8 );
+		_mm256_store_ps( p->px + i, _mm256_add_ps( _mm256_load_ps( p->px + i ), _mm256_mul_ps( vx8, dt8 ) ) );
+		_mm256_store_ps( p->py + i, _mm256_add_ps( _mm256_load_ps( p->py + i ), _mm256_mul_ps( vy8, dt8 ) ) );
+		_mm256_store_ps( p->pz + i, _mm256_add_ps( _mm256_load_ps( p->pz + i ), _mm256_mul_ps( vz8, dt8 ) ) );
+		_mm256_store_ps( p->life + i, _mm256_sub_ps( _mm256_load_ps( p->life + i ), dt8 ) );
+	}
+	auto solid = [this]( const uint x, const uint y, const uint z ) {
+		// collision test: uniform cells answer directly, bricks via their occupied rows
+		const uint g = grid[(x >> BDIMLOG2) + (z >> BDIMLOG2) * GRIDWIDTH + (y >> BDIMLOG2) * GRIDWIDTH * GRIDDEPTH];
+		if ((g & 1) == 0) return g != 0;
+		const uint lx = x & (BRICKDIM - 1), ly = y & (BRICKDIM - 1), lz = z & (BRICKDIM - 1), bits = OccupiedBits( lx, ly, lz );
+		if ((brickInfo[g >> 1].occupied & bits) != bits) return false;
+		return brick[(g >> 1) * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM] != 0;
+	};
+	for (uint i = 0; i < p->active;)
+	{
+		const float x = p->px[i], y = p->py[i], z = p->pz[i];
+		if (p->life[i] <= 0 || !(x >= 0 && x < MAPWIDTH && y >= 0 && y < MAPHEIGHT && z >= 0 && z < MAPDEPTH))
+		{
+			// remove: the last particle takes its place
+			const uint last = --p->active;
+			p->px[i] = p->px[last], p->py[i] = p->py[last], p->pz[i] = p->pz[last];
+			p->vx[i] = p->vx[last], p->vy[i] = p->vy[last], p->vz[i] = p->vz[last];
+			p->life[i] = p->life[last], p->voxel[i].w = p->voxel[last].w;
+			continue;
+		}
+		if (p->collide && solid( (uint)x, (uint)y, (uint)z ))
+		{
+			// moved into a solid voxel: step back and come to rest. Particles that start
+			// inside something (e.g. a burst from a sprite that is still drawn) pass through.
+			const float bx = x - p->vx[i] * dt, by = y - p->vy[i] * dt, bz = z - p->vz[i] * dt;
+			if (bx >= 0 && bx < MAPWIDTH && by >= 0 && by < MAPHEIGHT && bz >= 0 && bz < MAPDEPTH && !solid( (uint)bx, (uint)by, (uint)bz ))
+				p->px[i] = bx, p->py[i] = by, p->pz[i] = bz, p->vx[i] = p->vy[i] = p->vz[i] = 0;
+		}
+		p->voxel[i] = make_uint4( (uint)p->px[i], (uint)p->py[i], (uint)p->pz[i], p->voxel[i].w );
+		i++;
+	}
+}
+
 // World::DrawParticles
 // ----------------------------------------------------------------------------
-void World::DrawParticles( const uint set )
+static inline uint ParticlePart( const uint4& v, const uint parts )
 {
-	auto& particles = GetParticlesList();
-	if (particles[set]->count == 0 || particles[set]->voxel[0].x == OUTOFRANGE) return; // inactive
-	for (uint s = particles[set]->count, i = 0; i < s; i++)
+	// neighbouring grid cells go to different parts, to spread a cloud of particles
+	return ((v.x >> BDIMLOG2) + (v.y >> BDIMLOG2) * 7 + (v.z >> BDIMLOG2) * 13) % parts;
+}
+static inline uint ParticleCell( const uint4& v )
+{
+	return (v.x >> BDIMLOG2) + (v.z >> BDIMLOG2) * GRIDWIDTH + (v.y >> BDIMLOG2) * GRIDWIDTH * GRIDDEPTH;
+}
+static inline ushort ParticleVoxel( const uint4& v )
+{
+	const uint m = BRICKDIM - 1;
+	return (ushort)((v.x & m) + (v.y & m) * BRICKDIM + (v.z & m) * BRICKDIM * BRICKDIM);
+}
+#define PARTICLEBATCH 64
+void World::DrawParticles( const uint set, const uint part, const uint parts )
+{
+	// consecutive particles tend to share a brick (a burst, a trail, a stream of debris);
+	// they are written in batches, with a single grid lookup per batch
+	Particles* p = GetParticlesList()[set];
+	ushort local[PARTICLEBATCH];
+	PAYLOAD val[PARTICLEBATCH], old[PARTICLEBATCH];
+	uint idx[PARTICLEBATCH];
+	for (uint n = p->drawn, i = 0; i < n;)
 	{
-		const uint4 v = particles[set]->voxel[i];
-		particles[set]->backup[i] = make_uint4( v.x, v.y, v.z, Get( v.x, v.y, v.z ) );
-		Set( v.x, v.y, v.z, v.w );
+		uint k = 0, cellIdx = 0;
+		for (; i < n && k < PARTICLEBATCH; i++)
+		{
+			const uint4 v = p->voxel[i];
+			if (parts > 1 && ParticlePart( v, parts ) != part) continue;
+			if (v.x >= MAPWIDTH || v.y >= MAPHEIGHT || v.z >= MAPDEPTH) { p->backup[i] = make_uint4( v.x, v.y, v.z, 0 ); continue; }
+			const uint c = ParticleCell( v );
+			if (k > 0 && c != cellIdx) break;
+			cellIdx = c, local[k] = ParticleVoxel( v ), val[k] = (PAYLOAD)v.w, idx[k++] = i;
+		}
+		if (k == 0) continue;
+		SetCellVoxels( cellIdx, local, k, val, old );
+		for (uint j = 0; j < k; j++) { const uint4 v = p->voxel[idx[j]]; p->backup[idx[j]] = make_uint4( v.x, v.y, v.z, old[j] ); }
 	}
 }
 
 // World::EraseParticles
 // ----------------------------------------------------------------------------
-void World::EraseParticles( const uint set )
+void World::EraseParticles( const uint set, const uint part, const uint parts )
+{
+	// restore the backups in reverse order, batched like DrawParticles
+	Particles* p = GetParticlesList()[set];
+	ushort local[PARTICLEBATCH];
+	PAYLOAD val[PARTICLEBATCH];
+	for (int i = (int)p->drawn - 1; i >= 0;)
+	{
+		uint k = 0, cellIdx = 0;
+		for (; i >= 0 && k < PARTICLEBATCH; i--)
+		{
+			const uint4 v = p->backup[i];
+			if (parts > 1 && ParticlePart( v, parts ) != part) continue;
+			if (v.x >= MAPWIDTH || v.y >= MAPHEIGHT || v.z >= MAPDEPTH) continue;
+			const uint c = ParticleCell( v );
+			if (k > 0 && c != cellIdx) break;
+			cellIdx = c, local[k] = ParticleVoxel( v ), val[k++] = (PAYLOAD)v.w;
+		}
+		if (k > 0) SetCellVoxels( cellIdx, local, k, val, 0 );
+	}
+}
+
+// World::RunParticleJobs (private; called from World::Commit)
+// ----------------------------------------------------------------------------
+void World::ParticleJob::Main()
+{
+	// a voxel always lands in the same part, so each part sees the particles that hit
+	// it in list order, and erases them in reverse order: the backups stay consistent
+	auto& particles = world->GetParticlesList();
+	const int count = (int)particles.size();
+	if (!erase) for (int i = 0; i < count; i++) world->DrawParticles( i, part, parts );
+	else for (int i = count - 1; i >= 0; i--) world->EraseParticles( i, part, parts );
+}
+void World::RunParticleJobs( const bool erase )
 {
 	auto& particles = GetParticlesList();
-	for (int s = (int)particles[set]->count, i = s - 1; i >= 0; i--)
+	uint total = 0;
+	for (Particles* p : particles)
+	{
+		if (!erase) p->drawn = (p->active == 0 || (!p->simulated && (int)p->voxel[0].x == OUTOFRANGE)) ? 0 : p->active;
+		total += p->drawn;
+	}
+	if (total == 0) return;
+#if THREADSAFEWORLD
+	TaskScheduler* scheduler = TaskScheduler::Get();
+	const uint parts = min( scheduler->GetNumThreads(), total / 4096 /* not worth it for a few particles */ );
+	if (parts > 1)
 	{
-		const uint4 v = particles[set]->backup[i];
-		Set( v.x, v.y, v.z, v.w );
+		if (!particleJob) particleJob = new ParticleJob[particleJobCount = scheduler->GetNumThreads()];
+		for (uint i = 0; i < parts; i++)
+		{
+			ParticleJob& job = particleJob[i];
+			job.world = this, job.part = i, job.parts = parts, job.erase = erase;
+			scheduler->Submit( &job );
+		}
+		for (uint i = 0; i < parts; i++) scheduler->Wait( particleJob + i );
+		return;
 	}
+#endif
+	ParticleJob job;
+	job.world = this, job.part = 0, job.parts = 1, job.erase = erase;
+	job.Main();
 }
 
 // TileManager::LoadTile
@@ -1164,17 +2537,83 @@ void World::DrawTile( const uint idx, const uint x, const uint y, const uint z )
 	auto& tile = GetTileList();
 	if (x >= GRIDWIDTH || y >= GRIDHEIGHT || z > GRIDDEPTH) return;
 	const uint cellIdx = x + z * GRIDWIDTH + y * GRIDWIDTH * GRIDDEPTH;
-	DrawTileVoxels( cellIdx, tile[idx]->voxels, tile[idx]->zeroes );
+	DrawTileVoxels( cellIdx, *tile[idx] );
+}
+void World::DrawTileVoxels( const uint cellIdx, Tile& tile )
+{
+	// the cell refers to the shared brick of the tile: no voxels are copied, and
+	// only the grid needs to go to the GPU
+	const uint g = TileCell( tile );
+	uint prev;
+#if THREADSAFEWORLD
+	if (g & 1) InterlockedAdd( (volatile LONG*)brickRefs + (g >> 1), 1 );
+	do prev = grid[cellIdx]; while ((uint)InterlockedCompareExchange( (volatile LONG*)grid + cellIdx, g, prev ) != prev);
+#else
+	if (g & 1) brickRefs[g >> 1]++;
+	prev = grid[cellIdx], grid[cellIdx] = g;
+#endif
+	if (prev & 1) ReleaseBrick( prev >> 1 );
+	gridChanged = true;
+	const uint bx = cellIdx % GRIDWIDTH, bz = (cellIdx / GRIDWIDTH) % GRIDDEPTH, by = cellIdx / (GRIDWIDTH * GRIDDEPTH);
+	UpdateSurface( make_int3( bx, by, bz ) * BRICKDIM, tile.voxels, 0 );
+}
+
+// World::TileCell (private)
+// ----------------------------------------------------------------------------
+uint World::TileCell( Tile& tile )
+{
+	// the grid cell value that places a tile: a uniform color, or a reference to the shared
+	// brick that holds the tile, which is made on first use and stays until the world goes
+	if (tile.cell != 0xffffffff) return tile.cell;
+	bool uniform = true;
+	for (int i = 1; i < BRICKSIZE; i++) uniform &= tile.voxels[i] == tile.voxels[0];
+	if (uniform) return tile.cell = tile.voxels[0] << 1;
+	const uint idx = NewBrick();
+	memcpy( brick + idx * BRICKSIZE, tile.voxels, BRICKSIZE * PAYLOADSIZE );
+	brickInfo[idx] = tile.info;
+	brickRefs[idx] = 1; // the tile holds a reference of its own
+#if THREADSAFEWORLD
+	// several threads may place a new tile at once; the first brick wins
+	_interlockedbittestandset( (LONG*)shared + (idx >> 5), idx & 31 );
+	const uint seen = (uint)InterlockedCompareExchange( (volatile LONG*)&tile.cell, (idx << 1) | 1, 0xffffffff );
+	if (seen != 0xffffffff)
+	{
+		_interlockedbittestandreset( (LONG*)shared + (idx >> 5), idx & 31 );
+		brickRefs[idx] = 0;
+		FreeBrick( idx );
+		return seen;
+	}
+#else
+	shared[idx >> 5] |= 1 << (idx & 31);
+	tile.cell = (idx << 1) | 1;
+#endif
+	Mark( idx ); // tag to be synced with GPU, once
+	return tile.cell;
 }
-void World::DrawTileVoxels( const uint cellIdx, const PAYLOAD* voxels, const uint zeroes )
+
+// World::CopySharedBrick (private)
+// ----------------------------------------------------------------------------
+uint World::CopySharedBrick( const uint cellIdx, const uint g )
 {
-	const uint g = grid[cellIdx];
-	uint brickIdx;
-	if ((g & 1) == 1) brickIdx = g >> 1; else brickIdx = NewBrick(), grid[cellIdx] = (brickIdx << 1) | 1;
-	// copy tile data to brick
-	memcpy( brick + brickIdx * BRICKSIZE, voxels, BRICKSIZE * PAYLOADSIZE );
-	Mark( brickIdx );
-	brickInfo[brickIdx].zeroes = zeroes;
+	// a cell that refers to a tile brick is about to be written to: give it a private copy.
+	// Returns the new grid value of the cell.
+	const uint idx = g >> 1, newIdx = NewBrick(), ng = (newIdx << 1) | 1;
+	memcpy( brick + newIdx * BRICKSIZE, brick + idx * BRICKSIZE, BRICKSIZE * PAYLOADSIZE );
+	brickInfo[newIdx] = brickInfo[idx];
+#if THREADSAFEWORLD
+	if (writeMode == WRITE_SHARED)
+	{
+		// another thread may be copying the same cell; continue with its copy if it was first
+		const uint seen = (uint)InterlockedCompareExchange( (volatile LONG*)grid + cellIdx, ng, g );
+		if (seen != g) { FreeBrick( newIdx ); return seen; }
+	}
+	else grid[cellIdx] = ng;
+#else
+	grid[cellIdx] = ng;
+#endif
+	ReleaseBrick( idx );
+	Mark( newIdx );
+	return ng;
 }
 
 // World::DrawTiles
@@ -1203,14 +2642,14 @@ void World::DrawBigTile( const uint idx, const uint x, const uint y, const uint
 	auto& bigTile = GetBigTileList();
 	if (x >= GRIDWIDTH / 2 || y >= GRIDHEIGHT / 2 || z > GRIDDEPTH / 2) return;
 	const uint cellIdx = x * 2 + z * 2 * GRIDWIDTH + y * 2 * GRIDWIDTH * GRIDDEPTH;
-	DrawTileVoxels( cellIdx, bigTile[idx]->tile[0].voxels, bigTile[idx]->tile[0].zeroes );
-	DrawTileVoxels( cellIdx + 1, bigTile[idx]->tile[1].voxels, bigTile[idx]->tile[1].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH * GRIDDEPTH, bigTile[idx]->tile[2].voxels, bigTile[idx]->tile[2].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH * GRIDDEPTH + 1, bigTile[idx]->tile[3].voxels, bigTile[idx]->tile[3].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH, bigTile[idx]->tile[4].voxels, bigTile[idx]->tile[4].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH + 1, bigTile[idx]->tile[5].voxels, bigTile[idx]->tile[5].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH + GRIDWIDTH * GRIDDEPTH, bigTile[idx]->tile[6].voxels, bigTile[idx]->tile[6].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH + GRIDWIDTH * GRIDDEPTH + 1, bigTile[idx]->tile[7].voxels, bigTile[idx]->tile[7].zeroes );
+	DrawTileVoxels( cellIdx, bigTile[idx]->tile[0] );
+	DrawTileVoxels( cellIdx + 1, bigTile[idx]->tile[1] );
+	DrawTileVoxels( cellIdx + GRIDWIDTH * GRIDDEPTH, bigTile[idx]->tile[2] );
+	DrawTileVoxels( cellIdx + GRIDWIDTH * GRIDDEPTH + 1, bigTile[idx]->tile[3] );
+	DrawTileVoxels( cellIdx + GRIDWIDTH, bigTile[idx]->tile[4] );
+	DrawTileVoxels( cellIdx + GRIDWIDTH + 1, bigTile[idx]->tile[5] );
+	DrawTileVoxels( cellIdx + GRIDWIDTH + GRIDWIDTH * GRIDDEPTH, bigTile[idx]->tile[6] );
+	DrawTileVoxels( cellIdx + GRIDWIDTH + GRIDWIDTH * GRIDDEPTH + 1, bigTile[idx]->tile[7] );
 }
 
 // World::DrawBigTiles
@@ -1233,43 +2672,80 @@ float4 FixZeroDeltas( float4 V )
 	if (fabs( V.z ) < 1e-8f) V.z = V.z < 0 ? -1e-8f : 1e-8f;
 	return V;
 }
-uint World::TraceRay( float4 A, const float4 B, float& dist, float3& N, int steps )
+// traversal core, specialized at compile time per query type:
+// TRACE_CLOSEST: first non-empty voxel; returns the voxel, dist and N.
+// TRACE_ANY:     any non-empty voxel; returns the voxel and dist, N is not touched.
+// TRACE_VOID:    first empty voxel; leaving the map counts as empty.
+// RANGED variants start at tmin and give up beyond tmax; CAPPED variants give up
+// after 'steps' top-level grid cells. A miss returns 0 with dist = 1e34f.
+template <int QUERY, bool CAPPED, bool RANGED>
+uint World::Traverse( float4 A, const float4 B, float& dist, float3& N, const float tmin, const float tmax, int steps )
 {
 	const float4 V = FixZeroDeltas( B ), rV = make_float4( 1 / V.x, 1 / V.y, 1 / V.z, 1 );
 	const bool originOutsideGrid = A.x < 0 || A.y < 0 || A.z < 0 || A.x > MAPWIDTH || A.y > MAPHEIGHT || A.z > MAPDEPTH;
+	const int bits = SELECT( 4, 34, V.x > 0 ) + SELECT( 3072, 10752, V.y > 0 ) + SELECT( 1310720, 3276800, V.z > 0 ); // magic
 	float to = 0; // distance to travel to get into grid
-	if (steps == 999999 && originOutsideGrid)
-	{
-		// use slab test to clip ray origin against scene AABB
-		const float tx1 = -A.x * rV.x, tx2 = (MAPWIDTH - A.x) * rV.x;
-		float tmin = min( tx1, tx2 ), tmax = max( tx1, tx2 );
-		const float ty1 = -A.y * rV.y, ty2 = (MAPHEIGHT - A.y) * rV.y;
-		tmin = max( tmin, min( ty1, ty2 ) ), tmax = min( tmax, max( ty1, ty2 ) );
-		const float tz1 = -A.z * rV.z, tz2 = (MAPDEPTH - A.z) * rV.z;
-		tmin = max( tmin, min( tz1, tz2 ) ), tmax = min( tmax, max( tz1, tz2 ) );
-		if (tmax < tmin || tmax <= 0) return 0; /* ray misses scene */ else A += tmin * V; // new ray entry point
-		to = tmin;
+	uint last = 0;
+	if (QUERY == TRACE_VOID)
+	{
+		// we start outside the grid, and thus in empty space: don't do that
+		if (originOutsideGrid) { dist = 0, N = make_float3( 0 ); return 0; }
+		if (RANGED)
+		{
+			// a range that starts beyond the map exit starts in the empty space outside it
+			const float ex = max( -A.x * rV.x, (MAPWIDTH - A.x) * rV.x ), ey = max( -A.y * rV.y, (MAPHEIGHT - A.y) * rV.y );
+			const float ez = max( -A.z * rV.z, (MAPDEPTH - A.z) * rV.z );
+			if (tmin >= min( ex, min( ey, ez ) ))
+			{
+				last = ex <= min( ey, ez ) ? 0 : (ey <= ez ? 1 : 2), dist = tmin;
+				N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
+				return 1;
+			}
+			A += (to = tmin) * V;
+		}
+	}
+	else
+	{
+		if (originOutsideGrid || RANGED)
+		{
+			// use slab test to clip ray origin against scene AABB; a range also needs the exit
+			const float tx1 = -A.x * rV.x, tx2 = (MAPWIDTH - A.x) * rV.x;
+			float t1 = min( tx1, tx2 ), t2 = max( tx1, tx2 );
+			const float ty1 = -A.y * rV.y, ty2 = (MAPHEIGHT - A.y) * rV.y;
+			t1 = max( t1, min( ty1, ty2 ) ), t2 = min( t2, max( ty1, ty2 ) );
+			const float tz1 = -A.z * rV.z, tz2 = (MAPDEPTH - A.z) * rV.z;
+			t1 = max( t1, min( tz1, tz2 ) ), t2 = min( t2, max( tz1, tz2 ) );
+			if (t2 < t1 || t2 <= 0 || (RANGED && (t1 > tmax || tmin >= t2))) { dist = 1e34f; return 0; } // ray misses scene
+			if (originOutsideGrid) to = t1;
+		}
+		if (RANGED) to = max( to, tmin );
+		if (to > 0)
+		{
+			A += to * V; // new ray entry point
+			// update 'last', for correct handling of hits on the border of the map
+			if (A.y < 0.01f || A.y > (MAPHEIGHT - 1.01f)) last = 1;
+			if (A.z < 0.01f || A.z > (MAPDEPTH - 1.01f)) last = 2;
+		}
 	}
 	uint tp = (clamp( (uint)A.x >> 3, 0u, 127u ) << 20) + (clamp( (uint)A.y >> 3, 0u, 127u ) << 10) +
 		clamp( (uint)A.z >> 3, 0u, 127u );
-	const int bits = SELECT( 4, 34, V.x > 0 ) + SELECT( 3072, 10752, V.y > 0 ) + SELECT( 1310720, 3276800, V.z > 0 ); // magic
 	float4 tm = (make_float4( (float)(((tp >> 20) & 127) + ((bits >> 5) & 1)), (float)(((tp >> 10) & 127) + ((bits >> 13) & 1)),
 		(float)((tp & 127) + ((bits >> 21) & 1)), 0 ) - A * 0.125f) * rV;
 	float t = 0;
 	const float4 td = make_float4( (float)DIR_X, (float)DIR_Y, (float)DIR_Z, 0 ) * rV;
-	uint last = 0;
 	do
 	{
+		if (CAPPED) if (!--steps) break;
+		if (RANGED) if (t * 8.0f + to > tmax) break;
 		// fetch brick from top grid
 		uint o = grid[(tp >> 20) + ((tp & 127) << 7) + (((tp >> 10) & 127) << 14)];
-		if (!--steps) break;
-		if (o != 0) if ((o & 1) == 0) /* solid */
+		if (QUERY == TRACE_VOID ? (o == 0) : (o != 0 && (o & 1) == 0)) /* query satisfied by a solid or empty cell */
 		{
-			dist = (t + to) * 8.0f;
-			N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
-			return o >> 1;
+			dist = t * 8.0f + to;
+			if (QUERY != TRACE_ANY) N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
+			return QUERY == TRACE_VOID ? 1 : (o >> 1);
 		}
-		else // brick
+		if (o & 1) // brick
 		{
 			// backup top-grid traversal state
 			const float4 tm_ = tm;
@@ -1277,17 +2753,18 @@ uint World::TraceRay( float4 A, const float4 B, float& dist, float3& N, int step
 			tm = A + V * (t *= 8); // abusing tm for I to save registers
 			uint p = (clamp( (uint)tm.x, tp >> 17, (tp >> 17) + 7 ) << 20) +
 				(clamp( (uint)tm.y, (tp >> 7) & 1023, ((tp >> 7) & 1023) + 7 ) << 10) +
-				clamp( (uint)tm.z, (tp << 3) & 1023, ((tp << 3) & 1023) + 7 ), lp = ~1;
+				clamp( (uint)tm.z, (tp << 3) & 1023, ((tp << 3) & 1023) + 7 );
 			tm = (make_float4( (float)((p >> 20) + OFFS_X), (float)(((p >> 10) & 1023) + OFFS_Y), (float)((p & 1023) + OFFS_Z), 0 ) - A) * rV;
 			p &= 7 + (7 << 10) + (7 << 20), o = (o >> 1) * BRICKSIZE;
 			do // traverse brick
 			{
 				const uint v = brick[o + (p >> 20) + ((p >> 7) & (BMSK * BRICKDIM)) + (p & BMSK) * BDIM2];
-				if (v)
+				if (QUERY == TRACE_VOID ? (v == 0) : (v != 0))
 				{
+					if (RANGED) if (t + to > tmax) { dist = 1e34f; return 0; }
 					dist = t + to;
-					N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
-					return v;
+					if (QUERY != TRACE_ANY) N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
+					return QUERY == TRACE_VOID ? 1 : v;
 				}
 				t = min( tm.x, min( tm.y, tm.z ) );
 				if (t == tm.x) tm.x += td.x, p += DIR_X << 20, last = 0;
@@ -1301,126 +2778,276 @@ uint World::TraceRay( float4 A, const float4 B, float& dist, float3& N, int step
 		else if (t == tm.y) tm.y += td.y, tp += DIR_Y << 10, last = 1;
 		else if (t == tm.z) tm.z += td.z, tp += DIR_Z, last = 2;
 	} while (!(tp & 0xf80e0380));
-	return 0U;
+	if (QUERY == TRACE_VOID && (tp & 0xf80e0380))
+	{
+		// we left the map; outside the grid everything is empty
+		dist = t * 8.0f + to;
+		N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
+		return 1;
+	}
+	dist = 1e34f;
+	return 0;
+}
+uint World::TraceRay( float4 A, const float4 B, float& dist, float3& N )
+{
+	return Traverse<TRACE_CLOSEST, false, false>( A, B, dist, N, 0, 1e34f, 0 );
+}
+uint World::TraceRay( float4 A, const float4 B, float& dist, float3& N, const float tmin, const float tmax )
+{
+	return Traverse<TRACE_CLOSEST, false, true>( A, B, dist, N, tmin, tmax, 0 );
+}
+uint World::TraceRayCapped( float4 A, const float4 B, float& dist, float3& N, const int steps )
+{
+	return Traverse<TRACE_CLOSEST, true, false>( A, B, dist, N, 0, 1e34f, steps );
+}
+bool World::TraceOcclusion( float4 A, const float4 B, const float tmin, const float tmax )
+{
+	float dist;
+	float3 dummy;
+	return Traverse<TRACE_ANY, false, true>( A, B, dist, dummy, tmin, tmax, 0 ) != 0;
 }
 void World::TraceRayToVoid( float4 A, const float4 B, float& dist, float3& N )
 {
-	// find the first empty voxel
-	const float4 V = FixZeroDeltas( B ), rV = make_float4( 1 / V.x, 1 / V.y, 1 / V.z, 1 );
-	if (A.x < 0 || A.y < 0 || A.z < 0 || A.x > MAPWIDTH || A.y > MAPHEIGHT || A.z > MAPDEPTH)
+	Traverse<TRACE_VOID, false, false>( A, B, dist, N, 0, 1e34f, 0 );
+}
+
+// World::GetBatchBuffer / World::TraceBatch
+// ----------------------------------------------------------------------------
+// Ray batches are traced asynchronously: NewBatch hands out one of RAYBATCHES
+// slots, each with its own ray and result buffers; SubmitBatch enqueues upload,
+// kernel and readback without blocking, so several batches can be in flight.
+// Slot 0 is reserved for the blocking TraceBatch / TraceBatchToVoid interface.
+// Host buffers are pinned, and only the used part of a batch is transferred.
+// Optionally, rays are reordered for coherence before tracing (see ReorderBatch);
+// results are then scattered back to the original ray order on completion.
+enum { BATCH_FREE = 0, BATCH_FILLING, BATCH_INFLIGHT, BATCH_DONE };
+static struct RayBatch
+{
+	Buffer* rays, * results;					// user-facing ray and result buffers
+	Buffer* sortedRays, * sortedResults;		// reordered copies, created on first use
+	uint* order;								// sorted position -> original ray index
+	cl_event done;
+	uint state, capacity, size;
+	bool reordered;
+} rayBatch[RAYBATCHES + 1] = {};
+
+void World::InitBatch( const uint batch, const uint maxRays )
+{
+	RayBatch& b = rayBatch[batch];
+	if (b.capacity >= maxRays) return;
+	// (re)allocate; buffers only grow, so steady-state batches never reallocate
+	delete b.rays;
+	delete b.results;
+	delete b.sortedRays;
+	delete b.sortedResults;
+	delete[] b.order;
+	b.sortedRays = b.sortedResults = 0, b.order = 0;
+	b.rays = new Buffer( maxRays * sizeof( Ray ) / 4, Buffer::READONLY | Buffer::PINNED );
+	b.results = new Buffer( maxRays * sizeof( Intersection ) / 4, Buffer::WRITEONLY | Buffer::PINNED );
+	b.capacity = maxRays;
+	// batch buffers are passed per submission; the uberGrid is the same for all
+	if (!Kernel::clStarted) return;
+	batchTracer->SetArgument( 8, &uberGrid );
+	batchToVoidTracer->SetArgument( 8, &uberGrid );
+}
+
+// 10-bit to 30-bit Morton code helper: insert two zero bits after each bit
+static inline uint MortonSpread( uint v )
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+void World::ReorderBatch( const uint batch, const uint batchSize )
+{
+	RayBatch& b = rayBatch[batch];
+	const uint cap = b.capacity;
+	if (!b.order)
 	{
-		dist = 0; // we start outside the grid, and thus in empty space: don't do that
-		return;
+		b.sortedRays = new Buffer( cap * sizeof( Ray ) / 4, Buffer::READONLY | Buffer::PINNED );
+		b.sortedResults = new Buffer( cap * sizeof( Intersection ) / 4, Buffer::WRITEONLY | Buffer::PINNED );
+		b.order = new uint[cap * 4]; // order, keys, and two sort buffers
 	}
-	uint tp = (clamp( (uint)A.x >> 3, 0u, 127u ) << 20) + (clamp( (uint)A.y >> 3, 0u, 127u ) << 10) +
-		clamp( (uint)A.z >> 3, 0u, 127u );
-	const int bits = SELECT( 4, 34, V.x > 0 ) + SELECT( 3072, 10752, V.y > 0 ) + SELECT( 1310720, 3276800, V.z > 0 ); // magic
-	float4 tm = (make_float4( (float)(((tp >> 20) & 127) + ((bits >> 5) & 1)), (float)(((tp >> 10) & 127) + ((bits >> 13) & 1)),
-		(float)((tp & 127) + ((bits >> 21) & 1)), 0 ) - A * 0.125f) * rV;
-	float t = 0;
-	const float4 td = make_float4( (float)DIR_X, (float)DIR_Y, (float)DIR_Z, 0 ) * rV;
-	uint last = 0;
-	do
+	// sort key: direction octant in the top bits, Morton code of the origin (at 2x2x2
+	// voxel granularity) below that, so similar rays end up in the same warp / packet.
+	const Ray* rays = (const Ray*)b.rays->hostBuffer;
+	uint* idx = b.order, * key = idx + cap, * idx2 = key + cap, * key2 = idx2 + cap;
+	for (uint i = 0; i < batchSize; i++)
 	{
-		// fetch brick from top grid
-		uint o = grid[(tp >> 20) + ((tp & 127) << 7) + (((tp >> 10) & 127) << 14)];
-		if (o == 0) /* empty brick: done */
+		const Ray& r = rays[i];
+		const uint octant = (r.D.x < 0 ? 1 : 0) + (r.D.y < 0 ? 2 : 0) + (r.D.z < 0 ? 4 : 0);
+		const uint x = clamp( (int)r.O.x >> 1, 0, 511 );
+		const uint y = clamp( (int)r.O.y >> 1, 0, 511 );
+		const uint z = clamp( (int)r.O.z >> 1, 0, 511 );
+		key[i] = (octant << 27) + MortonSpread( x ) + (MortonSpread( y ) << 1) + (MortonSpread( z ) << 2), idx[i] = i;
+	}
+	// LSD radix sort over the 30-bit keys: three passes of 10 bits
+	for (uint shift = 0; shift < 30; shift += 10)
+	{
+		uint count[1024];
+		memset( count, 0, sizeof( count ) );
+		for (uint i = 0; i < batchSize; i++) count[(key[i] >> shift) & 1023]++;
+		for (uint sum = 0, i = 0; i < 1024; i++) { const uint c = count[i]; count[i] = sum, sum += c; }
+		for (uint i = 0; i < batchSize; i++)
 		{
-			dist = t * 8.0f;
-			N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
-			return;
+			const uint d = count[(key[i] >> shift) & 1023]++;
+			key2[d] = key[i], idx2[d] = idx[i];
 		}
-		else if ((o & 1) == 1) /* non-empty brick */
+		swap( key, key2 ), swap( idx, idx2 );
+	}
+	if (idx != b.order) memcpy( b.order, idx, batchSize * sizeof( uint ) );
+	// gather rays in sorted order
+	Ray* sorted = (Ray*)b.sortedRays->hostBuffer;
+	for (uint i = 0; i < batchSize; i++) sorted[i] = rays[b.order[i]];
+}
+
+void World::TraceBatchCPU( const Ray* rays, Intersection* results, const uint first, const uint last, const bool toVoid )
+{
+	// same results as the traceBatch / traceBatchToVoid kernels
+	for (uint i = first; i < last; i++)
+	{
+		const Ray& r = rays[i];
+		float3 N;
+		float dist;
+		uint voxel = 0;
+		if (toVoid)
 		{
-			// backup top-grid traversal state
-			const float4 tm_ = tm;
-			// intialize brick traversal
-			tm = A + V * (t *= 8); // abusing tm for I to save registers
-			uint p = (clamp( (uint)tm.x, tp >> 17, (tp >> 17) + 7 ) << 20) +
-				(clamp( (uint)tm.y, (tp >> 7) & 1023, ((tp >> 7) & 1023) + 7 ) << 10) +
-				clamp( (uint)tm.z, (tp << 3) & 1023, ((tp << 3) & 1023) + 7 ), lp = ~1;
-			tm = (make_float4( (float)((p >> 20) + OFFS_X), (float)(((p >> 10) & 1023) + OFFS_Y), (float)((p & 1023) + OFFS_Z), 0 ) - A) * rV;
-			p &= 7 + (7 << 10) + (7 << 20), o = (o >> 1) * BRICKSIZE;
-			do // traverse brick
-			{
-				if (!brick[o + (p >> 20) + ((p >> 7) & (BMSK * BRICKDIM)) + (p & BMSK) * BDIM2])
-				{
-					dist = t;
-					N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
-					return;
-				}
-				t = min( tm.x, min( tm.y, tm.z ) );
-				if (t == tm.x) tm.x += td.x, p += DIR_X << 20, last = 0;
-				else if (t == tm.y) tm.y += td.y, p += ((bits << 2) & 3072) - 1024, last = 1;
-				else if (t == tm.z) tm.z += td.z, p += DIR_Z, last = 2;
-			} while (!(p & TOPMASK3));
-			tm = tm_; // restore top-grid traversal state
+			TraceRayToVoid( make_float4( r.O, 1 ), make_float4( r.D, 1 ), dist, N );
+			if (dist >= r.t) dist = 1e34f;
 		}
-		t = min( tm.x, min( tm.y, tm.z ) );
-		if (t == tm.x) tm.x += td.x, tp += DIR_X << 20, last = 0;
-		else if (t == tm.y) tm.y += td.y, tp += DIR_Y << 10, last = 1;
-		else if (t == tm.z) tm.z += td.z, tp += DIR_Z, last = 2;
-	} while (!(tp & 0xf80e0380));
+		else voxel = TraceRay( make_float4( r.O, 1 ), make_float4( r.D, 1 ), dist, N, 0, r.t );
+		const uint Nval = ((int)N.x + 1) + (((int)N.y + 1) << 2) + (((int)N.z + 1) << 4);
+		results[i].t = dist;
+		results[i].N = toVoid ? Nval : ((voxel == 0 ? 0 : Nval) + (voxel << 16));
+	}
+}
+
+void World::EnqueueBatch( const uint batch, const uint batchSize, const bool toVoid, const bool reorder )
+{
+	RayBatch& b = rayBatch[batch];
+	Kernel* tracer = toVoid ? batchToVoidTracer : batchTracer;
+	if (reorder) ReorderBatch( batch, batchSize );
+	Buffer* rays = reorder ? b.sortedRays : b.rays, * results = reorder ? b.sortedResults : b.results;
+	if (!Kernel::clStarted)
+	{
+		// no OpenCL device: trace on the CPU, on all cores; done when this returns
+		const Ray* r = (const Ray*)rays->hostBuffer;
+		Intersection* hits = (Intersection*)results->hostBuffer;
+		TaskScheduler::Get()->ParallelFor( 0, batchSize, 1024, [&]( uint first, uint last ) { TraceBatchCPU( r, hits, first, last, toVoid ); } );
+		b.done = 0, b.state = BATCH_INFLIGHT, b.size = batchSize, b.reordered = reorder;
+		return;
+	}
+	// copy the ray batch to the GPU; the in-order queue takes care of dependencies
+	rays->CopyToDevice( false, batchSize * sizeof( Ray ) / 4 );
+	// invoke ray tracing kernel; arguments are captured at enqueue time
+	tracer->SetArgument( 5, (int)batchSize );
+	tracer->SetArgument( 6, rays );
+	tracer->SetArgument( 7, results );
+	tracer->Run( batchSize );
+	// get results back from GPU
+	results->CopyFromDevice( false, &b.done, batchSize * sizeof( Intersection ) / 4 );
+	clFlush( Kernel::GetQueue() );
+	b.state = BATCH_INFLIGHT, b.size = batchSize, b.reordered = reorder;
 }
 
-static Buffer* rayBatchBuffer = 0;
-static Buffer* rayBatchResult = 0;
+void World::FinishBatch( const uint batch, const bool wait )
+{
+	RayBatch& b = rayBatch[batch];
+	if (b.state != BATCH_INFLIGHT) return;
+	if (b.done) // no event for batches that were traced on the CPU
+	{
+		cl_int status = CL_COMPLETE;
+		if (wait) clWaitForEvents( 1, &b.done );
+		else clGetEventInfo( b.done, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof( cl_int ), &status, 0 );
+		if (status != CL_COMPLETE) return;
+		clReleaseEvent( b.done );
+	}
+	b.done = 0, b.state = BATCH_DONE;
+	if (b.reordered)
+	{
+		// scatter results back to the original ray order
+		const Intersection* sorted = (const Intersection*)b.sortedResults->hostBuffer;
+		Intersection* results = (Intersection*)b.results->hostBuffer;
+		for (uint i = 0; i < b.size; i++) results[b.order[i]] = sorted[i];
+	}
+}
 
-Ray* World::GetBatchBuffer()
+uint World::NewBatch( const uint maxRays )
 {
-	if (!rayBatchBuffer)
+	for (uint i = 1; i <= RAYBATCHES; i++) if (rayBatch[i].state == BATCH_FREE)
 	{
-		uint* hostBuffer = new uint[SCRWIDTH * SCRHEIGHT * sizeof( Ray ) / 4];
-		rayBatchBuffer = new Buffer( SCRWIDTH * SCRHEIGHT * sizeof( Ray ) / 4, Buffer::DEFAULT, hostBuffer );
-		uint* hostResults = new uint[SCRWIDTH * SCRHEIGHT * sizeof( Intersection ) / 4];
-		rayBatchResult = new Buffer( SCRWIDTH * SCRHEIGHT * sizeof( Intersection ) / 4, Buffer::DEFAULT, hostResults );
-		// now that we have the buffers, we can pass them to the kernel (just once)
-		batchTracer->SetArgument( 6, rayBatchBuffer );
-		batchTracer->SetArgument( 7, rayBatchResult );
-		batchTracer->SetArgument( 8, &uberGrid );
-		batchToVoidTracer->SetArgument( 6, rayBatchBuffer );
-		batchToVoidTracer->SetArgument( 7, rayBatchResult );
-		batchToVoidTracer->SetArgument( 8, &uberGrid );
+		InitBatch( i, maxRays );
+		rayBatch[i].state = BATCH_FILLING;
+		return i;
 	}
-	return (Ray*)rayBatchBuffer->hostBuffer;
+	FatalError( "NewBatch: all %i ray batches are in use.", RAYBATCHES );
+	return 0;
+}
+
+Ray* World::GetBatchBuffer( const uint batch )
+{
+	if (batch < 1 || batch > RAYBATCHES || rayBatch[batch].state != BATCH_FILLING)
+		FatalError( "GetBatchBuffer: batch %i was not obtained via NewBatch or was already submitted.", batch );
+	return (Ray*)rayBatch[batch].rays->hostBuffer;
+}
+
+void World::SubmitBatch( const uint batch, const uint batchSize, const bool toVoid, const bool reorder )
+{
+	// sanity checks
+	if (batch < 1 || batch > RAYBATCHES || rayBatch[batch].state != BATCH_FILLING)
+		FatalError( "SubmitBatch: batch %i was not obtained via NewBatch or was already submitted.", batch );
+	if (batchSize > rayBatch[batch].capacity) FatalError( "SubmitBatch: batch is larger than requested in NewBatch." );
+	if (batchSize == 0) rayBatch[batch].state = BATCH_DONE; else EnqueueBatch( batch, batchSize, toVoid, reorder );
+}
+
+bool World::BatchDone( const uint batch )
+{
+	FinishBatch( batch, false );
+	return rayBatch[batch].state == BATCH_DONE;
+}
+
+Intersection* World::GetBatchResults( const uint batch )
+{
+	FinishBatch( batch, true );
+	if (batch < 1 || batch > RAYBATCHES || rayBatch[batch].state != BATCH_DONE)
+		FatalError( "GetBatchResults: batch %i was not submitted.", batch );
+	return (Intersection*)rayBatch[batch].results->hostBuffer;
+}
+
+void World::FreeBatch( const uint batch )
+{
+	if (batch < 1 || batch > RAYBATCHES) return;
+	FinishBatch( batch, true ); // host buffers may still be in use by the queue
+	rayBatch[batch].state = BATCH_FREE;
+}
+
+Ray* World::GetBatchBuffer()
+{
+	InitBatch( 0, SCRWIDTH * SCRHEIGHT );
+	return (Ray*)rayBatch[0].rays->hostBuffer;
 }
 
 Intersection* World::TraceBatch( const uint batchSize )
 {
 	// sanity checks
-	if (!rayBatchBuffer) FatalError( "TraceBatch: Batch not yet created." );
-	if (batchSize > SCRWIDTH * SCRHEIGHT) FatalError( "TraceBatch: batch is too large." );
-	if (batchSize > 0)
-	{
-		// copy the ray batch to the GPU
-		rayBatchBuffer->CopyToDevice();
-		// invoke ray tracing kernel
-		batchTracer->SetArgument( 5, (int)batchSize );
-		batchTracer->Run( batchSize );
-		// get results back from GPU
-		rayBatchResult->CopyFromDevice( true /* blocking */ );
-	}
+	if (!rayBatch[0].rays) FatalError( "TraceBatch: Batch not yet created." );
+	if (batchSize > rayBatch[0].capacity) FatalError( "TraceBatch: batch is too large." );
+	if (batchSize > 0) EnqueueBatch( 0, batchSize, false, false ), FinishBatch( 0, true );
 	// return host buffer with ray tracing results
-	return (Intersection*)rayBatchResult->hostBuffer;
+	return (Intersection*)rayBatch[0].results->hostBuffer;
 }
 
 Intersection* World::TraceBatchToVoid( const uint batchSize )
 {
 	// sanity checks
-	if (!rayBatchBuffer) FatalError( "TraceBatchToVoid: Batch not yet created." );
-	if (batchSize > SCRWIDTH * SCRHEIGHT) FatalError( "TraceBatchToVoid: batch is too large." );
-	if (batchSize > 0)
-	{
-		// copy the ray batch to the GPU
-		rayBatchBuffer->CopyToDevice();
-		// invoke ray tracing kernel
-		batchToVoidTracer->SetArgument( 5, (int)batchSize );
-		batchToVoidTracer->Run( batchSize );
-		// get results back from GPU
-		rayBatchResult->CopyFromDevice( true /* blocking */ );
-	}
+	if (!rayBatch[0].rays) FatalError( "TraceBatchToVoid: Batch not yet created." );
+	if (batchSize > rayBatch[0].capacity) FatalError( "TraceBatchToVoid: batch is too large." );
+	if (batchSize > 0) EnqueueBatch( 0, batchSize, true, false ), FinishBatch( 0, true );
 	// return host buffer with ray tracing results
-	return (Intersection*)rayBatchResult->hostBuffer;
+	return (Intersection*)rayBatch[0].results->hostBuffer;
 }
 
 /*
@@ -1511,6 +3138,8 @@ void World::Render()
 		params.frame = frame++ & 255;
 		for (int i = 0; i < 6; i++) params.skyLight[i] = skyLight[i];
 		params.skyLightScale = Game::skyDomeLightScale;
+		// without an OpenCL device, Commit renders the frame on the CPU instead
+		if (!Kernel::clStarted) return;
 		// get render parameters to GPU and invoke kernel asynchronously
 		paramBuffer->CopyToDevice( false );
 		if (!screen)
@@ -1555,80 +3184,366 @@ void World::Render()
 	}
 }
 
+// cpu renderer helpers; these mirror their counterparts in cl/tools.cl and cl/trace.cl
+static const float halton[32] = {
+	0, 0, 0.5f, 0.333333f, 0, 0.6666666f, 0.75f, 0.111111111f, 0, 0.44444444f,
+	0.5f, 0.7777777f, 0.25f, 0.222222222f, 0.75f, 0.55555555f, 0, 0.88888888f,
+	0.5f, 0.03703703f, 0.25f, 0.37037037f, 0.75f, 0.70370370f, 0.125f, 0.148148148f,
+	0.625f, 0.481481481f, 0.375f, 0.814814814f, 0.875f, 0.259259259f
+};
+static float3 GenerateCameraRay( const float2 pixelPos, const RenderParams& p )
+{
+#if TAA
+	const uint px = (uint)pixelPos.x, py = (uint)pixelPos.y;
+	const uint h = (p.frame + (px & 3) + 4 * (py & 3)) & 15;
+	const float2 uv = make_float2( (pixelPos.x + halton[h * 2 + 0]) * p.oneOverRes.x, (pixelPos.y + halton[h * 2 + 1]) * p.oneOverRes.y );
+#else
+	const float2 uv = make_float2( pixelPos.x * p.oneOverRes.x, pixelPos.y * p.oneOverRes.y );
+#endif
+#if PANINI
+	// see PaniniProjection in cl/tools.cl
+	const float fov = PI / 5, d = 0.15f, d2 = d * d, fo = PI * 0.5f - fov * 0.5f;
+	const float f = cosf( fo ) / sinf( fo ) * 2.0f, f2 = f * f;
+	const float b = (sqrtf( max( 0.f, (d + d2) * (d + d2) * (f2 + f2 * f2) ) ) - (d * f + f)) / (d2 + d2 * f2 - 1);
+	const float h = (uv.x * 2 - 1) * b, v = (uv.y * 2 - 1) * ((float)SCRHEIGHT / SCRWIDTH) * b, h2 = h * h;
+	const float k = h2 / ((d + 1) * (d + 1)), k2 = k * k;
+	const float discr = max( 0.f, k2 * d2 - (k + 1) * (k * d2 - 1) );
+	const float cosPhi = (-k * d + sqrtf( discr )) / (k + 1.f);
+	const float S = (d + 1) / (d + cosPhi), tanTheta = v / S;
+	float sinPhi = sqrtf( max( 0.f, 1 - cosPhi * cosPhi ) );
+	if (h < 0) sinPhi *= -1;
+	const float3 V = make_float3( sinPhi, tanTheta, cosPhi ) * (1.0f / sqrtf( 1 + tanTheta * tanTheta ));
+	return V.z * normalize( (p.p1 + p.p2) * 0.5f - p.E ) + V.x * normalize( p.p1 - p.p0 ) + V.y * normalize( p.p2 - p.p0 );
+#else
+	return normalize( p.p0 + (p.p1 - p.p0) * uv.x + (p.p2 - p.p0) * uv.y - p.E );
+#endif
+}
+static float BlueNoiseSampler( const uint* blueNoise, int x, int y, int sampleIndex, int sampleDimension )
+{
+	x &= 127, y &= 127, sampleIndex &= 255, sampleDimension &= 255;
+	const int rankedSampleIndex = (sampleIndex ^ blueNoise[sampleDimension + (x + y * 128) * 8 + 65536 * 3]) & 255;
+	int value = blueNoise[sampleDimension + rankedSampleIndex * 256];
+	value ^= blueNoise[(sampleDimension & 7) + (x + y * 128) * 8 + 65536];
+	const float retVal = (0.5f + value) * (1.0f / 256.0f);
+	return retVal >= 1 ? retVal - 1 : retVal;
+}
+static float3 ToFloatRGB( const uint v )
+{
+#if PAYLOADSIZE == 1
+	return make_float3( (v >> 5) * (1.0f / 7.0f), ((v >> 2) & 7) * (1.0f / 7.0f), (v & 3) * (1.0f / 3.0f) );
+#else
+	return make_float3( ((v >> 8) & 15) * (1.0f / 15.0f), ((v >> 4) & 15) * (1.0f / 15.0f), (v & 15) * (1.0f / 15.0f) );
+#endif
+}
+static float4 SkyLightForNormal( const float3& N, const float4* skyLight )
+{
+	// matches the six normals in UpdateSkylights; N is axis aligned
+	if (N.x < -0.9f) return skyLight[0];
+	if (N.x > 0.9f) return skyLight[1];
+	if (N.y < -0.9f) return skyLight[2];
+	if (N.y > 0.9f) return skyLight[3];
+	return skyLight[N.z < 0 ? 4 : 5];
+}
+static uint ToScreenRGB( const float3& hdr )
+{
+	// ToneMapFilmic_Hejl2015 with whitePt = 1, followed by LinearToSRGB
+	const float4 vh = make_float4( hdr, 1 ), va = vh * 1.425f + 0.05f;
+	const float4 vf = (vh * va + 0.004f) / (vh * (va + 0.55f) + 0.0491f) - 0.0821f;
+	const float3 c = clamp( make_float3( vf ) * (1.0f / vf.w), 0.0f, 1.0f );
+	const float3 s = make_float3( powf( c.x * 1.055f, 1.0f / 2.4f ), powf( c.y * 1.055f, 1.0f / 2.4f ), powf( c.z * 1.055f, 1.0f / 2.4f ) ) - 0.055f;
+	const uint r = (uint)(255.0f * min( 1.0f, c.x < 0.0031308f ? c.x * 12.92f : s.x ) + 0.5f);
+	const uint g = (uint)(255.0f * min( 1.0f, c.y < 0.0031308f ? c.y * 12.92f : s.y ) + 0.5f);
+	const uint b = (uint)(255.0f * min( 1.0f, c.z < 0.0031308f ? c.z * 12.92f : s.z ) + 0.5f);
+	return (r << 16) + (g << 8) + b;
+}
+static float3 RGBToYCoCg( const float3& RGB )
+{
+	const float3 rgb = fminf( make_float3( 4 ), RGB ); // clamp helps AA for strong HDR
+	return make_float3( dot( rgb, make_float3( 1, 2, 1 ) ) * 0.25f,
+		dot( rgb, make_float3( 2, 0, -2 ) ) * 0.25f + (0.5f * 256.0f / 255.0f),
+		dot( rgb, make_float3( -1, 2, -1 ) ) * 0.25f + (0.5f * 256.0f / 255.0f) );
+}
+static float3 YCoCgToRGB( const float3& YCoCg )
+{
+	const float Y = YCoCg.x, Co = YCoCg.y - (0.5f * 256.0f / 255.0f), Cg = YCoCg.z - (0.5f * 256.0f / 255.0f);
+	return make_float3( Y + Co - Cg, Y + Cg, Y - Co - Cg );
+}
+static float3 BilerpSample( const float4* buffer, const float u, const float v, const int w, const int h )
+{
+	const int iu = (int)u, iv = (int)v;
+	if (iu <= 0 || iv <= 0 || iu >= w - 1 || iv >= h - 1) return make_float3( 0 );
+	const float fu = u - floorf( u ), fv = v - floorf( v );
+	const float4* p = buffer + iu + iv * w;
+	return make_float3( p[0] * ((1 - fu) * (1 - fv)) + p[1] * (fu * (1 - fv)) + p[w] * ((1 - fu) * fv) + p[w + 1] * (fu * fv) );
+}
+
+// World::RenderPixelCPU: render_whitted / render_gi from cl/kernels.cl
+// ----------------------------------------------------------------------------
+float4 World::RenderPixelCPU( const int x, const int y )
+{
+	const RenderParams& p = cpuParams;
+	float dist;
+	float3 N;
+#if GIRAYS == 0
+	// basic AA; TAA uses the distance of the last sample
+	float3 pixel = make_float3( 0 );
+	for (int u = 0; u < AA_SAMPLES; u++) for (int v = 0; v < AA_SAMPLES; v++)
+	{
+		const float2 P = make_float2( x + u * (1.0f / AA_SAMPLES), y + v * (1.0f / AA_SAMPLES) );
+		const float3 D = GenerateCameraRay( P, p );
+		const uint voxel = TraceRay( make_float4( p.E, 0 ), make_float4( D, 1 ), dist, N );
+		if (voxel == 0) return make_float4( SampleSky( make_float3( D.x, D.z, D.y ) ), 1e20f );
+		pixel += INVPI * ToFloatRGB( voxel ) * p.skyLightScale * make_float3( SkyLightForNormal( N, p.skyLight ) );
+	}
+	return make_float4( pixel * (1.0f / (AA_SAMPLES * AA_SAMPLES)), dist );
+#else
+	const float3 D = GenerateCameraRay( make_float2( (float)x, (float)y ), p );
+	const uint voxel = TraceRay( make_float4( p.E, 0 ), make_float4( D, 1 ), dist, N );
+	if (voxel == 0) return make_float4( SampleSky( make_float3( D.x, D.z, D.y ) ), 1e20f );
+	// indirect light: cosine weighted rays, blue noise sampled, capped at a short distance
+	const float3 BRDF1 = INVPI * ToFloatRGB( voxel );
+	const float4 I = make_float4( p.E + D * dist + 0.1f * N, 0 );
+	const uint* noise = blueNoise->hostBuffer;
+	float3 incoming = make_float3( 0 );
+	for (int i = 0; i < GIRAYS; i++)
+	{
+		const float r0 = BlueNoiseSampler( noise, x, y, i + GIRAYS * p.frame, 0 );
+		const float r1 = BlueNoiseSampler( noise, x, y, i + GIRAYS * p.frame, 1 );
+		const float3 R = DiffuseReflectionCosWeighted( r0, r1, N );
+		float dist2;
+		float3 N2;
+		const uint voxel2 = TraceRayCapped( I, make_float4( R, 1 ), dist2, N2, GRIDWIDTH / 12 );
+		float3 toAdd = make_float3( p.skyLightScale ), M = N;
+		if (voxel2 != 0) toAdd *= INVPI * ToFloatRGB( voxel2 ), M = N2;
+		incoming += toAdd * make_float3( SkyLightForNormal( M, p.skyLight ) );
+	}
+	return make_float4( BRDF1 * incoming * (1.0f / GIRAYS), dist );
+#endif
+}
+
+// World::RenderTilesCPU: one pass over a range of 16x16 screen tiles
+// ----------------------------------------------------------------------------
+void World::RenderTilesCPU( const int pass, const uint firstTile, const uint lastTile )
+{
+	const RenderParams& p = cpuParams;
+	const int w = cpuSize.x, h = cpuSize.y, tilesX = (w + 15) / 16;
+	const float4* histIn = cpuHistory[cpuHistIn];
+	float4* histOut = cpuHistory[cpuHistIn ^ 1];
+	uint* dst = cpuTarget->buffer;
+	for (int tile = firstTile; tile < (int)lastTile; tile++)
+	{
+		const int x1 = (tile % tilesX) * 16, y1 = (tile / tilesX) * 16;
+		const int x2 = min( w, x1 + 16 ), y2 = min( h, y1 + 16 );
+		for (int y = y1; y < y2; y++) for (int x = x1; x < x2; x++)
+		{
+			const int idx = x + y * w;
+			if (pass == 0) /* renderTAA / renderNoTAA */
+			{
+				const float4 pixel = RenderPixelCPU( x, y );
+			#if TAA == 0
+				dst[idx] = ToScreenRGB( make_float3( pixel ) );
+			#else
+				cpuFrame[idx] = pixel; // depth in w
+			#endif
+			}
+			else if (pass == 1) /* finalize: reproject, clamp history to the neighborhood, blend */
+			{
+				const float4 pixelData = cpuFrame[idx];
+				const float u = (float)x / w, v = (float)y / h;
+				const float3 D = normalize( p.p0 + (p.p1 - p.p0) * u + (p.p2 - p.p0) * v - p.E );
+				const float3 P = p.E + pixelData.w * D;
+				const float dl = dot( P, make_float3( p.Nleft ) ) - p.Nleft.w;
+				const float dr = dot( P, make_float3( p.Nright ) ) - p.Nright.w;
+				const float dt = dot( P, make_float3( p.Ntop ) ) - p.Ntop.w;
+				const float db = dot( P, make_float3( p.Nbottom ) ) - p.Nbottom.w;
+				float3 hist = BilerpSample( histIn, w * (dl / (dl + dr)), h * (dt / (dt + db)), w, h );
+				float3 colorAvg = make_float3( 0 ), colorVar = make_float3( 0 );
+				for (int ny = max( 0, y - 1 ); ny <= min( h - 1, y + 1 ); ny++)
+					for (int nx = max( 0, x - 1 ); nx <= min( w - 1, x + 1 ); nx++)
+					{
+						const float3 c = RGBToYCoCg( make_float3( cpuFrame[nx + ny * w] ) );
+						colorAvg += c, colorVar += c * c;
+					}
+				colorAvg *= 1.0f / 9.0f, colorVar *= 1.0f / 9.0f;
+				const float3 s2 = fmaxf( make_float3( 0 ), colorVar - colorAvg * colorAvg );
+				const float3 sigma = make_float3( sqrtf( s2.x ), sqrtf( s2.y ), sqrtf( s2.z ) );
+				hist = clamp( RGBToYCoCg( hist ), colorAvg - 1.25f * sigma, colorAvg + 1.25f * sigma );
+				histOut[idx] = make_float4( YCoCgToRGB( 0.9f * hist + 0.1f * RGBToYCoCg( make_float3( pixelData ) ) ), 1 );
+			}
+			else /* unsharpen; TAA blurs, this remedies it */
+			{
+				const float4* c = histOut + idx;
+				if (x == 0 || y == 0 || x == w - 1 || y == h - 1) { dst[idx] = ToScreenRGB( make_float3( *c ) ); continue; }
+				const float4 edges = c[-w] + c[1] + c[w] + c[-1], corners = c[-w - 1] + c[-w + 1] + c[w + 1] + c[w - 1];
+				const float4 color = fmaxf( *c, *c * 2.7f - 0.5f * (0.35f * corners + 0.5f * edges) );
+				dst[idx] = ToScreenRGB( make_float3( color ) );
+			}
+		}
+	}
+}
+
+// World::RenderCPU: cpu reference implementation of the render / finalize /
+// unsharpen kernels, used when there is no OpenCL device. Renders the current
+// world into 'target', at the resolution of that surface; a smaller surface
+// renders faster. Tiles are distributed over all threads of the scheduler.
+// ----------------------------------------------------------------------------
+void World::RenderCPU( Surface* target )
+{
+	Timer t;
+	const int w = target->width, h = target->height;
+	if (w != cpuSize.x || h != cpuSize.y)
+	{
+		// (re)allocate the linear frame and the TAA history
+		_aligned_free( cpuFrame );
+		_aligned_free( cpuHistory[0] );
+		_aligned_free( cpuHistory[1] );
+		cpuFrame = (float4*)_aligned_malloc( w * h * sizeof( float4 ), 64 );
+		for (int i = 0; i < 2; i++)
+		{
+			cpuHistory[i] = (float4*)_aligned_malloc( w * h * sizeof( float4 ), 64 );
+			memset( cpuHistory[i], 0, w * h * sizeof( float4 ) );
+		}
+		cpuSize = make_int2( w, h );
+	}
+	cpuTarget = target;
+	cpuParams = params;
+	cpuParams.oneOverRes = make_float2( 1.0f / w, 1.0f / h );
+	const uint tileCount = ((w + 15) / 16) * ((h + 15) / 16);
+#if TAA == 0
+	const int passes = 1;
+#else
+	const int passes = 3;
+#endif
+	for (int pass = 0; pass < passes; pass++) TaskScheduler::Get()->ParallelFor( 0, tileCount, 2,
+		[&]( uint first, uint last ) { RenderTilesCPU( pass, first, last ); } );
+	cpuHistIn ^= passes > 1 ? 1 : 0;
+	renderTime = t.elapsed();
+}
+
+// World::RecycleEmptiedBricks
+// ----------------------------------------------------------------------------
+void World::RecycleEmptiedBricks()
+{
+#if THREADSAFEWORLD
+	// Set defers this when writers may run concurrently; here, no-one is writing
+	const uint count = min( (uint)emptiedCount, (uint)BRICKCOUNT );
+	for (uint i = 0; i < count; i++)
+	{
+		// the cell may have been refilled or scrolled since; check before recycling
+		const uint cellIdx = emptied[i], g = grid[cellIdx];
+		if ((g & 1) == 0 || brickInfo[g >> 1].zeroes != BRICKSIZE) continue;
+		grid[cellIdx] = 0;
+		FreeBrick( g >> 1 );
+	}
+	emptiedCount = 0;
+#endif
+}
+
 // World::Commit
 // ----------------------------------------------------------------------------
 void World::Commit()
 {
-	// add the sprites and particles to the world
-	auto& sprite = GetSpriteList();
-	for (int s = (int)sprite.size(), i = 0; i < s; i++)
+	// recycle bricks that were zeroed by concurrent writers during the frame
+	RecycleEmptiedBricks();
+	// add the sprites and particles to the world; the game is not writing now, so the
+	// sprite and particle jobs only need to stay out of each other's grid cells
+	const uint gameWriteMode = writeMode;
+	SetWriteMode( WRITE_PARTITIONED );
+	DrawSprites();
+	RunParticleJobs( false );
+	SetWriteMode( WRITE_SINGLE );
+	if (!Kernel::clStarted)
 	{
-		if (sprite[i]->hasShadow) DrawSpriteShadow( i );
-		DrawSprite( i );
+		// no GPU copy to keep in sync; just reset the dirty flags
+		ClearMarks();
+		// render the frame now, while the sprites are in the world
+		if (Game::autoRendering && cpuTarget) RenderCPU( cpuTarget );
 	}
-	auto& particles = GetParticlesList();
-	for (int s = (int)particles.size(), i = 0; i < s; i++) DrawParticles( i );
-	// make sure the previous commit completed
-	if (commitInFlight)
-	{
-		clWaitForEvents( 1, &commitDone );
-		commitInFlight = false;
-	}
-	// replace the initial staging buffer by a double-sized buffer in pinned memory
-	static uint* pinnedMemPtr = 0;
-	if (pinnedMemPtr == 0)
-	{
-		const uint pinnedSize = commitSize + gridSize;
-		cl_mem pinned = clCreateBuffer( Kernel::GetContext(), CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, commitSize * 2, 0, 0 );
-		pinnedMemPtr = (uint*)clEnqueueMapBuffer( Kernel::GetQueue(), pinned, 1, CL_MAP_WRITE, 0, pinnedSize, 0, 0, 0, 0 );
-		StreamCopy( (__m256i*)(pinnedMemPtr + commitSize / 4), (__m256i*)grid, gridSize );
-		grid = pinnedMemPtr + commitSize / 4; // top-level grid resides at the start of the staging buffer
-	}
-	// gather changed bricks
-	tasks = 0;
-	uint* brickIndices = pinnedMemPtr + gridSize / 4;
-	uchar* changedBricks = (uchar*)(brickIndices + MAXCOMMITS);
-	for (uint j = 0; j < BRICKCOUNT / 32; j++) if (IsDirty32( j ) /* if not dirty: skip 32 bits at once */)
-	{
-		for (uint k = 0; k < 32; k++)
-		{
-			const uint i = j * 32 + k;
-			if (!IsDirty( i )) continue;
-			*brickIndices++ = i; // store index of modified brick at start of staging buffer
-			StreamCopy( (__m256i*)changedBricks, (__m256i*)(brick + i * BRICKSIZE), BRICKSIZE * PAYLOADSIZE );
-			changedBricks += BRICKSIZE * PAYLOADSIZE, tasks++;
-		}
-		ClearMarks32( j );
-		if (tasks + 32 >= MAXCOMMITS) break; // we have too many commits; postpone
-	}
-	// asynchroneously copy the CPU data to the GPU via the staging buffer
-	if (tasks > 0 || firstFrame)
-	{
-		// copy top-level grid to start of pinned buffer in preparation of final transfer
-		StreamCopyMT( (__m256i*)pinnedMemPtr, (__m256i*)grid, gridSize );
-		// enqueue (on queue 2) memcopy of pinned buffer to staging buffer on GPU
-		const uint copySize = firstFrame ? commitSize : (gridSize + MAXCOMMITS * 4 + tasks * BRICKSIZE * PAYLOADSIZE);
-		clEnqueueWriteBuffer( Kernel::GetQueue2(), devmem, 0, 0, copySize, pinnedMemPtr, 0, 0, 0 );
-		const size_t ws = UBERWIDTH * UBERHEIGHT * UBERDEPTH;
-		const size_t ls = 16;
-		clEnqueueNDRangeKernel( Kernel::GetQueue2(), uberGridUpdater->GetKernel(), 1, 0, &ws, &ls, 0, 0, &ubergridDone );
-		// enqueue (on queue 2) vram-to-vram copy of the top-level grid to a 3D OpenCL image buffer
-		size_t origin[3] = { 0, 0, 0 };
-		size_t region[3] = { GRIDWIDTH, GRIDDEPTH, GRIDHEIGHT };
-		clEnqueueCopyBufferToImage( Kernel::GetQueue2(), devmem, gridMap, 0, origin, region, 0, 0, &copyDone );
-		copyInFlight = true;	// next render should wait for this commit to complete
-		firstFrame = false;		// next frame is not the first frame
+	else
+	{
+		// make sure the previous commit completed
+		if (commitInFlight)
+		{
+			clWaitForEvents( 1, &commitDone );
+			commitInFlight = false;
+		}
+		// replace the initial staging buffer by a double-sized buffer in pinned memory
+		static uint* pinnedMemPtr = 0;
+		if (pinnedMemPtr == 0)
+		{
+			const uint pinnedSize = commitSize + gridSize;
+			cl_mem pinned = clCreateBuffer( Kernel::GetContext(), CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, commitSize * 2, 0, 0 );
+			pinnedMemPtr = (uint*)clEnqueueMapBuffer( Kernel::GetQueue(), pinned, 1, CL_MAP_WRITE, 0, pinnedSize, 0, 0, 0, 0 );
+			StreamCopy( (__m256i*)(pinnedMemPtr + commitSize / 4), (__m256i*)grid, gridSize );
+			grid = pinnedMemPtr + commitSize / 4; // top-level grid resides at the start of the staging buffer
+		}
+		// gather changed bricks, in parallel: count the dirty bricks per range of the
+		// bitfield, turn the counts into staging buffer offsets, then copy the bricks
+		uint* brickIndices = pinnedMemPtr + gridSize / 4;
+		uchar* changedBricks = (uchar*)(brickIndices + MAXCOMMITS);
+		const uint rangeSize = 1024, ranges = BRICKCOUNT / 32 / rangeSize;
+		static uint offset[ranges], gathered[ranges];
+		TaskScheduler* scheduler = TaskScheduler::Get();
+		scheduler->ParallelFor( 0, ranges, 1, [&]( uint first, uint last ) {
+			for (uint r = first; r < last; r++)
+			{
+				uint count = 0;
+				for (uint j = r * rangeSize; j < (r + 1) * rangeSize; j++) count += _mm_popcnt_u32( modified[j] );
+				offset[r] = count;
+			}
+		} );
+		for (uint r = 0, sum = 0; r < ranges; r++) { const uint count = offset[r]; offset[r] = sum, sum += count; }
+		scheduler->ParallelFor( 0, ranges, 1, [&]( uint first, uint last ) {
+			for (uint r = first; r < last; r++)
+			{
+				uint pos = offset[r];
+				for (uint j = r * rangeSize; j < (r + 1) * rangeSize; j++) if (IsDirty32( j ) /* if not dirty: skip 32 bits at once */)
+				{
+					// we have too many commits; postpone this word and everything after it
+					if (pos + _mm_popcnt_u32( modified[j] ) > MAXCOMMITS) break;
+					for (uint k = 0; k < 32; k++)
+					{
+						const uint i = j * 32 + k;
+						if (!IsDirty( i )) continue;
+						brickIndices[pos] = i; // store index of modified brick at start of staging buffer
+						StreamCopy( (__m256i*)(changedBricks + pos * BRICKSIZE * PAYLOADSIZE), (__m256i*)(brick + i * BRICKSIZE), BRICKSIZE * PAYLOADSIZE );
+						pos++;
+					}
+					ClearMarks32( j );
+				}
+				gathered[r] = pos - offset[r];
+			}
+		} );
+		tasks = 0;
+		for (uint r = 0; r < ranges; r++) tasks += gathered[r];
+		// asynchroneously copy the CPU data to the GPU via the staging buffer
+		if (tasks > 0 || firstFrame || gridChanged)
+		{
+			// copy top-level grid to start of pinned buffer in preparation of final transfer
+			StreamCopyMT( (__m256i*)pinnedMemPtr, (__m256i*)grid, gridSize );
+			// enqueue (on queue 2) memcopy of pinned buffer to staging buffer on GPU
+			const uint copySize = firstFrame ? commitSize : (gridSize + MAXCOMMITS * 4 + tasks * BRICKSIZE * PAYLOADSIZE);
+			clEnqueueWriteBuffer( Kernel::GetQueue2(), devmem, 0, 0, copySize, pinnedMemPtr, 0, 0, 0 );
+			const size_t ws = UBERWIDTH * UBERHEIGHT * UBERDEPTH;
+			const size_t ls = 16;
+			clEnqueueNDRangeKernel( Kernel::GetQueue2(), uberGridUpdater->GetKernel(), 1, 0, &ws, &ls, 0, 0, &ubergridDone );
+			// enqueue (on queue 2) vram-to-vram copy of the top-level grid to a 3D OpenCL image buffer
+			size_t origin[3] = { 0, 0, 0 };
+			size_t region[3] = { GRIDWIDTH, GRIDDEPTH, GRIDHEIGHT };
+			clEnqueueCopyBufferToImage( Kernel::GetQueue2(), devmem, gridMap, 0, origin, region, 0, 0, &copyDone );
+			copyInFlight = true;	// next render should wait for this commit to complete
+			firstFrame = false;		// next frame is not the first frame
+			gridChanged = false;
+		}
 	}
 	// bricks and top-level grid have been moved to the final host-side staging buffer; remove sprites and particles
 	// NOTE: this must explicitly happen in reverse order.
-	for (int s = (int)particles.size(), i = s - 1; i >= 0; i--) EraseParticles( i );
-	for (int s = (int)sprite.size(), i = s - 1; i >= 0; i--)
-	{
-		EraseSprite( i );
-		if (sprite[i]->hasShadow) RemoveSpriteShadow( i );
-	}
+	SetWriteMode( WRITE_PARTITIONED );
+	RunParticleJobs( true );
+	EraseSprites();
+	SetWriteMode( gameWriteMode );
 	// at this point, rendering *must* be done; let's make sure
-	if (Game::autoRendering)
+	if (Game::autoRendering && Kernel::clStarted)
 	{
 		clWaitForEvents( 1, &renderDone );
 		// profiling: https://stackoverflow.com/questions/23272170/opencl-measure-kernels-time
@@ -1643,27 +3558,14 @@ void World::Commit()
 
 // World::StreamCopyMT
 // ----------------------------------------------------------------------------
-#define COPYTHREADS	4
 void World::StreamCopyMT( __m256i* dst, __m256i* src, const uint bytes )
 {
 	// fast copying of large 32-byte aligned / multiple of 32 sized data blocks:
-	// streaming __m256 read/writes, on multiple threads
+	// streaming __m256 read/writes, on multiple threads, in blocks of 256KB
 	assert( (bytes & 31) == 0 );
-	int N = (int)(bytes / 32);
-	static JobManager* jm = JobManager::GetJobManager();
-	static CopyJob cj[COPYTHREADS];
-	__m256i* s = src;
-	__m256i* d = dst;
-	for (int i = 0; i < (COPYTHREADS - 1); i++, s += N / COPYTHREADS, d += N / COPYTHREADS)
-	{
-		cj[i].dst = d, cj[i].src = s, cj[i].N = N / COPYTHREADS;
-		jm->AddJob2( &cj[i] );
-	}
-	cj[COPYTHREADS - 1].dst = d;
-	cj[COPYTHREADS - 1].src = s;
-	cj[COPYTHREADS - 1].N = N - (COPYTHREADS - 1) * (N / COPYTHREADS);
-	jm->AddJob2( &cj[COPYTHREADS - 1] );
-	jm->RunJobs();
+	TaskScheduler::Get()->ParallelFor( 0, bytes / 32, 8192, [&]( uint first, uint last ) {
+		StreamCopy( dst + first, src + first, (last - first) * 32 );
+	} );
 }
 
 // Tile::Tile
@@ -1679,14 +3581,8 @@ Tile::Tile( const char* voxFile )
 	if (frame->size.x == BRICKDIM * 2) FatalError( "LoadTile( \"%s\" ):\nExpected an 8x8x8 tile; use LoadBigTile for 16x16x16 tiles.", voxFile );
 	if (frame->size.x != BRICKDIM) FatalError( "LoadTile( \"%s\" ):\nExpected an 8x8x8 tile.", voxFile );
 	// convert data
-	uint zeroCount = 0;
-	for (int i = 0; i < BRICKSIZE; i++)
-	{
-		PAYLOAD v = frame->buffer[i];
-		voxels[i] = v;
-		if (v == 0) zeroCount++;
-	}
-	zeroes = zeroCount;
+	memcpy( voxels, frame->buffer, BRICKSIZE * PAYLOADSIZE );
+	info = SummarizeBrick( voxels );
 	// remove the sprite from the world
 	SpriteManager::GetSpriteManager()->sprite.pop_back();
 }
@@ -1707,14 +3603,10 @@ BigTile::BigTile( const char* voxFile )
 	for (int subTile = 0; subTile < 8; subTile++)
 	{
 		int sx = subTile & 1, sy = (subTile >> 1) & 1, sz = (subTile >> 2) & 1;
-		uint zeroCount = 0;
 		for (int z = 0; z < BRICKDIM; z++) for (int y = 0; y < BRICKDIM; y++) for (int x = 0; x < BRICKDIM; x++)
-		{
-			PAYLOAD v = frame->buffer[sx * BRICKDIM + x + (sy * BRICKDIM + y) * BRICKDIM * 2 + (sz * BRICKDIM + z) * 4 * BRICKDIM * BRICKDIM];
-			tile[subTile].voxels[x + y * BRICKDIM + z * BRICKDIM * BRICKDIM] = v;
-			if (v == 0) zeroCount++;
-		}
-		tile[subTile].zeroes = zeroCount;
+			tile[subTile].voxels[x + y * BRICKDIM + z * BRICKDIM * BRICKDIM] =
+			frame->buffer[sx * BRICKDIM + x + (sy * BRICKDIM + y) * BRICKDIM * 2 + (sz * BRICKDIM + z) * 4 * BRICKDIM * BRICKDIM];
+		tile[subTile].info = SummarizeBrick( tile[subTile].voxels );
 	}
 	// remove the sprite from the world
 	SpriteManager::GetSpriteManager()->sprite.pop_back();
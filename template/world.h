@@ -1,41 +1,86 @@
 #pragma once
 
 #define THREADSAFEWORLD 1
+#define HUGEPAGES		1	// back bricks and grid with huge pages where the OS allows it
+#define NUMAPLACEMENT	0	// 0: pages land where first touched, 1: first touch by all workers, 2: interleaved
 #define SQR(x) ((x)*(x))
 #define TILESIZE	8
 #define TILESIZE2	(TILESIZE * TILESIZE)
+#define RAYBATCHES	4		// number of asynchronous ray batches that can be in flight
+#define DIRTYLISTSIZE	65536	// per-thread capacity for bricks marked in WRITE_PARTITIONED mode
+#define SURFACESTALE	0x80000000	// column height flag: the top voxel was removed
+#define VXSPANS		0x53505856	// "VXPS": tags .vx files that store sprite frames as runs of voxels
 
 #define OUTOFRANGE -99999
 
 namespace Tmpl8
 {
 
-struct BrickInfo { uint zeroes; /* , location; */ };
+// maintenance data and summary for a brick. 'occupied' and 'colors' are conservative:
+// Set only ever adds bits, bulk writes (BrickIterator::EndWrite, tiles) make them exact.
+struct BrickInfo
+{
+	uint zeroes;		// number of empty voxels; the other BRICKSIZE - zeroes are solid
+	uint occupied;		// bit i: solid voxels may exist at x = i (bits 0..7), y = i (8..15), z = i (16..23)
+	uint colors;		// bit i: solid voxels with ColorBucket i may exist
+};
+
+// 32 color buckets for BrickInfo::colors: the two most significant bits of red and green,
+// and the most significant bit of blue
+inline uint ColorBucket( const uint v )
+{
+#ifdef VOXEL8
+	return ((v >> 6) & 3) * 8 + ((v >> 3) & 3) * 2 + ((v >> 1) & 1);
+#else
+	return ((v >> 10) & 3) * 8 + ((v >> 6) & 3) * 2 + ((v >> 3) & 1);
+#endif
+}
 
 // Sprite system overview:
 // The world contains a set of 0 or more sprites, typically loaded from .vox files.
-// Sprites act like classic homecomputer sprites: they do not affect the world in
-// any way, they just get displayed. Internally, this works as follows:
+// Sprites are drawn into the world as voxels, but they do not replace it: the voxels
+// they cover are backed up and restored when they move. Internally, this works as follows:
 // 1. Before Game::Tick is executed:
 //    - the world gets rendered by the GPU
-//    - the sprites are then removed from the world
-// 2. Game::Tick is now executed on a world that does not contain the sprites.
+//    - sprites that changed position, frame or transform are then removed from the world
+// 2. Game::Tick is now executed on a world that contains only the stationary sprites.
 // 3. After Game::Tick completes:
-//    - each sprite makes a backup of the voxels it overlaps
+//    - sprites that changed, and sprites whose grid cells were written to, are removed
+//    - each of these makes a backup of the voxels it overlaps
 //    - the sprites are added back to the world
 //    - the world is synchronized with the GPU for rendering in step 1.
-// Consequence of this system is that even stationary sprites take time to process.
+// Stationary sprites thus cost next to nothing, but they are visible to Get (and thus to
+// Read, GetSurfaceHeight, the region queries and collisions) while they stay in the world.
+// KeepSpritesResident( false ) restores the old behaviour: all sprites are erased in
+// step 1. Where the game writes to voxels of a stationary sprite, the written values
+// end up under the sprite, as if they had been written to a world without it.
 
 class SpriteFrame
 {
 	// fast sprite system: B&H'21
 public:
-	~SpriteFrame() { _aligned_free( buffer ); }
+	~SpriteFrame()
+	{
+		_aligned_free( buffer ), _aligned_free( drawPos ), _aligned_free( drawVal );
+		_aligned_free( spanPos ), _aligned_free( spanLength );
+		_aligned_free( blockPos ), _aligned_free( blockVal ), _aligned_free( blockInfo );
+		_aligned_free( occupancy );
+	}
+	void BuildSpans();					// fill the span list, drawVal, the blocks and occupancy from buffer
 	PAYLOAD* buffer = 0;				// full frame buffer (width * height * depth)
 	int3 size = make_int3( 0 );			// size of the sprite over x, y and z
-	uint* drawPos = 0;					// compacted list of opaque sprite voxel positions
-	PAYLOAD* drawVal = 0;				// compacted list of opaque sprite voxel values
-	uint drawListSize = 0;				// number of voxels in buffer2
+	uint* spanPos = 0;					// runs of opaque voxels along x: first voxel, x + (y << 10) + (z << 20)
+	ushort* spanLength = 0;				// voxels per run
+	uint spanCount = 0;					// number of runs
+	PAYLOAD* drawVal = 0;				// opaque sprite voxel values, run after run
+	uint drawListSize = 0;				// number of opaque voxels
+	uint blockCount = 0;				// brick-sized blocks of the frame that hold opaque voxels
+	uint* blockPos = 0;					// block position in bricks, x + (y << 10) + (z << 20)
+	PAYLOAD* blockVal = 0;				// BRICKSIZE voxels per block in brick layout; zero is transparent
+	BrickInfo* blockInfo = 0;			// occupied rows and colors of the opaque voxels per block
+	uint64_t* occupancy = 0;			// bit x & 63 of word x >> 6 of row (y,z) is set for opaque voxels;
+										// a plane of words per x >> 6, rows y + z * size.y, plus a zero plane
+	uint* drawPos = 0;					// backup frames only: positions of voxels overwritten by a transformed draw
 };
 
 class Sprite
@@ -48,8 +93,20 @@ public:
 	mat4 transform = mat4::Identity();	// only 3x3 part is used; scale + rotation
 	int currFrame = 0;					// frame to draw
 	bool hasShadow = false;				// set to true to enable a drop shadow
+	uint collisionLayer = 1;			// CollideSprites: pairs are tested if the layer of one
+	uint collisionMask = 0xffffffff;	// sprite is in the mask of the other
 	uint4* preShadow = 0;				// room for backup of voxels overwritten by shadow
 	uint shadowVoxels = 0;				// size of backup voxel array
+	uint backupCapacity = 0;			// room in backup->drawPos / drawVal, for transformed sprites
+	PAYLOAD* blockBackup = 0;			// bricks overwritten by a draw at a multiple of BRICKDIM
+	uint blockBackupCapacity = 0;		// room in blockBackup, in bricks
+	PAYLOAD* drawnVal = 0;				// voxels written by a transformed draw
+	// incremental updates: what the world currently holds of this sprite
+	bool resident = false;				// still in the world after the last Commit
+	int drawnFrame = -1;				// frame and transform used to draw at lastPos
+	mat4 drawnTransform;
+	int3 drawnMin, drawnMax;			// grid cells that the last draw may have touched
+	vector<uint> drawnCells;			// their grid values after the last Commit
 };
 
 class SpriteManager
@@ -80,10 +137,22 @@ public:
 		memset( voxel, 0, N * sizeof( uint4 ) );
 		memset( backup, 0, N * sizeof( uint4 ) );
 		voxel[0].x = OUTOFRANGE;		// inactive by default
+		active = N;
 	}
 	uint4* voxel = 0;					// particle positions & color
 	uint4* backup = 0;					// backup of voxels overlapped by particles
 	uint count = 0;						// particle count for the set
+	uint active = 0;					// voxels in use: all of them, or the live particles of a simulated set
+	uint drawn = 0;						// voxels written by the last draw, restored by the next erase
+	// simulated sets (see World::UpdateParticles): state of the live particles, stored per
+	// component and padded to a multiple of 8 for AVX2; the color is kept in voxel[i].w
+	bool simulated = false;
+	bool collide = false;				// particles stop on solid voxels
+	float* px = 0, * py = 0, * pz = 0;	// positions
+	float* vx = 0, * vy = 0, * vz = 0;	// velocities, in voxels per time unit
+	float* life = 0;					// remaining time; the particle is removed when it runs out
+	float3 gravity = make_float3( 0 );	// acceleration
+	float drag = 0;						// fraction of the velocity lost per time unit
 };
 
 class ParticlesManager
@@ -98,6 +167,7 @@ public:
 		return particlesManager;
 	}
 	uint CreateParticles( const uint count );
+	uint CreateParticleSystem( const uint capacity, const float3 gravity, const float drag, const bool collide );
 	// data members
 	vector<Particles*> particles;		// list of particle sets
 private:
@@ -110,6 +180,9 @@ private:
 // voxel data, which can be placed in the world at locations that are a multiple of 8 
 // over x, y and z. Drawing a tile will thus simply overwrite the contents of a brick 
 // (or 8 bricks, when using the larger 16x16x16 tiles).
+// On first use, a tile gets a 'shared' brick in the brick pool. Drawing the tile then only
+// stores a reference to that brick in the grid cell; the brick itself is read-only, and a
+// cell gets a private copy of it once voxels in it are written to (see World::Set).
 
 class Tile
 {
@@ -117,7 +190,8 @@ public:
 	Tile() = default;
 	Tile( const char* voxFile );
 	PAYLOAD voxels[BRICKSIZE];			// tile voxel data
-	uint zeroes;						// number of transparent voxels in the tile
+	BrickInfo info;						// number of transparent voxels in the tile, and its summary
+	uint cell = 0xffffffff;				// grid cell value that places the tile; see World::TileCell
 };
 
 class BigTile
@@ -163,6 +237,8 @@ private:
 
 class World
 {
+	friend class BrickIterator;
+	friend class VoxelCursor;
 public:
 	// constructor / destructor
 	World( const uint targetID );
@@ -185,11 +261,15 @@ public:
 	// render flow
 	void Commit();
 	void Render();
+	void RenderCPU( Surface* target );
+	void SetCPURenderTarget( Surface* target ) { cpuTarget = target; }
 	float GetRenderTime() { return renderTime; }
 	// high-level voxel access
 	void Sphere( const float x, const float y, const float z, const float r, const uint c );
 	void HDisc( const float x, const float y, const float z, const float r, const uint c );
 	void Print( const char* text, const uint x, const uint y, const uint z, const uint c );
+	void ReadRegion( const int3 pos, const int3 size, PAYLOAD* data );
+	void WriteRegion( const int3 pos, const int3 size, const PAYLOAD* data, const bool skipUnchanged = false );
 	uint CreateSprite( const int3 pos, const int3 size, const int frames );
 	uint SpriteFrameCount( const uint idx );
 	void MoveSpriteTo( const uint idx, const uint x, const uint y, const uint z );
@@ -198,17 +278,48 @@ public:
 	void StampSpriteTo( const uint idx, const uint x, const uint y, const uint z );
 	void SetSpriteFrame( const uint idx, const uint frame );
 	bool SpriteHit( const uint A, const uint B );
+	uint CollideSprites( vector<uint2>& hits, const bool exact = true );
+	bool SpriteWorldHit( const uint idx );
+	bool SweepSprite( const uint idx, const int3 delta, int3& reached );
+	void KeepSpritesResident( const bool keep ) { residentSprites = keep; }
 	void SetParticle( const uint set, const uint idx, const uint3 pos, const uint v );
+	bool EmitParticle( const uint set, const float3 pos, const float3 velocity, const uint v, const float life );
+	uint EmitSpriteBurst( const uint set, const uint sprite, const float3 velocity, const float3 spread, const float life, const uint stride = 1 );
+	void UpdateParticles( const uint set, const float dt = 1 );
 	void DrawTile( const uint idx, const uint x, const uint y, const uint z );
 	void DrawTiles( const char* tileString, const uint x, const uint y, const uint z );
 	void DrawBigTile( const uint idx, const uint x, const uint y, const uint z );
 	void DrawBigTiles( const char* tileString, const uint x, const uint y, const uint z );
 	// inline ray tracing / cpu-only ray tracing / inline ray batch rendering
-	uint TraceRay( float4 A, const float4 B, float& dist, float3& N, int steps );
+	uint TraceRay( float4 A, const float4 B, float& dist, float3& N );
+	uint TraceRay( float4 A, const float4 B, float& dist, float3& N, const float tmin, const float tmax );
+	uint TraceRayCapped( float4 A, const float4 B, float& dist, float3& N, const int steps );
+	bool TraceOcclusion( float4 A, const float4 B, const float tmin, const float tmax );
 	void TraceRayToVoid( float4 A, const float4 B, float& dist, float3& N );
 	Ray* GetBatchBuffer();
 	Intersection* TraceBatch( const uint batchSize );
 	Intersection* TraceBatchToVoid( const uint batchSize );
+	uint NewBatch( const uint maxRays = SCRWIDTH * SCRHEIGHT );
+	Ray* GetBatchBuffer( const uint batch );
+	void SubmitBatch( const uint batch, const uint batchSize, const bool toVoid, const bool reorder = false );
+	bool BatchDone( const uint batch );
+	Intersection* GetBatchResults( const uint batch );
+	void FreeBatch( const uint batch );
+	// region queries over [bmin,bmax), answered from the grid and the brick summaries;
+	// voxels are only visited in bricks that the region covers partially
+	bool IsRegionEmpty( const int3 bmin, const int3 bmax );
+	uint CountSolid( const int3 bmin, const int3 bmax );
+	bool FindFirstSolid( const int3 bmin, const int3 bmax, int3& pos ); // the highest solid voxel
+	uint RegionColors( const int3 bmin, const int3 bmax ); // ColorBucket bits that may be present
+	// column height index: 1 + the y of the highest solid voxel at (x,z), or 0 for an empty
+	// column. Kept up to date by all writes; removing the top voxel of a column only flags it,
+	// the next query rescans it from there.
+	int GetSurfaceHeight( const int x, const int z )
+	{
+		if ((uint)x >= MAPWIDTH || (uint)z >= MAPDEPTH) return 0;
+		const uint h = surface[x + z * MAPWIDTH];
+		return (h & SURFACESTALE) ? RescanSurface( x, z ) : h;
+	}
 	// block scrolling
 	void ScrollX( const int offset );
 	void ScrollY( const int offset );
@@ -217,11 +328,27 @@ private:
 	// internal methods
 	void EraseSprite( const uint idx );
 	void DrawSprite( const uint idx );
+	bool FrameHitsWorld( const uint idx, const SpriteFrame* frame, const int3 pos );
+	void EraseSpriteBlocks( const uint idx, const SpriteFrame* frame, const int3 pos );
+	void DrawSpriteBlocks( const uint idx, const SpriteFrame* frame, const int3 pos );
 	void DrawSpriteShadow( const uint idx );
 	void RemoveSpriteShadow( const uint idx );
-	void EraseParticles( const uint set );
-	void DrawParticles( const uint set );
-	void DrawTileVoxels( const uint cellIdx, const PAYLOAD* voxels, const uint zeroes );
+	void EraseParticles( const uint set, const uint part = 0, const uint parts = 1 );
+	void DrawParticles( const uint set, const uint part = 0, const uint parts = 1 );
+	void DrawTileVoxels( const uint cellIdx, Tile& tile );
+	uint TileCell( Tile& tile );
+	int RescanSurface( const int x, const int z );
+	void UpdateSurface( const int3 origin, const PAYLOAD* voxels, const uint v );
+	void InitBatch( const uint batch, const uint maxRays );
+	void ReorderBatch( const uint batch, const uint batchSize );
+	void EnqueueBatch( const uint batch, const uint batchSize, const bool toVoid, const bool reorder );
+	void FinishBatch( const uint batch, const bool wait );
+	void TraceBatchCPU( const Ray* rays, Intersection* results, const uint first, const uint last, const bool toVoid );
+	float4 RenderPixelCPU( const int x, const int y );
+	void RenderTilesCPU( const int pass, const uint firstTile, const uint lastTile );
+	enum { TRACE_CLOSEST = 0, TRACE_ANY, TRACE_VOID };
+	template <int QUERY, bool CAPPED, bool RANGED> uint Traverse( float4 A, const float4 B, float& dist, float3& N,
+		const float tmin, const float tmax, int steps );
 	// convenient access to 'guaranteed to be instantiated' sprite, particle, tile lists
 	vector<Sprite*>& GetSpriteList() { return SpriteManager::GetSpriteManager()->sprite; }
 	vector<Particles*>& GetParticlesList() { return ParticlesManager::GetParticlesManager()->particles; }
@@ -242,6 +369,14 @@ public:
 		const uint lx = x & (BRICKDIM - 1), ly = y & (BRICKDIM - 1), lz = z & (BRICKDIM - 1);
 		return brick[(g >> 1) * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM];
 	}
+	// write modes: with WRITE_SHARED (the default), any thread may Set any voxel at any time, at
+	// the cost of atomics for every voxel. WRITE_SINGLE is for a single writing thread, and
+	// WRITE_PARTITIONED for TaskScheduler jobs that never write to the same grid cell at the same
+	// time; these use plain stores. Only change the mode while no thread is writing.
+	enum { WRITE_SHARED = 0, WRITE_SINGLE, WRITE_PARTITIONED };
+	void SetWriteMode( const uint mode );
+	uint GetWriteMode() { return writeMode; }
+	size_t GetBrickPageSize() { return brickPageSize; }
 	__forceinline void Set( const uint x, const uint y, const uint z, const uint v /* actually an 8-bit value */ )
 	{
 		// calculate brick location in top-level grid
@@ -252,52 +387,187 @@ public:
 		const uint cellIdx = bx + bz * GRIDWIDTH + by * GRIDWIDTH * GRIDDEPTH;
 		// obtain current brick identifier from top-level grid
 		uint g = grid[cellIdx], g1 = g >> 1;
-		if ((g & 1) == 0 /* this is currently a 'solid' grid cell */)
+	#if THREADSAFEWORLD
+		if (writeMode == WRITE_SHARED) SetShared( cellIdx, x, y, z, v, g ); else
+	#endif
 		{
+			if ((g & 1) == 0 /* this is currently a 'solid' grid cell */)
+			{
+				if (g1 == v) return; // about to set the same value; we're done here
+				const uint newIdx = NewBrick();
+				FillBrick( newIdx, g1 );
+				// we keep track of the number of zeroes, so we can remove fully zeroed bricks
+				InitBrickInfo( newIdx, g1 );
+				g1 = newIdx, grid[cellIdx] = g = (newIdx << 1) | 1;
+			}
+			// calculate the position of the voxel inside the brick
+			const uint lx = x & (BRICKDIM - 1), ly = y & (BRICKDIM - 1), lz = z & (BRICKDIM - 1);
+			if (IsShared( g1 ))
+			{
+				// tile bricks are read-only: write to a private copy, unless nothing changes
+				if (brick[g1 * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM] == v) return;
+				g1 = CopySharedBrick( cellIdx, g ) >> 1;
+			}
+			const uint voxelIdx = g1 * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM;
+			const uint cv = brick[voxelIdx];
+			if (v && !cv) RaiseSurface( x, y, z ); else if (!v && cv) LowerSurface( x, y, z );
+			if ((brickInfo[g1].zeroes += (cv != 0 && v == 0) - (cv == 0 && v != 0)) < BRICKSIZE)
+			{
+				brick[voxelIdx] = v;
+				if (v) brickInfo[g1].occupied |= OccupiedBits( lx, ly, lz ), brickInfo[g1].colors |= 1 << ColorBucket( v );
+				Mark( g1 ); // tag to be synced with GPU
+				return;
+			}
+			grid[cellIdx] = 0;	// brick just became completely zeroed; recycle
+			UnMark( g1 );		// no need to send it to GPU anymore
+			FreeBrick( g1 );
+		}
+	}
+private:
+	void SetSpan( int x, const int y, const int z, int n, const PAYLOAD* v, PAYLOAD* old = 0, const PAYLOAD* expect = 0 );
+	void SetRow( const uint x, const uint y, const uint z, const uint n, const PAYLOAD* v, PAYLOAD* old, const PAYLOAD* expect );
+	void SetCellVoxels( const uint cellIdx, const ushort* local, const uint n, const PAYLOAD* v, PAYLOAD* old );
+#if THREADSAFEWORLD
+	__forceinline void SetShared( const uint cellIdx, const uint x, const uint y, const uint z, const uint v, uint g )
+	{
+		// Set for WRITE_SHARED: other threads may be writing to the same cell or voxel
+		uint g1 = g >> 1;
+		while ((g & 1) == 0 /* this is currently a 'solid' grid cell */ || IsShared( g1 ))
+		{
+			if (g & 1)
+			{
+				// a read-only tile brick: continue in a private copy, ours or another thread's,
+				// unless nothing changes
+				const uint lx = x & (BRICKDIM - 1), ly = y & (BRICKDIM - 1), lz = z & (BRICKDIM - 1);
+				if (brick[g1 * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM] == v) return;
+				g = CopySharedBrick( cellIdx, g ), g1 = g >> 1;
+				continue;
+			}
 			if (g1 == v) return; // about to set the same value; we're done here
 			const uint newIdx = NewBrick();
-		#if BRICKDIM == 8 && PAYLOADSIZE == 1
-			// fully unrolled loop for writing the 512 bytes needed for a single brick, faster than memset
-			const __m256i zero8 = _mm256_set1_epi8( static_cast<char>(g1) );
-			__m256i* d8 = (__m256i*)(brick + newIdx * BRICKSIZE);
-			d8[0] = zero8, d8[1] = zero8, d8[2] = zero8, d8[3] = zero8;
-			d8[4] = zero8, d8[5] = zero8, d8[6] = zero8, d8[7] = zero8;
-			d8[8] = zero8, d8[9] = zero8, d8[10] = zero8, d8[11] = zero8;
-			d8[12] = zero8, d8[13] = zero8, d8[14] = zero8, d8[15] = zero8;
-		#elif BRICKDIM == 8 && PAYLOADSIZE == 2
-			// fully unrolled loop for writing 1KB needed for a single brick, faster than memset
-			const __m256i zero16 = _mm256_set1_epi16( static_cast<short>(g1) );
-			__m256i* d = (__m256i*)(brick + newIdx * BRICKSIZE);
-			d[0] = zero16, d[1] = zero16, d[2] = zero16, d[3] = zero16;
-			d[4] = zero16, d[5] = zero16, d[6] = zero16, d[7] = zero16;
-			d[8] = zero16, d[9] = zero16, d[10] = zero16, d[11] = zero16;
-			d[12] = zero16, d[13] = zero16, d[14] = zero16, d[15] = zero16;
-			d[16] = zero16, d[17] = zero16, d[18] = zero16, d[19] = zero16;
-			d[20] = zero16, d[21] = zero16, d[22] = zero16, d[23] = zero16;
-			d[24] = zero16, d[25] = zero16, d[26] = zero16, d[27] = zero16;
-			d[28] = zero16, d[29] = zero16, d[30] = zero16, d[31] = zero16;
-		#else
-			// TODO: generic case
-		#endif
-			// we keep track of the number of zeroes, so we can remove fully zeroed bricks
-			brickInfo[newIdx].zeroes = g == 0 ? BRICKSIZE : 0;
-			g1 = newIdx, grid[cellIdx] = g = (newIdx << 1) | 1;
+			FillBrick( newIdx, g1 );
+			InitBrickInfo( newIdx, g1 );
+			// publish the brick, unless another thread changed the cell first; in that case
+			// the brick goes back to the trash and we continue with what the other thread wrote
+			const uint seen = (uint)InterlockedCompareExchange( (volatile LONG*)grid + cellIdx, (newIdx << 1) | 1, g );
+			if (seen == g) { g1 = newIdx, g = (newIdx << 1) | 1; break; }
+			FreeBrick( newIdx );
+			g = seen, g1 = g >> 1;
 		}
 		// calculate the position of the voxel inside the brick
 		const uint lx = x & (BRICKDIM - 1), ly = y & (BRICKDIM - 1), lz = z & (BRICKDIM - 1);
 		const uint voxelIdx = g1 * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM;
-		const uint cv = brick[voxelIdx];
-		if ((brickInfo[g1].zeroes += (cv != 0 && v == 0) - (cv == 0 && v != 0)) < BRICKSIZE)
+		// swap in the new value, so concurrent writes to one voxel still count zeroes exactly
+		const uint cv = ExchangeVoxel( brick + voxelIdx, (PAYLOAD)v );
+		Mark( g1 ); // tag to be synced with GPU
+		if (v)
+		{
+			// grow the summary; most writes find the bits set already
+			BrickInfo& info = brickInfo[g1];
+			const uint occupied = OccupiedBits( lx, ly, lz ), color = 1 << ColorBucket( v );
+			if ((info.occupied & occupied) != occupied) InterlockedOr( (volatile LONG*)&info.occupied, occupied );
+			if ((info.colors & color) == 0) InterlockedOr( (volatile LONG*)&info.colors, color );
+		}
+		const int delta = (cv != 0 && v == 0) - (cv == 0 && v != 0);
+		if (delta == 0) return;
+		if (delta < 0) RaiseSurface( x, y, z ); else LowerSurface( x, y, z );
+		// a brick that became completely zeroed is recycled in the next Commit, when no
+		// other thread can be writing to it
+		if (InterlockedAdd( (volatile LONG*)&brickInfo[g1].zeroes, delta ) == BRICKSIZE)
 		{
-			brick[voxelIdx] = v;
-			Mark( g1 ); // tag to be synced with GPU
+			const uint slot = InterlockedAdd( &emptiedCount, 1 ) - 1;
+			if (slot < BRICKCOUNT) emptied[slot] = cellIdx;
+		}
+	}
+#endif
+	__forceinline void RaiseSurface( const uint x, const uint y, const uint z )
+	{
+		// a voxel became solid; it is the new top if it is above the old one. Since nothing
+		// can be above it, this also settles a pending rescan.
+		volatile LONG* h = (volatile LONG*)surface + x + z * MAPWIDTH;
+		for (LONG old = *h; (uint)(old & ~SURFACESTALE) <= y;)
+		{
+		#if THREADSAFEWORLD
+			if (writeMode != WRITE_SINGLE)
+			{
+				const LONG seen = InterlockedCompareExchange( h, y + 1, old );
+				if (seen == old) return;
+				old = seen;
+				continue;
+			}
+		#endif
+			*h = y + 1;
 			return;
 		}
-		grid[cellIdx] = 0;	// brick just became completely zeroed; recycle
-		UnMark( g1 );		// no need to send it to GPU anymore
-		FreeBrick( g1 );
 	}
-private:
+	__forceinline void LowerSurface( const uint x, const uint y, const uint z )
+	{
+		// a voxel became empty; if it was the top of its column, flag the column for a rescan
+		volatile LONG* h = (volatile LONG*)surface + x + z * MAPWIDTH;
+		if ((uint)(*h & ~SURFACESTALE) != y + 1) return;
+	#if THREADSAFEWORLD
+		if (writeMode != WRITE_SINGLE) { InterlockedOr( h, (LONG)SURFACESTALE ); return; }
+	#endif
+		*h |= (LONG)SURFACESTALE;
+	}
+	static __forceinline uint OccupiedBits( const uint lx, const uint ly, const uint lz ) { return (1 << lx) | (256 << ly) | (65536 << lz); }
+	__forceinline void InitBrickInfo( const uint idx, const uint v /* color of the voxels */ )
+	{
+		brickInfo[idx].zeroes = v == 0 ? BRICKSIZE : 0;
+		brickInfo[idx].occupied = v == 0 ? 0 : 0xffffff;
+		brickInfo[idx].colors = v == 0 ? 0 : (1 << ColorBucket( v ));
+	}
+	__forceinline void FillBrick( const uint idx, const uint v )
+	{
+	#if BRICKDIM == 8 && PAYLOADSIZE == 1
+		// fully unrolled loop for writing the 512 bytes needed for a single brick, faster than memset
+		const __m256i zero8 = _mm256_set1_epi8( static_cast<char>(v) );
+		__m256i* d8 = (__m256i*)(brick + idx * BRICKSIZE);
+		d8[0] = zero8, d8[1] = zero8, d8[2] = zero8, d8[3] = zero8;
+		d8[4] = zero8, d8[5] = zero8, d8[6] = zero8, d8[7] = zero8;
+		d8[8] = zero8, d8[9] = zero8, d8[10] = zero8, d8[11] = zero8;
+		d8[12] = zero8, d8[13] = zero8, d8[14] = zero8, d8[15] = zero8;
+	#elif BRICKDIM == 8 && PAYLOADSIZE == 2
+		// fully unrolled loop for writing 1KB needed for a single brick, faster than memset
+		const __m256i zero16 = _mm256_set1_epi16( static_cast<short>(v) );
+		__m256i* d = (__m256i*)(brick + idx * BRICKSIZE);
+		d[0] = zero16, d[1] = zero16, d[2] = zero16, d[3] = zero16;
+		d[4] = zero16, d[5] = zero16, d[6] = zero16, d[7] = zero16;
+		d[8] = zero16, d[9] = zero16, d[10] = zero16, d[11] = zero16;
+		d[12] = zero16, d[13] = zero16, d[14] = zero16, d[15] = zero16;
+		d[16] = zero16, d[17] = zero16, d[18] = zero16, d[19] = zero16;
+		d[20] = zero16, d[21] = zero16, d[22] = zero16, d[23] = zero16;
+		d[24] = zero16, d[25] = zero16, d[26] = zero16, d[27] = zero16;
+		d[28] = zero16, d[29] = zero16, d[30] = zero16, d[31] = zero16;
+	#else
+		// TODO: generic case
+	#endif
+	}
+	static __forceinline PAYLOAD ExchangeVoxel( PAYLOAD* voxel, const PAYLOAD v )
+	{
+	#if PAYLOADSIZE == 1
+		return (PAYLOAD)_InterlockedExchange8( (volatile char*)voxel, (char)v );
+	#else
+		return (PAYLOAD)InterlockedExchange16( (volatile short*)voxel, (short)v );
+	#endif
+	}
+	void RecycleEmptiedBricks();
+	void ResetTrash();
+	uint CopySharedBrick( const uint cellIdx, const uint g );
+	void ReleaseBrick( const uint idx )
+	{
+		// a grid cell no longer refers to brick idx
+		if (IsShared( idx ))
+		{
+		#if THREADSAFEWORLD
+			if (writeMode != WRITE_SINGLE) { InterlockedAdd( (volatile LONG*)brickRefs + idx, -1 ); return; }
+		#endif
+			brickRefs[idx]--;
+			return;
+		}
+		UnMark( idx );
+		FreeBrick( idx );
+	}
 	uint NewBrick()
 	{
 	#if THREADSAFEWORLD
@@ -323,6 +593,15 @@ private:
 	void Mark( const uint idx )
 	{
 	#if THREADSAFEWORLD
+		if (writeMode == WRITE_PARTITIONED)
+		{
+			// jobs own their cells, but not the bitfield words; collect marks per thread instead
+			const int worker = TaskScheduler::GetWorkerIndex();
+			DirtyList& list = dirtyList[worker < 0 ? dirtyLists - 1 : worker];
+			if (list.recent[idx & 63] == idx) return; // most writes hit a recently marked brick
+			if (list.count < DIRTYLISTSIZE) { list.idx[list.count++] = list.recent[idx & 63] = idx; return; }
+		}
+		else if (writeMode == WRITE_SINGLE) { modified[idx >> 5] |= 1 << (idx & 31); return; }
 		// be careful, setting a bit in an array is not thread-safe without _interlockedbittestandset
 		_interlockedbittestandset( (LONG*)modified + (idx >> 5), idx & 31 );
 	#else
@@ -332,6 +611,7 @@ private:
 	void UnMark( const uint idx )
 	{
 	#if THREADSAFEWORLD
+		if (writeMode == WRITE_SINGLE) { modified[idx >> 5] &= 0xffffffffu - (1 << (idx & 31)); return; }
 		// be careful, resetting a bit in an array is not thread-safe without _interlockedbittestandreset
 		_interlockedbittestandreset( (LONG*)modified + (idx >> 5), idx & 31 );
 	#else
@@ -340,6 +620,7 @@ private:
 	}
 	bool IsDirty( const uint idx ) { return (modified[idx >> 5] & (1 << (idx & 31))) > 0; }
 	bool IsDirty32( const uint idx ) { return modified[idx] != 0; }
+	bool IsShared( const uint idx ) { return (shared[idx >> 5] & (1 << (idx & 31))) > 0; }
 	void ClearMarks32( const uint idx ) { modified[idx] = 0; }
 	void ClearMarks() { memset( modified, 0, (BRICKCOUNT / 32) * 4 ); }
 	// helpers
@@ -351,7 +632,7 @@ private:
 		{
 			// fallback: no AVX2, use SSE 4.2
 			uint N = bytes / 16;
-			const __m128i* src4 = (__m128i*)src;
+			__m128i* src4 = (__m128i*)src; // _mm_stream_load_si128 takes a non-const pointer
 			__m128i* dst4 = (__m128i*)dst;
 			for (; N > 0; N--, src4++, dst4++)
 			{
@@ -394,14 +675,35 @@ private:
 		}
 	}
 	void StreamCopyMT( __m256i* dst, __m256i* src, const uint bytes );
-	// helper class for multithreaded memcpy
-	class CopyJob : public Job
+	// helper class for drawing and erasing sprites in parallel
+	class SpriteJob : public Job
+	{
+	public:
+		void Main();
+		bool Overlaps( const SpriteJob& o ) const;
+		World* world;
+		uint idx;
+		bool erase;
+		bool active;		// part of the current RunSpriteJobs pass
+		bool redraw;		// erased and drawn in this Commit
+		bool moved;			// position, frame or transform changed since the last draw
+		int3 bmin, bmax;	// range of grid cells the sprite may touch
+	};
+	void RunSpriteJobs( const bool erase );
+	// helper class for drawing and erasing particles in parallel; a job handles the
+	// particles in the grid cells that hash to its part, so parts never share a cell
+	class ParticleJob : public Job
 	{
 	public:
-		void Main() { World::StreamCopy( dst, src, N * 32 ); }
-		__m256i* dst, * src;
-		uint N;
+		void Main();
+		World* world;
+		uint part, parts;
+		bool erase;
 	};
+	void RunParticleJobs( const bool erase );
+	bool SpriteEdited( const Sprite* s );
+	void DrawSprites();
+	void EraseSprites();
 	// data members
 	mat4 camMat;						// camera matrix to be used for rendering
 	uint* grid = 0, * gridOrig = 0;		// pointer to host-side copy of the top-level grid
@@ -412,10 +714,24 @@ private:
 #endif
 	PAYLOAD* brick = 0;					// pointer to host-side copy of the bricks
 	uint* modified = 0;					// bitfield to mark bricks for synchronization
+	uint* shared = 0;					// bitfield of read-only bricks that hold a tile, see TileCell
+	uint* brickRefs = 0;				// per shared brick: the tile, plus each grid cell that refers to it
+	bool gridChanged = false;			// grid cells changed without a dirty brick; upload the grid anyway
+	bool residentSprites = true;		// leave unchanged sprites in the world during Game::Tick
 	BrickInfo* brickInfo = 0;			// maintenance data for bricks: zeroes, location
 	volatile inline static LONG trashHead = BRICKCOUNT;	// thrash circular buffer tail
 	volatile inline static LONG trashTail = 0;	// thrash circular buffer tail
 	uint* trash = 0;					// indices of recycled bricks
+#if THREADSAFEWORLD
+	volatile LONG emptiedCount = 0;		// number of entries in 'emptied'
+	uint* emptied = 0;					// grid cells whose brick became fully zeroed since the last commit
+	struct alignas(64) DirtyList { uint* idx = 0, count = 0, recent[64]; };
+	DirtyList* dirtyList = 0;			// per-thread marks for WRITE_PARTITIONED, merged by SetWriteMode
+	uint dirtyLists = 0;				// number of dirty lists: one per worker, plus one for other threads
+#endif
+	uint writeMode = WRITE_SHARED;		// see SetWriteMode
+	uint* surface = 0;					// column heights, see GetSurfaceHeight
+	size_t brickPageSize = 0;			// page size obtained for the brick store
 	Buffer* screen = 0;					// OpenCL buffer that encapsulates the target OpenGL texture
 	uint targetTextureID = 0;			// OpenGL render target
 	int prevFrameIdx = 0;				// index of the previous frame buffer that will be used for TAA
@@ -426,7 +742,7 @@ private:
 	Buffer* blueNoise = 0;				// blue noise data
 	int2 skySize;						// size of the skydome bitmap
 	RenderParams params;				// CPU-side copy of the renderer parameters
-	Kernel* renderer, * committer;		// render kernel and commit kernel
+	Kernel* renderer = 0, * committer = 0;	// render kernel and commit kernel
 	Kernel* finalizer, * unsharpen;		// TAA finalization kernels
 	Kernel* batchTracer;				// ray batch tracing kernel for inline tracing
 	Kernel* batchToVoidTracer;			// ray batch tracing kernel for inline tracing from solid to void
@@ -438,7 +754,7 @@ private:
 	cl_event ubergridDone;				// for profiling
 	cl_event copyDone, commitDone;		// events for queue synchronization
 	cl_event renderDone;				// event used for profiling
-	float renderTime;					// render time for the previous frame (in seconds)
+	float renderTime = 0;				// render time for the previous frame (in seconds)
 	uint tasks = 0;						// number of changed bricks, to be passed to commit kernel
 	bool copyInFlight = false;			// flag for skipping async copy on first iteration
 	bool commitInFlight = false;		// flag to make next commit wait for previous to complete
@@ -447,6 +763,142 @@ private:
 	Surface* font;						// bitmap font for print command
 	bool firstFrame = true;				// for doing things in the first frame
 	float4 skyLight[6];					// integrated light for the 6 possible normals
+	Surface* cpuTarget = 0;				// cpu renderer output, used when there is no OpenCL device
+	RenderParams cpuParams;				// renderer parameters for the cpu target resolution
+	float4* cpuFrame = 0;				// cpu renderer frame in linear color space, depth in w
+	float4* cpuHistory[2] = { 0 };		// cpu renderer TAA history
+	int2 cpuSize = make_int2( 0 );		// resolution of the cpu renderer buffers
+	int cpuHistIn = 0;					// cpu renderer history buffer that holds the previous frame
+	SpriteJob* spriteJob = 0;			// per-sprite draw / erase jobs, reused every frame
+	uint spriteJobCapacity = 0;			// size of the spriteJob array
+	ParticleJob* particleJob = 0;		// one per part, see RunParticleJobs
+	vector<uint> sweepOrder;			// sprites sorted by x, kept between CollideSprites calls
+	uint particleJobCount = 0;			// size of the particleJob array
+};
+
+// Brick-by-brick access to the voxels in [bmin,bmax), in the memory order of the grid.
+// Each call to Next visits one grid cell; a uniform cell (empty or a single color) can be
+// handled in one step, a brick exposes its voxel memory: voxel (x,y,z) of the brick is at
+// x + y * BRICKDIM + z * BRICKDIM * BRICKDIM, so each row over x is a contiguous span.
+// lo and hi are the part of the brick that overlaps the region, in brick coordinates.
+// Writes require that no other thread writes to the same cells at the same time.
+// Usage: for (BrickIterator it( world, bmin, bmax ); it.Next();) { ... }
+class BrickIterator
+{
+public:
+	BrickIterator( World* world, const int3 bmin, const int3 bmax ) : world( world )
+	{
+		rmin = max( bmin, make_int3( 0 ) ), rmax = min( bmax, make_int3( MAPWIDTH, MAPHEIGHT, MAPDEPTH ) );
+		cmin = make_int3( rmin.x / BRICKDIM, rmin.y / BRICKDIM, rmin.z / BRICKDIM );
+		cmax = make_int3( (rmax.x - 1) / BRICKDIM, (rmax.y - 1) / BRICKDIM, (rmax.z - 1) / BRICKDIM );
+		done = rmin.x >= rmax.x || rmin.y >= rmax.y || rmin.z >= rmax.z;
+		cell = cmin, cell.x--; // first Next moves to cmin
+	}
+	bool Next()
+	{
+		if (done) return false;
+		if (++cell.x > cmax.x)
+		{
+			cell.x = cmin.x;
+			if (++cell.z > cmax.z) { cell.z = cmin.z; if (++cell.y > cmax.y) return done = true, false; }
+		}
+		cellIdx = cell.x + cell.z * GRIDWIDTH + cell.y * GRIDWIDTH * GRIDDEPTH;
+		g = world->grid[cellIdx];
+		origin = cell * BRICKDIM;
+		lo = max( rmin - origin, make_int3( 0 ) ), hi = min( rmax - origin, make_int3( BRICKDIM ) );
+		return true;
+	}
+	// number of cells in the region, and repositioning so that Next visits cell i (for
+	// splitting the region over jobs)
+	uint Cells() const { return done ? 0 : (cmax.x - cmin.x + 1) * (cmax.y - cmin.y + 1) * (cmax.z - cmin.z + 1); }
+	void Seek( const uint i )
+	{
+		const uint nx = cmax.x - cmin.x + 1, nz = cmax.z - cmin.z + 1;
+		cell = make_int3( cmin.x + i % nx - 1, cmin.y + i / (nx * nz), cmin.z + (i / nx) % nz );
+	}
+	bool IsBrick() const { return (g & 1) == 1; }
+	uint BrickIndex() const { return g >> 1; }
+	uint Color() const { return g >> 1; } // color of a uniform cell; 0 is empty
+	bool Covered() const { return lo.x == 0 && lo.y == 0 && lo.z == 0 && hi.x == BRICKDIM && hi.y == BRICKDIM && hi.z == BRICKDIM; }
+	const PAYLOAD* Voxels() const { return IsBrick() ? world->brick + (g >> 1) * BRICKSIZE : 0; }
+	PAYLOAD* BeginWrite();		// turns a uniform cell into a brick; returns its voxels
+	void EndWrite();			// updates the brick summary and marks the brick for the GPU
+	void Fill( const uint v );	// set the overlapping voxels to v; covered cells become uniform
+	int3 cell, origin;			// current grid cell, and its first voxel
+	int3 lo, hi;				// overlap of the region and the current cell, in [0,BRICKDIM]
+private:
+	World* world;
+	int3 rmin, rmax, cmin, cmax;
+	uint cellIdx = 0, g = 0;
+	bool done;
+};
+
+// Sequential access around a voxel position: the grid is only consulted when the cursor
+// leaves the current brick, and column searches skip uniform cells in one step. Voxels
+// outside the world read as empty.
+class VoxelCursor
+{
+public:
+	VoxelCursor( World* world, const int x, const int y, const int z ) : world( world ) { MoveTo( x, y, z ); }
+	VoxelCursor( World* world, const int3 p ) : world( world ) { MoveTo( p.x, p.y, p.z ); }
+	void MoveTo( const int x, const int y, const int z )
+	{
+		pos = make_int3( x, y, z ), voxels = 0, g = 0;
+		if ((uint)x >= MAPWIDTH || (uint)y >= MAPHEIGHT || (uint)z >= MAPDEPTH) return;
+		g = world->grid[x / BRICKDIM + (z / BRICKDIM) * GRIDWIDTH + (y / BRICKDIM) * GRIDWIDTH * GRIDDEPTH];
+		if (g & 1) voxels = world->brick + (g >> 1) * BRICKSIZE;
+	}
+	void Move( const int dx, const int dy, const int dz )
+	{
+		const int3 p = make_int3( pos.x + dx, pos.y + dy, pos.z + dz );
+		if ((((p.x ^ pos.x) | (p.y ^ pos.y) | (p.z ^ pos.z)) & ~(BRICKDIM - 1)) == 0) pos = p; /* same brick */ else MoveTo( p.x, p.y, p.z );
+	}
+	uint Get() const
+	{
+		if (!voxels) return g >> 1;
+		return voxels[(pos.x & (BRICKDIM - 1)) + (pos.y & (BRICKDIM - 1)) * BRICKDIM + (pos.z & (BRICKDIM - 1)) * BRICKDIM * BRICKDIM];
+	}
+	void Set( const uint v ) { world->Set( pos.x, pos.y, pos.z, v ), MoveTo( pos.x, pos.y, pos.z ); }
+	int3 GetPos() const { return pos; }
+	// move down to the first solid voxel at or below the cursor; returns its y, or -1 if
+	// there is none down to minY
+	int FindSolidDown( const int minY = 0 )
+	{
+		while (pos.y >= minY)
+		{
+			const int y0 = pos.y & ~(BRICKDIM - 1);
+			if (!voxels) { if (g >> 1) return pos.y; }
+			else
+			{
+				const PAYLOAD* column = voxels + (pos.x & (BRICKDIM - 1)) + (pos.z & (BRICKDIM - 1)) * BRICKDIM * BRICKDIM;
+				for (int ly = pos.y - y0; ly >= 0 && y0 + ly >= minY; ly--) if (column[ly * BRICKDIM]) return pos.y = y0 + ly;
+			}
+			MoveTo( pos.x, y0 - 1, pos.z );
+		}
+		return -1;
+	}
+	// move up to the first empty voxel at or above the cursor; returns its y, or maxY if
+	// everything up to maxY is solid
+	int FindEmptyUp( const int maxY = MAPHEIGHT )
+	{
+		while (pos.y < maxY)
+		{
+			const int y0 = pos.y & ~(BRICKDIM - 1);
+			if (!voxels) { if ((g >> 1) == 0) return pos.y; }
+			else
+			{
+				const PAYLOAD* column = voxels + (pos.x & (BRICKDIM - 1)) + (pos.z & (BRICKDIM - 1)) * BRICKDIM * BRICKDIM;
+				for (int ly = pos.y - y0; ly < BRICKDIM && y0 + ly < maxY; ly++) if (!column[ly * BRICKDIM]) return pos.y = y0 + ly;
+			}
+			MoveTo( pos.x, y0 + BRICKDIM, pos.z );
+		}
+		return maxY;
+	}
+private:
+	World* world;
+	int3 pos;
+	const PAYLOAD* voxels = 0;	// brick at pos, or 0 for a uniform cell
+	uint g = 0;					// grid cell at pos
 };
 
 } // namespace Tmpl8
\ No newline at end of file
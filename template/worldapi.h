@@ -12,10 +12,13 @@ void Plot( const int3 pos, const uint c );
 uint Read( const int x, const int y, const int z );
 uint Read( const int3 pos );
 uint Read( const uint3 pos );
+int GetSurfaceHeight( const int x, const int z ); // 1 + y of the highest solid voxel, or 0
 void Sphere( const float x, const float y, const float z, const float r, const uint c );
 void Sphere( const float3 pos, const float r, const uint c );
 void Box( const int x1, const int y1, const int z1, const int x2, const int y2, const int z2, const uint c );
 void Box( const int3 pos1, const int3 pos2, const uint c );
+void ReadRegion( const int3 pos, const int3 size, PAYLOAD* data );
+void WriteRegion( const int3 pos, const int3 size, const PAYLOAD* data, const bool skipUnchanged = false );
 void Copy( const int3 s1, const int3 s2, const int3 D );
 void Copy( const int3 s1, const int3 s2, const int x, const int y, const int z );
 void Copy( const int x1, const int y1, const int z1, const int x2, const int y2, const int z2, const int3 D );
@@ -38,10 +41,21 @@ uint CreateParticles( const uint count );
 void SetParticle( const uint set, const uint idx, const int3 pos, const uint v );
 void SetParticle( const uint set, const uint idx, const uint3 pos, const uint v );
 void SetParticle( const uint set, const uint idx, const uint x, const uint y, const uint z, const uint v );
+uint CreateParticleSystem( const uint capacity, const float3 gravity = make_float3( 0 ), const float drag = 0, const bool collide = false );
+bool EmitParticle( const uint set, const float3 pos, const float3 velocity, const uint v, const float life );
+uint EmitSpriteBurst( const uint set, const uint sprite, const float3 velocity, const float3 spread, const float life, const uint stride = 1 );
+void UpdateParticles( const uint set, const float dt = 1 );
 void EnableShadow( const uint idx );
 void DisableShadow( const uint idx );
 void SetSpriteFrame( const uint idx, const uint frame );
 bool SpriteHit( const uint A, const uint B );
+void SetSpriteLayer( const uint idx, const uint layer, const uint mask );
+uint CollideSprites( vector<uint2>& hits, const bool exact = true ); // all colliding sprite pairs
+bool SpriteWorldHit( const uint idx );
+bool SweepSprite( const uint idx, const int3 delta, int3& reached ); // true on impact; reached: last free position
+// unchanged sprites stay in the world during Tick, so Read, GetSurfaceHeight and the
+// queries see them; pass false to erase all sprites before Tick, as before
+void KeepSpritesResident( const bool keep );
 void MoveSpriteTo( const uint idx, const uint x, const uint y, const uint z );
 void MoveSpriteTo( const uint idx, const int3 pos );
 void MoveSpriteTo( const uint idx, const uint3 pos );
@@ -94,5 +108,12 @@ float GetRenderTime();
 Ray* GetBatchBuffer();
 Intersection* TraceBatch( const uint batchSize );
 Intersection* TraceBatchToVoid( const uint batchSize );
+uint NewBatch( const uint maxRays = SCRWIDTH * SCRHEIGHT );
+Ray* GetBatchBuffer( const uint batch );
+void SubmitBatch( const uint batch, const uint batchSize, const bool reorder = false );
+void SubmitBatchToVoid( const uint batch, const uint batchSize, const bool reorder = false );
+bool BatchDone( const uint batch );
+Intersection* GetBatchResults( const uint batch );
+void FreeBatch( const uint batch );
 
 // EOF
\ No newline at end of file